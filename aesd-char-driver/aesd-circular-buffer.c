@@ -36,32 +36,32 @@ struct aesd_buffer_entry *aesd_circular_buffer_find_entry_offset_for_fpos(
     *entry_offset_byte_rtn = 0;
 
     // Check for an empty buffer condition
-    if (buffer->full == false && (buffer->in_offs == buffer->out_offs)) {
+    if (aesd_circular_buffer_count(buffer) == 0) {
         return NULL;
     }
 
-    int total_entries_visited = 0; // To track the number of entries visited
-
-    // Start looking for the specified character offset in the buffer
-    for (int seek_off = buffer->out_offs; 
-         total_entries_visited < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; 
-         total_entries_visited++, seek_off = (seek_off + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED) 
-    {
-        size_t entry_size = buffer->entry[seek_off].size;
+    // The running offsets give the stored size directly, no need to walk the entries
+    if (char_offset >= buffer->total_size) {
+        *entry_offset_byte_rtn = (size_t)-1; // Indicate that no valid entry was found
+        return NULL;
+    }
 
-        if (entry_size <= char_offset) {
-            // Offset exceeds the current entry, move to the next
-            char_offset -= entry_size;
+    // Binary search for the last entry starting at or before char_offset, entries are
+    // ordered by their running offset so this takes O(log n) instead of a walk from out_offs
+    uint32_t low = 0;
+    uint32_t high = aesd_circular_buffer_count(buffer) - 1;
+    while (low < high) {
+        uint32_t middle = low + (high - low + 1) / 2;
+        if (aesd_circular_buffer_entry_start(buffer, middle) <= char_offset) {
+            low = middle;
         } else {
-            // Found the entry containing the requested offset
-            *entry_offset_byte_rtn = char_offset; // This is the position within the found entry
-            return &buffer->entry[seek_off];
+            high = middle - 1;
         }
     }
 
-    // If we get here, the offset was not found in any entry
-    *entry_offset_byte_rtn = (size_t)-1; // Indicate that no valid entry was found
-    return NULL;
+    // Found the entry containing the requested offset
+    *entry_offset_byte_rtn = char_offset - aesd_circular_buffer_entry_start(buffer, low);
+    return &buffer->entry[(buffer->out_offs + low) % buffer->capacity];
 }
 
 /**
@@ -87,12 +87,16 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
     // If buffer is full, prepare to return the oldest entry (currently at out_offs)
     if (buffer->full) {
         retval = buffer->entry[buffer->out_offs].buffptr;
-        buffer->out_offs = (buffer->out_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+        buffer->total_size -= buffer->entry[buffer->out_offs].size;
+        buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
     }
 
     // Advance in_offs and check if we've filled up the buffer
      buffer->entry[buffer->in_offs] = *add_entry;
-    buffer->in_offs = (buffer->in_offs + 1) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    buffer->entry[buffer->in_offs].offset = buffer->added_size;
+    buffer->added_size += add_entry->size;
+    buffer->total_size += add_entry->size;
+    buffer->in_offs = (buffer->in_offs + 1) % buffer->capacity;
 
     // If in_offs catches up with out_offs, the buffer is now full
     if (buffer->in_offs == buffer->out_offs && buffer->full == false ) 
@@ -105,8 +109,99 @@ const char* aesd_circular_buffer_add_entry(struct aesd_circular_buffer *buffer,
 
 /**
 * Initializes the circular buffer described by @param buffer to an empty struct
+* holding up to AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED entries
 */
 void aesd_circular_buffer_init(struct aesd_circular_buffer *buffer)
 {
     memset(buffer,0,sizeof(struct aesd_circular_buffer));
+    buffer->entry = buffer->default_entry;
+    buffer->capacity = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+/**
+* @return the number of entries stored in @param buffer
+*/
+uint32_t aesd_circular_buffer_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return buffer->capacity;
+    }
+    return (buffer->in_offs + buffer->capacity - buffer->out_offs) % buffer->capacity;
+}
+
+/**
+* @return the position of the first byte of the @param index th stored entry of @param buffer,
+* oldest first, in the concatenated contents. index must be below aesd_circular_buffer_count().
+*/
+size_t aesd_circular_buffer_entry_start(const struct aesd_circular_buffer *buffer, uint32_t index)
+{
+    // Unsigned arithmetic stays correct once added_size wraps around
+    return buffer->entry[(buffer->out_offs + index) % buffer->capacity].offset -
+           buffer->entry[buffer->out_offs].offset;
+}
+
+/**
+* Removes the oldest entry of @param buffer, used to enforce a byte budget or before shrinking it.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry for the caller to free, NULL if the buffer is empty
+*/
+const char *aesd_circular_buffer_remove_oldest(struct aesd_circular_buffer *buffer)
+{
+    struct aesd_buffer_entry *oldest;
+    const char *retval;
+
+    if (aesd_circular_buffer_count(buffer) == 0) {
+        return NULL;
+    }
+    oldest = &buffer->entry[buffer->out_offs];
+    retval = oldest->buffptr;
+    buffer->total_size -= oldest->size;
+    // Cleared so AESD_CIRCULAR_BUFFER_FOREACH only sees stored entries
+    oldest->buffptr = NULL;
+    oldest->size = 0;
+    buffer->out_offs = (buffer->out_offs + 1) % buffer->capacity;
+    buffer->full = false;
+    return retval;
+}
+
+/**
+* Removes the oldest entry of @param buffer while it holds more than @param max_entries entries,
+* or more than @param max_bytes bytes (0 for no byte limit) in more than one entry. The newest
+* entry is kept even when it alone is larger than max_bytes.
+* Any necessary locking must be handled by the caller
+* @return the buffptr of the removed entry for the caller to free, NULL once the buffer is within the limits
+*/
+const char *aesd_circular_buffer_remove_over_limit(struct aesd_circular_buffer *buffer,
+            uint32_t max_entries, size_t max_bytes)
+{
+    uint32_t stored_entries = aesd_circular_buffer_count(buffer);
+
+    if (stored_entries > max_entries ||
+        (max_bytes != 0 && buffer->total_size > max_bytes && stored_entries > 1)) {
+        return aesd_circular_buffer_remove_oldest(buffer);
+    }
+    return NULL;
+}
+
+/**
+* Moves the entries of @param buffer, oldest first, to the @param capacity entries at @param entries.
+* The caller first removes the oldest entries until no more than capacity are stored.
+* Any necessary locking must be handled by the caller
+* @return the previous entry array for the caller to free, unless it is buffer->default_entry
+*/
+struct aesd_buffer_entry *aesd_circular_buffer_set_storage(struct aesd_circular_buffer *buffer,
+            struct aesd_buffer_entry *entries, uint32_t capacity)
+{
+    struct aesd_buffer_entry *previous = buffer->entry;
+    uint32_t stored_entries = aesd_circular_buffer_count(buffer);
+
+    for (uint32_t index = 0; index < stored_entries; index++) {
+        entries[index] = buffer->entry[(buffer->out_offs + index) % buffer->capacity];
+    }
+    buffer->entry = entries;
+    buffer->capacity = capacity;
+    buffer->out_offs = 0;
+    buffer->in_offs = stored_entries % capacity;
+    buffer->full = stored_entries == capacity;
+    return previous;
 }
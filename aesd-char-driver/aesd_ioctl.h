@@ -33,14 +33,99 @@ struct aesd_seekto {
     uint32_t write_cmd_offset;
 };
 
+/**
+ * How much the aesdchar device retains, passed by AESDCHAR_IOCSETLIMITS and
+ * returned by AESDCHAR_IOCGETLIMITS. The oldest writes are dropped first.
+ */
+struct aesd_ring_limits {
+    /**
+     * Number of write commands kept, 1 to AESDCHAR_MAX_RING_ENTRIES
+     */
+    uint32_t max_entries;
+    /**
+     * Must be 0
+     */
+    uint32_t reserved;
+    /**
+     * Total bytes kept, up to AESDCHAR_MAX_RING_BYTES, the newest write is always kept;
+     * 0 for no limit
+     */
+    uint64_t max_bytes;
+};
+
+/**
+ * Largest ring capacity accepted by the ring_entries module parameter and AESDCHAR_IOCSETLIMITS
+ */
+#define AESDCHAR_MAX_RING_ENTRIES (1U << 20)
+
+/**
+ * Largest byte budget accepted by the ring_bytes module parameter and AESDCHAR_IOCSETLIMITS
+ */
+#define AESDCHAR_MAX_RING_BYTES (1UL << 30)
+
+/**
+ * Read-only mapping of /dev/aesdchar, available when the module is loaded with mmap_bytes.
+ * The mapping starts with struct aesd_mmap_header and its entry slots, the data ring of
+ * data_size bytes follows at data_offset. Writes are numbered from 0: writes tail to head - 1
+ * are mapped, write n is described by entry[n % entry_slots] and its data starts at byte
+ * offset % data_size of the data ring, wrapping around to its start.
+ * The driver advances tail past a write before overwriting its data, so a consumer reads
+ * head (acquire), uses the entries and data of the writes it wants, then re-reads tail: the
+ * data of any write still at or after tail was intact. Writes larger than the data ring are
+ * skipped.
+ */
+struct aesd_mmap_entry {
+    /**
+     * Bytes of all mapped writes before this one, the position of its data in the data ring
+     */
+    uint64_t offset;
+    /**
+     * Number of bytes of the write
+     */
+    uint64_t size;
+};
+
+struct aesd_mmap_header {
+    /**
+     * AESD_MMAP_MAGIC
+     */
+    uint32_t magic;
+    /**
+     * Number of entries in entry
+     */
+    uint32_t entry_slots;
+    /**
+     * Position of the data ring in the mapping, page aligned
+     */
+    uint64_t data_offset;
+    /**
+     * Size of the data ring
+     */
+    uint64_t data_size;
+    /**
+     * Number of the next write, updated after its entry and data
+     */
+    uint64_t head;
+    /**
+     * Number of the oldest write still mapped, updated before data is overwritten
+     */
+    uint64_t tail;
+    struct aesd_mmap_entry entry[];
+};
+
+#define AESD_MMAP_MAGIC 0xAE5DC0DEU
+
 // Pick an arbitrary unused value from https://github.com/torvalds/linux/blob/master/Documentation/userspace-api/ioctl/ioctl-number.rst
 #define AESD_IOC_MAGIC 0x16
 
 // Define a write command from the user point of view, use command number 1
 #define AESDCHAR_IOCSEEKTO _IOWR(AESD_IOC_MAGIC, 1, struct aesd_seekto)
+// Resize the ring at runtime, needs CAP_SYS_ADMIN
+#define AESDCHAR_IOCSETLIMITS _IOW(AESD_IOC_MAGIC, 2, struct aesd_ring_limits)
+#define AESDCHAR_IOCGETLIMITS _IOR(AESD_IOC_MAGIC, 3, struct aesd_ring_limits)
 /**
  * The maximum number of commands supported, used for bounds checking
  */
-#define AESDCHAR_IOC_MAXNR 1
+#define AESDCHAR_IOC_MAXNR 3
 
 #endif /* AESD_IOCTL_H */
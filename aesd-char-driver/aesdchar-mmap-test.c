@@ -0,0 +1,196 @@
+/**
+ * @file aesdchar-mmap-test.c
+ * @brief User space check of the read-only mapping of /dev/aesdchar
+ *
+ * Writes a few records, then reads them back through the mapping described by
+ * struct aesd_mmap_header and compares them, their sequence numbers and offsets with what
+ * read() returns. Needs the module loaded with mmap_bytes, e.g. ./aesdchar_load mmap_bytes=65536,
+ * and no other writer while it runs.
+ * Usage: aesdchar-mmap-test [device]
+ */
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "aesd_ioctl.h"
+
+#define DEFAULT_DEVICE "/dev/aesdchar"
+#define TEST_WRITES 8
+#define RECORD_LEN 64
+
+static int failures;
+
+#define CHECK(condition, ...) \
+    do { \
+        if (!(condition)) { \
+            fprintf(stderr, "FAIL: " __VA_ARGS__); \
+            fprintf(stderr, "\n"); \
+            failures++; \
+        } \
+    } while (0)
+
+/**
+ * Copies the data of write sequence out of the mapping, following the protocol of
+ * struct aesd_mmap_header.
+ * @return the size of the write, -1 if it is no longer mapped or larger than size
+ */
+static ssize_t copy_mapped_write(const struct aesd_mmap_header *header, uint64_t sequence, char *buf, size_t size)
+{
+    const char *data = (const char *)header + header->data_offset;
+    const struct aesd_mmap_entry *entry;
+    uint64_t head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    uint64_t entry_offset;
+    uint64_t entry_size;
+    size_t position;
+    size_t first;
+
+    if (sequence >= head || sequence < __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    entry = &header->entry[sequence % header->entry_slots];
+    entry_offset = entry->offset;
+    entry_size = entry->size;
+    if (entry_size > size) {
+        return -1;
+    }
+    position = entry_offset % header->data_size;
+    first = entry_size < header->data_size - position ? entry_size : header->data_size - position;
+    memcpy(buf, data + position, first);
+    memcpy(buf + first, data, entry_size - first);
+    // The copy is only valid if the driver did not move tail past this write meanwhile
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (sequence < __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE)) {
+        return -1;
+    }
+    return entry_size;
+}
+
+/**
+ * Reads the whole device from offset 0.
+ * @return a malloc()ed buffer, NULL on failure
+ */
+static char *read_device(int fd, size_t *length)
+{
+    size_t capacity = 4096;
+    char *contents = malloc(capacity);
+    ssize_t bytes_read;
+
+    *length = 0;
+    if (contents == NULL || lseek(fd, 0, SEEK_SET) == -1) {
+        free(contents);
+        return NULL;
+    }
+    while ((bytes_read = read(fd, contents + *length, capacity - *length)) > 0) {
+        *length += bytes_read;
+        if (*length == capacity) {
+            char *grown = realloc(contents, capacity * 2);
+            if (grown == NULL) {
+                free(contents);
+                return NULL;
+            }
+            contents = grown;
+            capacity *= 2;
+        }
+    }
+    if (bytes_read == -1) {
+        free(contents);
+        return NULL;
+    }
+    return contents;
+}
+
+int main(int argc, char **argv)
+{
+    const char *device = argc > 1 ? argv[1] : DEFAULT_DEVICE;
+    char expected[TEST_WRITES][RECORD_LEN];
+    char record[RECORD_LEN];
+    struct aesd_mmap_header *header;
+    size_t mapping_len;
+    size_t contents_len;
+    size_t written_len = 0;
+    uint64_t first;
+    uint64_t head;
+    char *contents;
+
+    int fd = open(device, O_RDWR);
+    if (fd == -1) {
+        fprintf(stderr, "Failed to open %s: %s\n", device, strerror(errno));
+        return 1;
+    }
+
+    // The header tells how much to map
+    header = mmap(NULL, sizeof(struct aesd_mmap_header), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "mmap of %s failed, is the module loaded with mmap_bytes? %s\n", device, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    CHECK(header->magic == AESD_MMAP_MAGIC, "Bad magic %#x", header->magic);
+    mapping_len = header->data_offset + header->data_size;
+    munmap(header, sizeof(struct aesd_mmap_header));
+    header = mmap(NULL, mapping_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "mmap of %zu bytes failed: %s\n", mapping_len, strerror(errno));
+        close(fd);
+        return 1;
+    }
+    CHECK(mmap(NULL, mapping_len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) == MAP_FAILED,
+          "The mapping should be read-only");
+
+    first = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    for (int index = 0; index < TEST_WRITES; index++) {
+        // Writes of different sizes, so offsets and the data ring wrap are exercised
+        int len = snprintf(expected[index], RECORD_LEN, "mmap-test %d %d %.*s\n", (int)getpid(), index,
+                           index * 3, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxx");
+        CHECK(write(fd, expected[index], len) == len, "Write %d failed", index);
+        written_len += len;
+    }
+
+    // Each completed write takes the next sequence number
+    head = __atomic_load_n(&header->head, __ATOMIC_ACQUIRE);
+    CHECK(head == first + TEST_WRITES, "head moved from %llu to %llu for %d writes, is another writer active?",
+          (unsigned long long)first, (unsigned long long)head, TEST_WRITES);
+    CHECK(header->tail <= first, "Writes of this test were dropped, mmap_bytes is too small");
+
+    contents = read_device(fd, &contents_len);
+    CHECK(contents != NULL, "Reading %s failed", device);
+    // read() ends with the writes of this test, in order
+    size_t contents_offset = contents != NULL && contents_len >= written_len ? contents_len - written_len : 0;
+    for (int index = 0; index < TEST_WRITES && head == first + TEST_WRITES; index++) {
+        uint64_t sequence = first + index;
+        ssize_t size = copy_mapped_write(header, sequence, record, sizeof(record));
+        size_t expected_len = strlen(expected[index]);
+
+        CHECK(size == (ssize_t)expected_len, "Write %llu has %zd bytes mapped, %zu written",
+              (unsigned long long)sequence, size, expected_len);
+        if (size != (ssize_t)expected_len) {
+            continue;
+        }
+        CHECK(memcmp(record, expected[index], size) == 0, "Write %llu differs in the mapping",
+              (unsigned long long)sequence);
+        CHECK(contents != NULL && contents_offset + size <= contents_len &&
+              memcmp(record, contents + contents_offset, size) == 0,
+              "Write %llu differs between the mapping and read()", (unsigned long long)sequence);
+        contents_offset += size;
+        if (index > 0) {
+            const struct aesd_mmap_entry *previous = &header->entry[(sequence - 1) % header->entry_slots];
+            CHECK(header->entry[sequence % header->entry_slots].offset == previous->offset + previous->size,
+                  "Write %llu does not start where the previous one ends", (unsigned long long)sequence);
+        }
+    }
+
+    free(contents);
+    munmap(header, mapping_len);
+    close(fd);
+    if (failures != 0) {
+        fprintf(stderr, "%d checks failed\n", failures);
+        return 1;
+    }
+    printf("PASS: %d writes with sequence numbers %llu to %llu match read()\n", TEST_WRITES,
+           (unsigned long long)first, (unsigned long long)(head - 1));
+    return 0;
+}
@@ -25,14 +25,30 @@
 #  define PDEBUG(fmt, args...) /* not debugging: nothing */
 #endif
 
+/*
+ * A write stored in the ring, buffptr of its aesd_buffer_entry points at data.
+ * Readers find it without buffer_lock and hold a reference while copying from it.
+ */
+struct aesd_record
+{
+    refcount_t refs;      /* One held by the ring, one per reader copying data */
+    struct rcu_head rcu;  /* Freed after a grace period, lookups run under rcu_read_lock() */
+    char data[];
+};
+
 struct aesd_dev
 {
     /**
      * TODO: Add structure(s) and locks needed to complete assignment requirements
      */
-struct aesd_buffer_entry  entry;
-struct aesd_circular_buffer buffer;
-struct mutex buffer_lock;
+struct aesd_buffer_entry  entry; /* Write still missing its newline, data of an unpublished aesd_record */
+struct aesd_circular_buffer __rcu *buffer; /* Replaced as a whole when the ring is resized */
+seqcount_mutex_t buffer_seq; /* Bumped by writers around every change of buffer */
+size_t max_bytes;     /* Byte budget of buffer, 0 for none */
+struct aesd_mmap_header *mirror; /* Latest writes mapped read-only by user space, NULL without mmap_bytes */
+char *mirror_data;    /* Data ring of mirror */
+uint64_t mirrored_bytes; /* Bytes ever copied to mirror_data */
+struct mutex buffer_lock; /* Serializes writers only */
     struct cdev cdev;     /* Char device structure      */
 };
 
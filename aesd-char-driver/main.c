@@ -18,6 +18,14 @@
 #include <linux/cdev.h>
 #include <linux/fs.h> // file_operations
 #include <linux/slab.h>
+#include <linux/mm.h> // kvcalloc, vm_area_struct
+#include <linux/vmalloc.h>
+#include <linux/overflow.h>
+#include <linux/version.h>
+#include <linux/capability.h>
+#include <linux/rcupdate.h>
+#include <linux/refcount.h>
+#include <linux/seqlock.h>
 #include <linux/uaccess.h>
 #include "aesdchar.h"
 #include "aesd_ioctl.h"
@@ -30,8 +38,243 @@ int aesd_minor =   0;
 MODULE_AUTHOR("Induja Narayanan"); /** TODO: fill in your name **/
 MODULE_LICENSE("Dual BSD/GPL");
 
+// Initial retention, changed at runtime with AESDCHAR_IOCSETLIMITS
+static unsigned int ring_entries = AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+module_param(ring_entries, uint, 0444);
+MODULE_PARM_DESC(ring_entries, "Number of writes kept by the device (default 10)");
+static unsigned long ring_bytes = 0;
+module_param(ring_bytes, ulong, 0444);
+MODULE_PARM_DESC(ring_bytes, "Bytes kept by the device before the oldest writes are dropped, 0 for no limit");
+static unsigned long mmap_bytes = 0;
+module_param(mmap_bytes, ulong, 0444);
+MODULE_PARM_DESC(mmap_bytes, "Size of the data ring user space can mmap read-only, up to 1 GiB, 0 to disable mmap");
+
+// Entry slots of the mapped ring per byte of its data ring, shorter writes are evicted by slot
+#define AESD_MMAP_BYTES_PER_ENTRY 32
+// Largest mmap_bytes accepted, the mapped ring is vmalloc'd once at load
+#define AESD_MMAP_MAX_BYTES (1UL << 30)
+
 struct aesd_dev aesd_device;
 
+// The record holding the data of a ring entry
+static struct aesd_record *aesd_record_of(const char *buffptr)
+{
+    return (struct aesd_record *)(buffptr - offsetof(struct aesd_record, data));
+}
+
+// Drops a reference to the record of buffptr, the last one frees it after a grace period
+static void aesd_record_put(const char *buffptr)
+{
+    struct aesd_record *record;
+
+    if (buffptr == NULL) {
+        return;
+    }
+    record = aesd_record_of(buffptr);
+    if (refcount_dec_and_test(&record->refs)) {
+        kfree_rcu(record, rcu);
+    }
+}
+
+// The ring as seen by a writer, which holds buffer_lock
+static struct aesd_circular_buffer *aesd_locked_buffer(struct aesd_dev *dev)
+{
+    return rcu_dereference_protected(dev->buffer, lockdep_is_held(&dev->buffer_lock));
+}
+
+/**
+ * Drops the oldest writes until dev->buffer fits dev->max_bytes, always keeping the newest one.
+ * Caller holds dev->buffer_lock, within a buffer_seq write section.
+ */
+static void aesd_enforce_byte_budget(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = aesd_locked_buffer(dev);
+    const char *removed;
+
+    while ((removed = aesd_circular_buffer_remove_over_limit(buffer, buffer->capacity, dev->max_bytes)) != NULL) {
+        aesd_record_put(removed);
+    }
+}
+
+/**
+ * Resizes the ring of dev to max_entries writes and max_bytes bytes, dropping the oldest writes
+ * that no longer fit. Caller holds dev->buffer_lock.
+ * The resized ring is a new struct aesd_circular_buffer, so a reader always sees an entry array
+ * matching the capacity; the old one is freed once no reader can be using it.
+ * @return 0 on success, -EINVAL or -ENOMEM leaving the ring unchanged
+ */
+static int aesd_set_limits(struct aesd_dev *dev, uint32_t max_entries, uint64_t max_bytes)
+{
+    struct aesd_circular_buffer *buffer = aesd_locked_buffer(dev);
+    struct aesd_circular_buffer *resized;
+    struct aesd_buffer_entry *entries;
+    struct aesd_buffer_entry *previous;
+    const char *removed;
+
+    if (max_entries == 0 || max_entries > AESDCHAR_MAX_RING_ENTRIES) {
+        PDEBUG("Error: Invalid ring capacity %u\n", max_entries);
+        return -EINVAL;
+    }
+    if (max_bytes > AESDCHAR_MAX_RING_BYTES) {
+        PDEBUG("Error: Invalid ring byte budget %llu\n", (unsigned long long)max_bytes);
+        return -EINVAL;
+    }
+    if (max_entries != buffer->capacity) {
+        resized = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
+        entries = kvcalloc(max_entries, sizeof(struct aesd_buffer_entry), GFP_KERNEL);
+        if (resized == NULL || entries == NULL) {
+            PDEBUG("Error: Ring allocation failed\n");
+            kfree(resized);
+            kvfree(entries);
+            return -ENOMEM;
+        }
+        write_seqcount_begin(&dev->buffer_seq);
+        while ((removed = aesd_circular_buffer_remove_over_limit(buffer, max_entries, 0)) != NULL) {
+            aesd_record_put(removed);
+        }
+        write_seqcount_end(&dev->buffer_seq);
+
+        *resized = *buffer;
+        previous = aesd_circular_buffer_set_storage(resized, entries, max_entries);
+        write_seqcount_begin(&dev->buffer_seq);
+        rcu_assign_pointer(dev->buffer, resized);
+        write_seqcount_end(&dev->buffer_seq);
+
+        synchronize_rcu();
+        if (previous != buffer->default_entry) {
+            kvfree(previous);
+        }
+        kfree(buffer);
+    }
+    write_seqcount_begin(&dev->buffer_seq);
+    dev->max_bytes = max_bytes;
+    aesd_enforce_byte_budget(dev);
+    write_seqcount_end(&dev->buffer_seq);
+    PDEBUG("Ring holds %u writes, %zu bytes\n", max_entries, dev->max_bytes);
+    return 0;
+}
+
+/**
+ * Allocates the ring mapped by user space, with a data ring of data_size bytes rounded up to
+ * whole pages.
+ * @return 0 on success, -EINVAL when the size overflows, -ENOMEM
+ */
+static int aesd_mirror_init(struct aesd_dev *dev, size_t data_size)
+{
+    struct aesd_mmap_header *header;
+    size_t header_size;
+    size_t total_size;
+    uint32_t slots;
+
+    data_size = PAGE_ALIGN(data_size);
+    slots = min_t(size_t, data_size / AESD_MMAP_BYTES_PER_ENTRY, AESDCHAR_MAX_RING_ENTRIES);
+    header_size = PAGE_ALIGN(struct_size(header, entry, slots));
+    if (check_add_overflow(header_size, data_size, &total_size)) {
+        return -EINVAL;
+    }
+    // Zeroed pages that remap_vmalloc_range() can map
+    header = vmalloc_user(total_size);
+    if (header == NULL) {
+        return -ENOMEM;
+    }
+    header->magic = AESD_MMAP_MAGIC;
+    header->entry_slots = slots;
+    header->data_offset = header_size;
+    header->data_size = data_size;
+    dev->mirror = header;
+    dev->mirror_data = (char *)header + header_size;
+    return 0;
+}
+
+/**
+ * Copies the next write, size bytes of data, to the mapped ring. Caller holds buffer_lock.
+ * With mmap_bytes every write is stored twice: in its kmalloc'd record, which read() and the
+ * lockless readers pin while they copy it out, and here in the vmalloc'd pages user space maps.
+ * The ring cannot live in the mapped pages themselves, a pinned record must outlive its
+ * eviction, so mmap costs a second memcpy per write and up to mmap_bytes more memory.
+ */
+static void aesd_mirror_write(struct aesd_dev *dev, const char *data, size_t size)
+{
+    struct aesd_mmap_header *header = dev->mirror;
+    uint64_t head;
+    uint64_t tail;
+    uint64_t start = dev->mirrored_bytes;
+    size_t position;
+    size_t first;
+
+    if (header == NULL) {
+        return;
+    }
+    head = header->head;
+    tail = header->tail;
+    if (size > header->data_size) {
+        // Does not fit, consumers see every older write dropped and this one skipped
+        WRITE_ONCE(header->tail, head + 1);
+        smp_wmb();
+        WRITE_ONCE(header->head, head + 1);
+        return;
+    }
+
+    // Drop the oldest writes whose slot or data is about to be reused
+    while (tail < head &&
+           (head - tail >= header->entry_slots ||
+            header->entry[tail % header->entry_slots].offset + header->data_size < start + size)) {
+        tail++;
+    }
+    WRITE_ONCE(header->tail, tail);
+    // Consumers see the new tail before any byte of the dropped writes changes
+    smp_wmb();
+
+    position = start % header->data_size;
+    first = min_t(size_t, size, header->data_size - position);
+    memcpy(dev->mirror_data + position, data, first);
+    memcpy(dev->mirror_data, data + first, size - first);
+    header->entry[head % header->entry_slots].offset = start;
+    header->entry[head % header->entry_slots].size = size;
+    // The entry and its data are complete before consumers see the new head
+    smp_wmb();
+    WRITE_ONCE(header->head, head + 1);
+    dev->mirrored_bytes = start + size;
+}
+
+// Frees the ring and the pending write, no reader or writer may be left
+static void aesd_free_buffer(struct aesd_dev *dev)
+{
+    struct aesd_circular_buffer *buffer = rcu_dereference_protected(dev->buffer, 1);
+    struct aesd_buffer_entry *entry;
+    uint32_t index = 0;
+
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, buffer, index) {
+        aesd_record_put(entry->buffptr);
+    }
+    if (buffer->entry != buffer->default_entry) {
+        kvfree(buffer->entry);
+    }
+    kfree(buffer);
+    RCU_INIT_POINTER(dev->buffer, NULL);
+    if (dev->entry.buffptr != NULL) {
+        kfree(aesd_record_of(dev->entry.buffptr));
+        dev->entry.buffptr = NULL;
+    }
+    vfree(dev->mirror);
+    dev->mirror = NULL;
+}
+
+// Reads the stored size without buffer_lock, the buffer keeps it up to date on every add
+static size_t aesd_total_size(struct aesd_dev *dev)
+{
+    unsigned int seq;
+    size_t total_size;
+
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        total_size = rcu_dereference(dev->buffer)->total_size;
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    rcu_read_unlock();
+    return total_size;
+}
+
 int aesd_open(struct inode *inode, struct file *filp)
 {
     PDEBUG("open");
@@ -46,10 +289,36 @@ int aesd_release(struct inode *inode, struct file *filp)
     return 0;
 }
 
+/**
+ * Finds the write holding byte pos of the device without buffer_lock and pins its record.
+ * @return the data of the write, to release with aesd_record_put(), or NULL when pos is past
+ *         the stored data. *size is the size of the write and *offset the position of pos in it.
+ */
+static const char *aesd_get_entry(struct aesd_dev *dev, size_t pos, size_t *size, size_t *offset)
+{
+    struct aesd_buffer_entry *entry;
+    const char *data = NULL;
+    unsigned int seq;
+
+    // A lookup overlapping a write is retried, and the record is pinned with a reference
+    // because copy_to_user() may sleep
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        entry = aesd_circular_buffer_find_entry_offset_for_fpos(rcu_dereference(dev->buffer), pos, offset);
+        if (entry) {
+            data = entry->buffptr;
+            *size = entry->size;
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq) ||
+             (entry && !refcount_inc_not_zero(&aesd_record_of(data)->refs)));
+    rcu_read_unlock();
+    return entry ? data : NULL;
+}
+
 ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
                   loff_t *f_pos)
 {
-    ssize_t retval = 0;
     PDEBUG("read %zu bytes with offset %lld", count, *f_pos);
     
     // Validate input
@@ -59,56 +328,49 @@ ssize_t aesd_read(struct file *filp, char __user *buf, size_t count,
     }
 
     struct aesd_dev *dev = filp->private_data;
+    const char *data;
+    size_t size = 0;
     size_t offset = 0;
     size_t remaining_bytes = 0;
+    size_t not_copied = 0;
+    size_t copied = 0;
 
-    // Lock
-    retval = mutex_lock_interruptible(&dev->buffer_lock);
-    if (retval != 0) {
-        PDEBUG("Error: Unable to acquire mutex");
-        return -ERESTART;
-    }
-
-    struct aesd_buffer_entry *temp = aesd_circular_buffer_find_entry_offset_for_fpos(&dev->buffer, *f_pos, &offset);
-    if (!temp) {
-        PDEBUG("Error: Entry for given position not found");
-        retval = 0;
-        goto unlock;
-    }
+    // Fill as much of buf as is stored, walking on to the following writes
+    while (copied < count) {
+        data = aesd_get_entry(dev, *f_pos, &size, &offset);
+        if (!data) {
+            break;
+        }
 
-    remaining_bytes = temp->size - offset;
-    if (remaining_bytes > count) {
-        remaining_bytes = count; // Prevent overflow
-    }
+        remaining_bytes = size - offset;
+        if (remaining_bytes > count - copied) {
+            remaining_bytes = count - copied; // Prevent overflow
+        }
 
-    retval = copy_to_user(buf, temp->buffptr + offset, remaining_bytes);
-    if (retval != 0) {
-        remaining_bytes -= retval; // Adjust remaining bytes
-        PDEBUG("Error: Copying data to user space failed");
-        retval = -EFAULT;
-        goto unlock;
+        not_copied = copy_to_user(buf + copied, data + offset, remaining_bytes);
+        aesd_record_put(data);
+        remaining_bytes -= not_copied; // Adjust remaining bytes
+        *f_pos += remaining_bytes; // Update position
+        copied += remaining_bytes;
+        if (not_copied != 0) {
+            PDEBUG("Error: Copying data to user space failed");
+            // Report the bytes copied before the fault, if any
+            return copied > 0 ? (ssize_t)copied : -EFAULT;
+        }
     }
-
-    *f_pos += remaining_bytes; // Update position
-    retval = remaining_bytes; // Successfully read this many bytes
-
-unlock:
-    mutex_unlock(&dev->buffer_lock);
-    PDEBUG("Mutex unlocked");
-    return retval;
+    return copied; // Successfully read this many bytes
 }
 
 loff_t aesd_llseek(struct file *filp,loff_t offset,int whence)
 {
     loff_t ret_value;
-    int total_length = 0;
     struct aesd_dev *dev = filp->private_data;
     
     switch(whence)
     {
         case SEEK_SET:
             //Set the file position to the specified offset
-            ret_value = filp->f_pos;
+            ret_value = offset;
             break;
         case SEEK_CUR:
             //Set the file position relative to the current position
@@ -116,22 +378,7 @@ loff_t aesd_llseek(struct file *filp,loff_t offset,int whence)
             break;
         case SEEK_END:
             //Set the file position relative to the end of the buffer
-            // Attempt to acquire the buffer mutex to calculate total buffer length
-            ret_value = mutex_lock_interruptible(&dev->buffer_lock);
-            if(ret_value !=0)
-            {
-                ret_value = -ERESTART;
-                PDEBUG("Error: Unable to do mutex lock");
-                goto exit;
-            }
-            //Calculate the total length 
-            for(int i= dev->buffer.out_offs; i!=dev->buffer.in_offs;)
-            {
-                total_length +=dev->buffer.entry[i].size;
-                i = (i+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-            }
-            mutex_unlock(&dev->buffer_lock);
-            ret_value = total_length-1+offset;
+            ret_value = aesd_total_size(dev) + offset;
             break;
         default:
             ret_value = -EINVAL;
@@ -145,20 +392,77 @@ loff_t aesd_llseek(struct file *filp,loff_t offset,int whence)
 
    
     filp->f_pos = ret_value;
-    PDEBUG("File position seeked to %d",filp->f_pos);
+    PDEBUG("File position seeked to %lld",filp->f_pos);
 
 exit:
     return ret_value;
 }
 
 
+// Handles AESDCHAR_IOCSETLIMITS and AESDCHAR_IOCGETLIMITS
+static long aesd_ioctl_limits(struct aesd_dev *dev, unsigned int cmd, unsigned long arg)
+{
+    struct aesd_ring_limits limits;
+    long ret_value = 0;
+
+    if (cmd == AESDCHAR_IOCSETLIMITS)
+    {
+        // Shrinking the ring discards data of every user of the device
+        if (!capable(CAP_SYS_ADMIN))
+        {
+            return -EPERM;
+        }
+        if (copy_from_user(&limits, (struct aesd_ring_limits __user *)arg, sizeof(limits)))
+        {
+            PDEBUG("Error: Copying from user failed\n");
+            return -EFAULT;
+        }
+        if (limits.reserved != 0)
+        {
+            return -EINVAL;
+        }
+    }
+    if (mutex_lock_interruptible(&dev->buffer_lock) != 0)
+    {
+        PDEBUG("Error: Unable to acquire mutex lock\n");
+        return -ERESTART;
+    }
+    if (cmd == AESDCHAR_IOCSETLIMITS)
+    {
+        ret_value = aesd_set_limits(dev, limits.max_entries, limits.max_bytes);
+    }
+    else
+    {
+        memset(&limits, 0, sizeof(limits));
+        limits.max_entries = aesd_locked_buffer(dev)->capacity;
+        limits.max_bytes = dev->max_bytes;
+    }
+    mutex_unlock(&dev->buffer_lock);
+    if (ret_value == 0 && cmd == AESDCHAR_IOCGETLIMITS &&
+        copy_to_user((struct aesd_ring_limits __user *)arg, &limits, sizeof(limits)))
+    {
+        PDEBUG("Error: Copying to user failed\n");
+        ret_value = -EFAULT;
+    }
+    return ret_value;
+}
+
 long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg) 
 {
      struct aesd_dev *dev = filp->private_data;
     long ret_value = 0;
     struct aesd_seekto seek_params;
-    int total_length = 0;
+    struct aesd_circular_buffer *buffer;
+    bool stored;
+    size_t entry_size = 0;
+    size_t total_length = 0;
+    unsigned int seq;
     PDEBUG("Inside aesd_unlocked_ioctl");
+    if (cmd == AESDCHAR_IOCSETLIMITS || cmd == AESDCHAR_IOCGETLIMITS)
+    {
+        ret_value = aesd_ioctl_limits(dev, cmd, arg);
+        goto exit;
+    }
     //Check if the command is AESDCHAR_IOCSEEKTO
     if (cmd != AESDCHAR_IOCSEEKTO)
     {
@@ -174,44 +478,71 @@ long aesd_unlocked_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
         ret_value = -EFAULT;
         goto exit;
     }
-    //Check if write_cmd exceeds max buffer operations
-    if(seek_params.write_cmd > AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED)
+    //Read the write without buffer_lock, retrying if the ring changed meanwhile
+    rcu_read_lock();
+    do {
+        seq = read_seqcount_begin(&dev->buffer_seq);
+        buffer = rcu_dereference(dev->buffer);
+        stored = seek_params.write_cmd < aesd_circular_buffer_count(buffer);
+        if (stored) {
+            entry_size = buffer->entry[(seek_params.write_cmd+buffer->out_offs)% buffer->capacity].size;
+            // The running offset of the write is the total length of the ones before it
+            total_length = aesd_circular_buffer_entry_start(buffer, seek_params.write_cmd);
+        }
+    } while (read_seqcount_retry(&dev->buffer_seq, seq));
+    rcu_read_unlock();
+
+    //Check if write_cmd is one of the stored writes
+    if(!stored)
     {
         PDEBUG("Error: Invalid command index offset\n");
         ret_value = -EINVAL;
         goto exit; 
     }
-
-    seek_params.write_cmd = (seek_params.write_cmd+dev->buffer.out_offs)% AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    PDEBUG("Write cmd is %d, write cmd offset is %d\n",seek_params.write_cmd,seek_params.write_cmd_offset);
-    if(seek_params.write_cmd_offset > dev->buffer.entry[seek_params.write_cmd].size)
+    PDEBUG("Write cmd is %u, write cmd offset is %u\n",seek_params.write_cmd,seek_params.write_cmd_offset);
+    if(seek_params.write_cmd_offset > entry_size)
     {
         PDEBUG("Error: Invalid command command offset\n");
         ret_value = -EINVAL;
         goto exit; 
     }
-    //Lock mutex
-    ret_value = mutex_lock_interruptible(&dev->buffer_lock);
-    if(ret_value !=0)
-    {
-        PDEBUG("Error: Unable to acquire mutex lock\n");
-        ret_value = -ERESTART;
-        goto exit;
-    }
-    // Calculate the total length
-    for(int i=dev->buffer.out_offs;i!=seek_params.write_cmd;)
-    {
-        total_length+=dev->buffer.entry[i].size;
-        i = (i+1)%AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
-    }
     filp->f_pos = total_length + seek_params.write_cmd_offset;
-    mutex_unlock(&dev->buffer_lock);
-    PDEBUG("Total size is %d",total_length);
-    PDEBUG("File position seeked to %d",filp->f_pos);
+    PDEBUG("Total size is %zu",total_length);
+    PDEBUG("File position seeked to %lld",filp->f_pos);
 exit:
     return ret_value;
 }
 
+// Grows the pending write by size bytes of data, it is kept unchanged on failure
+static int aesd_append_partial(struct aesd_dev *dev, const char *data, size_t size)
+{
+    struct aesd_record *record = dev->entry.buffptr ? aesd_record_of(dev->entry.buffptr) : NULL;
+
+    record = krealloc(record, sizeof(struct aesd_record) + dev->entry.size + size, GFP_KERNEL);
+    if (record == NULL) {
+        return -ENOMEM;
+    }
+    memcpy(record->data + dev->entry.size, data, size);
+    dev->entry.buffptr = record->data;
+    dev->entry.size += size;
+    return 0;
+}
+
+// Adds the completed pending write to the ring, evicting the oldest writes that no longer fit
+static void aesd_publish_partial(struct aesd_dev *dev)
+{
+    // Copied while the record is still ours, the byte budget may drop it once it is added
+    aesd_mirror_write(dev, dev->entry.buffptr, dev->entry.size);
+    refcount_set(&aesd_record_of(dev->entry.buffptr)->refs, 1);
+    write_seqcount_begin(&dev->buffer_seq);
+    aesd_record_put(aesd_circular_buffer_add_entry(aesd_locked_buffer(dev), &dev->entry));
+    aesd_enforce_byte_budget(dev);
+    write_seqcount_end(&dev->buffer_seq);
+
+    dev->entry.size = 0;
+    dev->entry.buffptr = NULL;
+}
+
 ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos) {
     ssize_t retval = -ENOMEM;
     char *ptr_data_from_user_space = NULL;
@@ -253,33 +584,15 @@ ssize_t aesd_write(struct file *filp, const char __user *buf, size_t count, loff
         goto free_and_exit;
     }
 
+    // Readers never see the pending write, only adding it to the ring is a buffer_seq write section
+    retval = aesd_append_partial(dev, ptr_data_from_user_space,
+                                 size_until_new_linechar > 0 ? size_until_new_linechar : count);
+    if (retval != 0) {
+        PDEBUG("Error: Reallocation failed\n");
+        goto free_unlock_exit;
+    }
     if (size_until_new_linechar > 0) {
-        dev->entry.buffptr = krealloc(dev->entry.buffptr, dev->entry.size + size_until_new_linechar, GFP_KERNEL);
-        if (dev->entry.buffptr == NULL) {
-            PDEBUG("Error: Reallocation failed\n");
-            retval = -ENOMEM;
-            goto free_unlock_exit;
-        }
-
-        memcpy(dev->entry.buffptr + dev->entry.size, ptr_data_from_user_space, size_until_new_linechar);
-        dev->entry.size += size_until_new_linechar;
-
-        const char *ret_ptr = aesd_circular_buffer_add_entry(&dev->buffer, &dev->entry);
-        if (ret_ptr) {
-            kfree(ret_ptr);
-        }
-
-        dev->entry.size = 0;
-        dev->entry.buffptr = NULL;
-    } else {
-        dev->entry.buffptr = krealloc(dev->entry.buffptr, dev->entry.size + count, GFP_KERNEL);
-        if (dev->entry.buffptr == NULL) {
-            PDEBUG("Error: Reallocation failed\n");
-            retval = -ENOMEM;
-            goto free_unlock_exit;
-        }
-        memcpy(dev->entry.buffptr + dev->entry.size, ptr_data_from_user_space, count);
-        dev->entry.size += count;
+        aesd_publish_partial(dev);
     }
 
     retval = count;
@@ -292,6 +605,27 @@ free_and_exit:
 }
 
 
+// Maps the mirror of the latest writes, see struct aesd_mmap_header
+static int aesd_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct aesd_dev *dev = filp->private_data;
+
+    if (dev->mirror == NULL) {
+        PDEBUG("Error: mmap needs the mmap_bytes module parameter\n");
+        return -ENODEV;
+    }
+    // Read only, the driver is the only writer of the mapped ring
+    if (vma->vm_flags & VM_WRITE) {
+        return -EPERM;
+    }
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+    vm_flags_clear(vma, VM_MAYWRITE);
+#else
+    vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+    return remap_vmalloc_range(vma, dev->mirror, vma->vm_pgoff);
+}
+
 struct file_operations aesd_fops = {
     .owner =    THIS_MODULE,
     .read =     aesd_read,
@@ -300,6 +634,7 @@ struct file_operations aesd_fops = {
     .release =  aesd_release,
     .llseek = aesd_llseek,
     .unlocked_ioctl = aesd_unlocked_ioctl,
+    .mmap = aesd_mmap,
 };
 
 static int aesd_setup_cdev(struct aesd_dev *dev)
@@ -322,6 +657,7 @@ int aesd_init_module(void)
 {
     dev_t dev = 0;
     int result;
+    struct aesd_circular_buffer *buffer;
     result = alloc_chrdev_region(&dev, aesd_minor, 1,
             "aesdchar");
     aesd_major = MAJOR(dev);
@@ -330,13 +666,46 @@ int aesd_init_module(void)
         return result;
     }
     memset(&aesd_device,0,sizeof(struct aesd_dev));
-	aesd_circular_buffer_init(&aesd_device.buffer);
 	mutex_init(&aesd_device.buffer_lock);
+	seqcount_mutex_init(&aesd_device.buffer_seq, &aesd_device.buffer_lock);
+    buffer = kmalloc(sizeof(struct aesd_circular_buffer), GFP_KERNEL);
+    if (buffer == NULL) {
+        unregister_chrdev_region(dev, 1);
+        return -ENOMEM;
+    }
+	aesd_circular_buffer_init(buffer);
+    RCU_INIT_POINTER(aesd_device.buffer, buffer);
+    // The ring is empty, this only sizes it
+    mutex_lock(&aesd_device.buffer_lock);
+    result = aesd_set_limits(&aesd_device, ring_entries, ring_bytes);
+    mutex_unlock(&aesd_device.buffer_lock);
+    if (result) {
+        printk(KERN_ERR "Invalid ring_entries %u or ring_bytes %lu\n", ring_entries, ring_bytes);
+        aesd_free_buffer(&aesd_device);
+        unregister_chrdev_region(dev, 1);
+        return result;
+    }
+    if (mmap_bytes > AESD_MMAP_MAX_BYTES) {
+        printk(KERN_ERR "Invalid mmap_bytes %lu, at most %lu\n", mmap_bytes, AESD_MMAP_MAX_BYTES);
+        aesd_free_buffer(&aesd_device);
+        unregister_chrdev_region(dev, 1);
+        return -EINVAL;
+    }
+    if (mmap_bytes != 0) {
+        result = aesd_mirror_init(&aesd_device, mmap_bytes);
+        if (result) {
+            printk(KERN_ERR "Failed to allocate %lu bytes for mmap\n", mmap_bytes);
+            aesd_free_buffer(&aesd_device);
+            unregister_chrdev_region(dev, 1);
+            return result;
+        }
+    }
 
 
     result = aesd_setup_cdev(&aesd_device);
 
     if( result ) {
+        aesd_free_buffer(&aesd_device);
         unregister_chrdev_region(dev, 1);
     }
     return result;
@@ -348,13 +717,7 @@ void aesd_cleanup_module(void)
     dev_t devno = MKDEV(aesd_major, aesd_minor);
 
     cdev_del(&aesd_device.cdev);
-struct aesd_buffer_entry *entry;
-uint8_t index = 0;
-AESD_CIRCULAR_BUFFER_FOREACH(entry, &aesd_device.buffer, index){
-if(entry->buffptr != NULL){
-	kfree(entry->buffptr);
-}
-}
+aesd_free_buffer(&aesd_device);
 
 mutex_destroy(&aesd_device.buffer_lock);
 
@@ -0,0 +1,519 @@
+/******************************************************
+# Load generator and latency benchmark for aesdsocket
+# Opens N concurrent connections, sends tagged packets of a fixed
+# size at a configurable rate, validates that every answer contains
+# the packet and only well formed records, and reports throughput and
+# latency percentiles.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <errno.h>
+#include <getopt.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+// Packet layout: "c<client>-<sequence>-" padded with 'x' up to the packet size, newline included
+#define BENCH_TAG_FORMAT "c%06d-%09lu-"
+#define BENCH_TAG_LEN 18
+#define BENCH_MAX_PACKET (1024 * 1024)
+#define BENCH_RECV_CHUNK (64 * 1024)
+
+typedef struct
+{
+    const char *host;
+    const char *port;
+    int connections;
+    unsigned long requests;  // Per connection, ignored when duration_sec is set
+    int duration_sec;
+    size_t packet_size;
+    double rate;             // Requests per second per connection, 0 for closed loop
+    bool keep_alive;         // Server runs with -k -i, every connection is one ordered stream
+} bench_config;
+
+static bench_config config = {
+    .host = "127.0.0.1",
+    .port = "9000",
+    .connections = 8,
+    .requests = 1000,
+    .duration_sec = 0,
+    .packet_size = 64,
+    .rate = 0,
+    .keep_alive = false,
+};
+
+// Accumulates received bytes and hands out complete lines
+typedef struct
+{
+    char *data;
+    size_t len;
+    size_t capacity;
+} line_reader;
+
+typedef struct
+{
+    int id;
+    pthread_t thread;
+    uint64_t *latencies; // Microseconds, one per completed request
+    size_t latency_count;
+    size_t latency_capacity;
+    uint64_t bytes_received;
+    unsigned long errors;  // Connect, send or receive failures
+    unsigned long invalid; // Answers without the packet or with malformed records
+} bench_client;
+
+static uint64_t now_usec(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sleep_until(uint64_t deadline_usec)
+{
+    uint64_t now = now_usec();
+
+    if (deadline_usec > now)
+    {
+        struct timespec delay = {
+            .tv_sec = (deadline_usec - now) / 1000000,
+            .tv_nsec = ((deadline_usec - now) % 1000000) * 1000,
+        };
+        while (nanosleep(&delay, &delay) == -1 && errno == EINTR)
+        {
+        }
+    }
+}
+
+static int connect_server(void)
+{
+    struct addrinfo hints, *result, *address;
+    int fd = -1;
+    int yes = 1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(config.host, config.port, &hints, &result) != 0)
+    {
+        return -1;
+    }
+    for (address = result; address != NULL; address = address->ai_next)
+    {
+        fd = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (fd == -1)
+        {
+            continue;
+        }
+        if (connect(fd, address->ai_addr, address->ai_addrlen) == 0)
+        {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(result);
+    if (fd != -1)
+    {
+        // Packets are small and latency sensitive
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    return fd;
+}
+
+static int send_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, data, len, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+static void format_packet(char *packet, int client, unsigned long sequence)
+{
+    snprintf(packet, BENCH_TAG_LEN + 1, BENCH_TAG_FORMAT, client, sequence);
+    memset(packet + BENCH_TAG_LEN, 'x', config.packet_size - BENCH_TAG_LEN - 1);
+    packet[config.packet_size - 1] = '\n';
+}
+
+// Records written by the server itself, or by any benchmark run regardless of its packet size
+static bool valid_record(const char *line, size_t len)
+{
+    if (len >= 10 && strncmp(line, "timestamp:", 10) == 0)
+    {
+        return true;
+    }
+    if (len <= BENCH_TAG_LEN || line[0] != 'c' || line[7] != '-' || line[17] != '-')
+    {
+        return false;
+    }
+    for (size_t i = BENCH_TAG_LEN; i < len - 1; i++)
+    {
+        if (line[i] != 'x')
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+typedef enum
+{
+    READ_FOUND,     // The expected packet was seen (and EOF reached when waiting for it)
+    READ_NOT_FOUND, // EOF without the expected packet
+    READ_ERROR
+} read_status;
+
+/**
+ * Reads the answer to expected, validating every record on the way. In keep-alive mode
+ * this returns as soon as the packet was seen, otherwise it reads until the server closes.
+ */
+static read_status read_answer(int fd, line_reader *reader, const char *expected, bench_client *client)
+{
+    bool found = false;
+
+    while (true)
+    {
+        // Complete records first, in keep-alive mode some may be left from the last answer
+        size_t start = 0;
+        char *newline;
+        while (!(found && config.keep_alive) && (newline = memchr(reader->data + start, '\n', reader->len - start)) != NULL)
+        {
+            const char *line = reader->data + start;
+            size_t line_len = newline - line + 1;
+            if (!valid_record(line, line_len))
+            {
+                client->invalid++;
+            }
+            else if (!found && memcmp(line, expected, BENCH_TAG_LEN) == 0)
+            {
+                found = true;
+            }
+            start += line_len;
+        }
+        memmove(reader->data, reader->data + start, reader->len - start);
+        reader->len -= start;
+        if (found && config.keep_alive)
+        {
+            return READ_FOUND;
+        }
+
+        if (reader->capacity - reader->len < BENCH_RECV_CHUNK)
+        {
+            size_t capacity = reader->capacity * 2 + BENCH_RECV_CHUNK;
+            char *data = realloc(reader->data, capacity);
+            if (data == NULL)
+            {
+                return READ_ERROR;
+            }
+            reader->data = data;
+            reader->capacity = capacity;
+        }
+        ssize_t received = recv(fd, reader->data + reader->len, reader->capacity - reader->len, 0);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return READ_ERROR;
+        }
+        if (received == 0)
+        {
+            if (reader->len > 0)
+            {
+                // Partial trailing record
+                client->invalid++;
+                reader->len = 0;
+            }
+            return found ? READ_FOUND : READ_NOT_FOUND;
+        }
+        client->bytes_received += received;
+        reader->len += received;
+    }
+}
+
+static void record_latency(bench_client *client, uint64_t latency)
+{
+    if (client->latency_count == client->latency_capacity)
+    {
+        size_t capacity = client->latency_capacity * 2 + 1024;
+        uint64_t *latencies = realloc(client->latencies, capacity * sizeof(uint64_t));
+        if (latencies == NULL)
+        {
+            return;
+        }
+        client->latencies = latencies;
+        client->latency_capacity = capacity;
+    }
+    client->latencies[client->latency_count++] = latency;
+}
+
+static void *client_thread(void *args)
+{
+    bench_client *client = (bench_client *)args;
+    line_reader reader = {0};
+    char *packet = malloc(config.packet_size);
+    uint64_t start = now_usec();
+    uint64_t deadline = start + (uint64_t)config.duration_sec * 1000000;
+    uint64_t interval = config.rate > 0 ? (uint64_t)(1000000 / config.rate) : 0;
+    int fd = -1;
+
+    if (packet == NULL)
+    {
+        client->errors++;
+        return NULL;
+    }
+    for (unsigned long sequence = 0;; sequence++)
+    {
+        if (config.duration_sec > 0 ? now_usec() >= deadline : sequence >= config.requests)
+        {
+            break;
+        }
+        uint64_t sent_at = now_usec();
+        if (interval > 0)
+        {
+            // Open loop: latency counts from the scheduled send time, so a slow answer
+            // also delays the measurements of the requests queued behind it
+            sent_at = start + sequence * interval;
+            sleep_until(sent_at);
+        }
+
+        if (fd == -1 && (fd = connect_server()) == -1)
+        {
+            client->errors++;
+            break;
+        }
+        format_packet(packet, client->id, sequence);
+        read_status status = send_all(fd, packet, config.packet_size) == -1 ? READ_ERROR : read_answer(fd, &reader, packet, client);
+        if (status == READ_FOUND)
+        {
+            record_latency(client, now_usec() - sent_at);
+        }
+        else if (status == READ_NOT_FOUND)
+        {
+            client->invalid++;
+        }
+        else
+        {
+            client->errors++;
+        }
+        if (!config.keep_alive || status != READ_FOUND)
+        {
+            close(fd);
+            fd = -1;
+            reader.len = 0;
+        }
+    }
+    if (fd != -1)
+    {
+        close(fd);
+    }
+    free(reader.data);
+    free(packet);
+    return NULL;
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+    uint64_t left = *(const uint64_t *)a;
+    uint64_t right = *(const uint64_t *)b;
+
+    return left < right ? -1 : left > right;
+}
+
+static uint64_t percentile(const uint64_t *sorted, size_t count, double fraction)
+{
+    size_t index = (size_t)(fraction * count);
+
+    return count == 0 ? 0 : sorted[index >= count ? count - 1 : index];
+}
+
+static void print_usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-H host] [-p port] [-c connections] [-n requests | -d seconds]\n"
+                    "       [-s packet_size] [-r rate] [-k]\n", program);
+    fprintf(stderr, "  -H, --host HOST        server address (default: 127.0.0.1)\n");
+    fprintf(stderr, "  -p, --port PORT        server port (default: 9000)\n");
+    fprintf(stderr, "  -c, --connections N    concurrent connections (default: 8)\n");
+    fprintf(stderr, "  -n, --requests N       requests per connection (default: 1000)\n");
+    fprintf(stderr, "  -d, --duration SEC     run for SEC seconds instead of a request count\n");
+    fprintf(stderr, "  -s, --size BYTES       packet size including the newline (default: 64)\n");
+    fprintf(stderr, "  -r, --rate N           requests per second per connection (default: unlimited)\n");
+    fprintf(stderr, "  -k, --keep-alive       reuse connections, the server must run with -k -i\n");
+}
+
+static bool parse_arguments(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"host", required_argument, NULL, 'H'},
+        {"port", required_argument, NULL, 'p'},
+        {"connections", required_argument, NULL, 'c'},
+        {"requests", required_argument, NULL, 'n'},
+        {"duration", required_argument, NULL, 'd'},
+        {"size", required_argument, NULL, 's'},
+        {"rate", required_argument, NULL, 'r'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    char *end;
+
+    while ((option = getopt_long(argc, argv, "H:p:c:n:d:s:r:kh", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'H':
+            config.host = optarg;
+            break;
+        case 'p':
+            config.port = optarg;
+            break;
+        case 'c':
+            config.connections = strtol(optarg, &end, 10);
+            if (*end != '\0' || config.connections <= 0)
+            {
+                fprintf(stderr, "Invalid connection count %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'n':
+            config.requests = strtoul(optarg, &end, 10);
+            if (*end != '\0' || config.requests == 0)
+            {
+                fprintf(stderr, "Invalid request count %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'd':
+            config.duration_sec = strtol(optarg, &end, 10);
+            if (*end != '\0' || config.duration_sec <= 0)
+            {
+                fprintf(stderr, "Invalid duration %s\n", optarg);
+                return false;
+            }
+            break;
+        case 's':
+            config.packet_size = strtoul(optarg, &end, 10);
+            if (*end != '\0' || config.packet_size <= BENCH_TAG_LEN || config.packet_size > BENCH_MAX_PACKET)
+            {
+                fprintf(stderr, "Packet size must be between %d and %d bytes\n", BENCH_TAG_LEN + 1, BENCH_MAX_PACKET);
+                return false;
+            }
+            break;
+        case 'r':
+            config.rate = strtod(optarg, &end);
+            if (*end != '\0' || config.rate < 0)
+            {
+                fprintf(stderr, "Invalid rate %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'k':
+            config.keep_alive = true;
+            break;
+        default:
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    bench_client *clients;
+    uint64_t *latencies;
+    size_t latency_count = 0;
+    uint64_t bytes_received = 0;
+    unsigned long errors = 0;
+    unsigned long invalid = 0;
+
+    if (!parse_arguments(argc, argv))
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    clients = calloc(config.connections, sizeof(bench_client));
+    if (clients == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    uint64_t start = now_usec();
+    for (int i = 0; i < config.connections; i++)
+    {
+        clients[i].id = i;
+        int err = pthread_create(&clients[i].thread, NULL, client_thread, &clients[i]);
+        if (err != 0)
+        {
+            fprintf(stderr, "Creating client thread failed: %s\n", strerror(err));
+            config.connections = i;
+            break;
+        }
+    }
+    for (int i = 0; i < config.connections; i++)
+    {
+        pthread_join(clients[i].thread, NULL);
+        latency_count += clients[i].latency_count;
+    }
+    double elapsed = (now_usec() - start) / 1e6;
+
+    latencies = malloc((latency_count + 1) * sizeof(uint64_t));
+    if (latencies == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    latency_count = 0;
+    for (int i = 0; i < config.connections; i++)
+    {
+        memcpy(latencies + latency_count, clients[i].latencies, clients[i].latency_count * sizeof(uint64_t));
+        latency_count += clients[i].latency_count;
+        bytes_received += clients[i].bytes_received;
+        errors += clients[i].errors;
+        invalid += clients[i].invalid;
+        free(clients[i].latencies);
+    }
+    qsort(latencies, latency_count, sizeof(uint64_t), compare_latency);
+    uint64_t total = 0;
+    for (size_t i = 0; i < latency_count; i++)
+    {
+        total += latencies[i];
+    }
+
+    printf("connections: %d  packet size: %zu  mode: %s\n", config.connections, config.packet_size,
+           config.keep_alive ? "keep-alive" : "one-shot");
+    printf("requests:    %zu completed, %lu errors, %lu invalid answers\n", latency_count, errors, invalid);
+    printf("duration:    %.3f s\n", elapsed);
+    printf("throughput:  %.1f requests/s, %.2f MB/s received\n", latency_count / elapsed, bytes_received / elapsed / 1e6);
+    printf("latency us:  mean %.1f  p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+           latency_count > 0 ? (double)total / latency_count : 0.0,
+           (unsigned long long)percentile(latencies, latency_count, 0.50),
+           (unsigned long long)percentile(latencies, latency_count, 0.99),
+           (unsigned long long)percentile(latencies, latency_count, 0.999),
+           (unsigned long long)(latency_count > 0 ? latencies[latency_count - 1] : 0));
+    free(latencies);
+    free(clients);
+    return errors > 0 || invalid > 0 ? 1 : 0;
+}
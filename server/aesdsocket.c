@@ -6,6 +6,7 @@
 # 4) Returns the same data back to the client
 # Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
 ******************************************************/
+#define _GNU_SOURCE
 #include <syslog.h>
 #include <signal.h>
 #include <errno.h>
@@ -21,129 +22,121 @@
 #include <stdio.h>
 #include <string.h>
 #include <pthread.h>
-#include <sys/queue.h>
 #include <time.h>
-#include <sys/ioctl.h>
-#include "../aesd-char-driver/aesd_ioctl.h" 
+#include <getopt.h>
+#include <poll.h>
+#include <sched.h>
+#include "aesdsocket.h"
+#include "thread_pool.h"
+#include "replay.h"
+#include "framing.h"
+#include "commit.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+#include "seglog.h"
+#include "memring.h"
+#include "timestamp.h"
+#include "lifecycle.h"
 
 #pragma GCC diagnostic warning "-Wunused-variable"
-#define USE_AESD_CHAR_DEVICE 1
 
-#if USE_AESD_CHAR_DEVICE
-#define SOCKETDATA_FILE "/dev/aesdchar"
-#else
-#define SOCKETDATA_FILE "/var/tmp/aesdsocketdata"
-#endif
-
-#define CLIENT_BUFFER_LEN 1024
 FILE *tmp_file = NULL;
-bool exit_main_loop = false;
-typedef struct
-{
-    int client_fd;
-    int file_fd;
-    struct sockaddr_storage socket_addr;
-} ThreadArgs;
-
-typedef struct thread_Node
-{
-    pthread_t thread_id;
-    SLIST_ENTRY(thread_Node) entry;
-}thread_Node;
-
-// Define the head of the list
-SLIST_HEAD(ThreadList, thread_Node) head = SLIST_HEAD_INITIALIZER(head);
-
+volatile sig_atomic_t exit_main_loop = false;
+aesd_config server_config = {
+    .daemon_mode = false,
+    .mode = AESD_MODE_THREAD,
+    .storage = USE_AESD_CHAR_DEVICE ? AESD_STORAGE_CHARDEV : AESD_STORAGE_FILE,
+    .worker_threads = 0,
+    .queue_depth = 64,
+    .reject_when_full = false,
+    .commit_window_usec = 0,
+    .commit_max_bytes = 1024 * 1024,
+    .keep_alive = false,
+    .idle_timeout_ms = 30000,
+    .incremental_replay = false,
+    .metrics_port = NULL,
+    .listen_backlog = 20,
+    .reuse_port = false,
+    .segment_bytes = 0,
+    .retain_bytes = 0,
+    .ring_records = MEMRING_DEFAULT_RECORDS,
+    .ring_bytes = 0,
+    .timestamp_interval = 10,
+    .drain_timeout_ms = 5000,
+    .handoff_path = NULL,
+};
 // Global mutex for synchronizing access to the file
 pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
-// Global mutex for synchronizing access to the thread nodes
-pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void add_thread_node(pthread_t thread_id)
+// Clients being served by pool workers, shut down when the drain timeout expires
+static struct
 {
-   thread_Node* new_thread_node = malloc(sizeof(thread_Node));
-   if(!new_thread_node)
-   {
-    syslog(LOG_ERR,"Failed to allocate memory for thread node");
-    return;
-   }
-   new_thread_node->thread_id = thread_id;
-   pthread_mutex_lock(&thread_list_mutex);
-   syslog(LOG_INFO,"Inserting thread node");
-   SLIST_INSERT_HEAD(&head,new_thread_node,entry);
-   pthread_mutex_unlock(&thread_list_mutex);
+    pthread_mutex_t lock;
+    int *fds;     // One slot per worker, -1 when free
+    int capacity;
+    bool aborted; // Past the drain timeout, connections are closed without being served
+} active_clients = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
 
-}
-
-void wait_for_all_threads_to_join()
+// @return false when the drain timeout expired and the client must not be served
+static bool track_client(int client_fd)
 {
-    thread_Node* current_thread_node = SLIST_FIRST(&head);
-    thread_Node* next_thread_node;
-    pthread_mutex_lock(&thread_list_mutex);
-    while((current_thread_node != NULL))
+    bool tracked = false;
+
+    pthread_mutex_lock(&active_clients.lock);
+    for (int i = 0; i < active_clients.capacity && !active_clients.aborted; i++)
     {
-        next_thread_node = SLIST_NEXT(current_thread_node,entry);
-        if(pthread_join(current_thread_node->thread_id,NULL)==0)
-        {
-            syslog(LOG_INFO,"Removing the thread node");
-            SLIST_REMOVE(&head,current_thread_node,thread_Node,entry);
-            free(current_thread_node);
-        }
-        else
+        if (active_clients.fds[i] == -1)
         {
-            syslog(LOG_INFO,"Thread %ld was not able to join: %s",current_thread_node->thread_id, strerror(errno));
+            active_clients.fds[i] = client_fd;
+            tracked = true;
+            break;
         }
-        current_thread_node = next_thread_node;
     }
-  
-    pthread_mutex_unlock(&thread_list_mutex);
+    pthread_mutex_unlock(&active_clients.lock);
+    return tracked;
 }
-#if !USE_AESD_CHAR_DEVICE
-void *timestamp_appender(void* args)
-{
-    time_t current_time;
-    struct tm *tm_info;
-    char timestamp[100];
 
-    while(!exit_main_loop)
+// Called before client_fd is closed, so an abort never shuts down a reused descriptor
+static void untrack_client(int client_fd)
+{
+    pthread_mutex_lock(&active_clients.lock);
+    for (int i = 0; i < active_clients.capacity; i++)
     {
-        //Sleep for 10 seconds
-        sleep(10);
-        // Extract timestamp
-        current_time = time(NULL);
-
-        tm_info = localtime(&current_time);
-        if(tm_info==NULL)
+        if (active_clients.fds[i] == client_fd)
         {
-            syslog(LOG_ERR,"Unable to get local time");
+            active_clients.fds[i] = -1;
+            break;
         }
+    }
+    pthread_mutex_unlock(&active_clients.lock);
+}
 
-        //Format the string to RFC 2822
-        if(strftime(timestamp, sizeof(timestamp), "timestamp:%Y-%m-%d %H:%M:%S\n", tm_info)==0)
-        {
-            syslog(LOG_ERR,"strftime failed");
-            continue;
-        }
-        syslog(LOG_INFO,"10s has elapsed saving the time in socketdata file,time is %s",timestamp);
-        //Save the timestamp to socketdata file
-        pthread_mutex_lock(&file_mutex);
-        if(write(((ThreadArgs *)args)->file_fd, timestamp, strlen(timestamp))==-1)
-        {
-            syslog(LOG_INFO,"Timestamp write has failed");
-            pthread_mutex_unlock(&file_mutex);
-            continue;
-        }
-        else
+static bool clients_aborted(void)
+{
+    pthread_mutex_lock(&active_clients.lock);
+    bool aborted = active_clients.aborted;
+    pthread_mutex_unlock(&active_clients.lock);
+    return aborted;
+}
+
+// Wakes workers blocked on a client that stopped reading or sending
+static void abort_active_clients(void)
+{
+    pthread_mutex_lock(&active_clients.lock);
+    active_clients.aborted = true;
+    for (int i = 0; i < active_clients.capacity; i++)
+    {
+        if (active_clients.fds[i] != -1)
         {
-            syslog(LOG_INFO, "Syncing data to the disk");
-            fdatasync(((ThreadArgs *)args)->file_fd);
+            shutdown(active_clients.fds[i], SHUT_RDWR);
         }
-        pthread_mutex_unlock(&file_mutex);
-
     }
-
+    pthread_mutex_unlock(&active_clients.lock);
 }
-#endif
+
 bool create_daemon()
 {
     pid_t pid;
@@ -153,7 +146,7 @@ bool create_daemon()
 
     if (pid < 0)
     {
-        syslog(LOG_ERR, "Fork failed");
+        aesd_log(LOG_ERR, "Fork failed");
         return status;
     }
 
@@ -166,14 +159,14 @@ bool create_daemon()
     // create new group and session
     if (setsid() < 0)
     {
-        syslog(LOG_ERR, "Create new session  failed");
+        aesd_log(LOG_ERR, "Create new session  failed");
         return status;
     }
 
     // Change the working directory to "/"
     if (chdir("/") == -1)
     {
-        syslog(LOG_ERR, "Changing working directory failed");
+        aesd_log(LOG_ERR, "Changing working directory failed");
         return status;
     }
     // Since no files were open in parent, no fds are closed here
@@ -214,176 +207,276 @@ bool create_daemon()
     return true;
 }
 
-void signal_handler(int signal)
+// Stores a packet of a client, in incremental mode AESDCURSOR:N packets move the client's cursor instead
+static int store_client_packet(int file_fd, const line_packet *packet, off_t *cursor)
 {
-    if (signal == SIGINT)
-    {
-        syslog(LOG_INFO, "Caught SIGINT (Ctrl+C), exiting gracefully\n");
-    }
-    else if (signal == SIGTERM)
+    if (server_config.incremental_replay && packet->spill_len == 0 && handle_cursor_command(packet->data, packet->len, cursor))
     {
-        syslog(LOG_INFO, "Caught SIGTERM, exiting gracefully\n");
+        return 0;
     }
-    // Set the global variable so the main server exits gracefully
-    exit_main_loop = true;
+    return store_framed_packet(file_fd, packet, cursor);
 }
 
-void initialize_sigaction()
+int receive_and_store_socket_data(int client_fd, int file_fd, off_t *cursor)
 {
-    struct sigaction sighandle;
-    // Initialize sigaction
-    sighandle.sa_handler = signal_handler;
-    sigemptyset(&sighandle.sa_mask); // Initialize the signal set to empty
-    sighandle.sa_flags = 0;          // No special flags
+    line_framer framer;
+    line_packet packet;
+    int status = 0;
+    bool stored = false;
 
-    // Catch SIGINT
-    if (sigaction(SIGINT, &sighandle, NULL) == -1)
+    framer_init(&framer);
+    while (!stored && status != -1)
     {
-        syslog(LOG_ERR, "Error setting up signal handler SIGINT: %s \n", strerror(errno));
-    }
+        // Receive data from client
+        ssize_t received_no_of_bytes = framer_recv(&framer, client_fd);
+        if (received_no_of_bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received_no_of_bytes <= 0)
+        {
+            // Connection closed or error, keep whatever was received without a newline
+            // unless the server cut the client off
+            if (!clients_aborted() && framer_flush(&framer, &packet) == FRAME_PACKET)
+            {
+                status = store_client_packet(file_fd, &packet, cursor);
+            }
+            break;
+        }
 
-    // Catch SIGTERM
-    if (sigaction(SIGTERM, &sighandle, NULL) == -1)
-    {
-        syslog(LOG_ERR, "Error setting up signal handler SIGINT: %s \n", strerror(errno));
+        // Store every complete packet of this recv, pipelined packets included
+        while (status != -1 && framer_next(&framer, &packet) == FRAME_PACKET)
+        {
+            status = store_client_packet(file_fd, &packet, cursor);
+            stored = true;
+        }
     }
+    framer_release(&framer);
+    return status;
 }
 
-int receive_and_store_socket_data(int client_fd, int file_fd)
+int store_framed_packet(int file_fd, const line_packet *packet, off_t *cursor)
 {
-    char *client_buffer = NULL;
-    size_t total_received = 0;
-    size_t current_size = CLIENT_BUFFER_LEN;
-    size_t multiplication_factor = 1;
-    struct aesd_seekto seek_to; // Struct for AESDCHAR_IOCSEEKTO
-
-    // Dynamically allocate initial buffer
-    client_buffer = (char *)calloc(current_size, sizeof(char));
-    if (client_buffer == NULL)
+    // Oversized packets are never seek commands
+    if (packet->spill_len == 0)
     {
-        syslog(LOG_ERR, "Client buffer allocation failed, returning with error");
-        return -1;
+        return store_socket_packet(file_fd, packet->data, packet->len, cursor);
     }
+    return write_framed_packet(file_fd, packet);
+}
 
-    while (true)
+int write_framed_packet(int file_fd, const line_packet *packet)
+{
+    if (commit_enabled())
     {
-        // Receive data from client
-        ssize_t received_no_of_bytes = recv(client_fd, client_buffer + total_received, current_size - total_received - 1, 0);
-        if (received_no_of_bytes <= 0)
-        {
-            break; // Connection closed or error
-        }
-        total_received += received_no_of_bytes;
-        client_buffer[total_received] = '\0'; // Null-terminate the string
-
-        // Check for newline
-        if (strchr(client_buffer, '\n') != NULL)
-        {
-            break; // Newline found, exit the loop
-        }
-
-        // If we reach this point, we need to resize the buffer
-        multiplication_factor <<= 1;
-        size_t new_size = multiplication_factor * CLIENT_BUFFER_LEN;
-        char *new_buffer = (char *)realloc(client_buffer, new_size);
-        if (new_buffer == NULL)
+        // The writer thread batches this packet with other clients' packets under one fdatasync
+        commit_request request;
+        commit_request_init(&request, packet->data, packet->len);
+        request.spill_fd = packet->spill_fd;
+        request.spill_len = packet->spill_len;
+        if (commit_write(&request) == -1)
         {
-            syslog(LOG_ERR, "Reallocation of client buffer failed, returning with error");
-            free(client_buffer);
+            aesd_log(LOG_ERR, "Writing received data to the socketdata file failed");
             return -1;
         }
-        client_buffer = new_buffer;
-        current_size = new_size;
+        return 0;
     }
+    if (storage_append(file_fd, packet) == -1)
+    {
+        aesd_log(LOG_ERR, "Writing received data to the socketdata file failed");
+        return -1;
+    }
+    return 0;
+}
+
+int handle_seek_command(int file_fd, const char *packet, size_t length, off_t *cursor)
+{
+    struct aesd_seekto seek_to; // Struct for AESDCHAR_IOCSEEKTO
+    char command[64];
+
     // Check if the buffer contains an ioctl command
-    if (strncmp(client_buffer, "AESDCHAR_IOCSEEKTO:", 19) == 0)
+    if (length > 19 && length < sizeof(command) && strncmp(packet, "AESDCHAR_IOCSEEKTO:", 19) == 0)
     {
+        // Packets are not NUL terminated, parse a terminated copy
+        memcpy(command, packet, length);
+        command[length] = '\0';
         // Extract command and offset from the received data
-        if (sscanf(client_buffer + 19, "%u,%u", &seek_to.write_cmd, &seek_to.write_cmd_offset) == 2)
+        if (sscanf(command + 19, "%u,%u", &seek_to.write_cmd, &seek_to.write_cmd_offset) == 2)
         {
-            syslog(LOG_INFO, "Parsed ioctl command AESDCHAR_IOCSEEKTO with command %u, offset %u", seek_to.write_cmd, seek_to.write_cmd_offset);
+            aesd_log(LOG_INFO, "Parsed ioctl command AESDCHAR_IOCSEEKTO with command %u, offset %u", seek_to.write_cmd, seek_to.write_cmd_offset);
 
-            // Perform the ioctl operation
-            if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &seek_to) == -1)
+            if (storage_seek(file_fd, &seek_to, cursor) == -1)
             {
-                syslog(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
-                free(client_buffer);
                 return -1;
             }
-            syslog(LOG_INFO, "Seek operation successful");
 
             // Since this was an ioctl command, skip writing to the file
-            free(client_buffer);
-            return 0;
+            return 1;
         }
         else
         {
-            syslog(LOG_ERR, "Failed to parse AESDCHAR_IOCSEEKTO command and offset");
+            aesd_log(LOG_ERR, "Failed to parse AESDCHAR_IOCSEEKTO command and offset");
         }
     }
+    return 0;
+}
+
+bool handle_cursor_command(const char *packet, size_t length, off_t *cursor)
+{
+    char command[64];
+    char *end;
+
+    if (length <= 11 || length >= sizeof(command) || strncmp(packet, "AESDCURSOR:", 11) != 0)
+    {
+        return false;
+    }
+    memcpy(command, packet, length);
+    // Drop the newline that terminates the packet
+    command[packet[length - 1] == '\n' ? length - 1 : length] = '\0';
+    long long offset = strtoll(command + 11, &end, 10);
+    if (end == command + 11 || *end != '\0' || offset < 0)
+    {
+        aesd_log(LOG_ERR, "Failed to parse AESDCURSOR offset");
+        return false;
+    }
+    *cursor = offset;
+    return true;
+}
+
+int store_socket_packet(int file_fd, const char *packet, size_t length, off_t *cursor)
+{
+    line_packet data = {
+        .data = packet,
+        .len = length,
+        .spill_fd = -1,
+        .spill_len = 0,
+    };
+    int status = handle_seek_command(file_fd, packet, length, cursor);
+
+    if (status != 0)
+    {
+        return status;
+    }
     // Now we have the complete data, store it in the file
-    syslog(LOG_INFO, "Writing received data to the sockedata file");
-    // Lock the mutex before writing to the file
-    pthread_mutex_lock(&file_mutex);
-    if (write(file_fd, client_buffer, total_received) != -1)
+    aesd_log(LOG_DEBUG, "Writing received data to the sockedata file");
+    return write_framed_packet(file_fd, &data);
+}
+
+int return_socketdata_to_client(int client_fd, int file_fd, off_t *offset)
+{
+    replay_state state;
+    replay_status status;
+
+    uint64_t start_usec = metrics_now_usec();
+
+    replay_state_init(&state);
+    state.end = storage_replay_end();
+    // sendfile()/splice() move the data without copying it through user space
+    status = storage_replay(client_fd, file_fd, offset, &state);
+    replay_state_release(&state);
+    metrics_observe_since(METRIC_REPLAY_LATENCY, start_usec);
+    aesd_log(LOG_DEBUG, "Returning from send routine");
+    return status == REPLAY_DONE ? 0 : -1;
+}
+
+// Replays the data from *cursor, which a seek or cursor command may have moved
+static int answer_client(int client_fd, int file_fd, off_t *cursor)
+{
+    off_t offset = *cursor;
+    int status = return_socketdata_to_client(client_fd, file_fd, &offset);
+
+    // The next incremental answer starts where this one ended, otherwise at the beginning
+    if (!server_config.incremental_replay)
     {
-        syslog(LOG_INFO, "Syncing data to the disk");
-        fdatasync(file_fd);
+        *cursor = 0;
     }
-    else
+    else if (status == 0)
     {
-        syslog(LOG_ERR, "Writing received data to the socketdata file failed");
-        pthread_mutex_unlock(&file_mutex); //Unlock mutex before returning from function
-        free(client_buffer);
-        return -1;
+        *cursor = offset;
     }
-    // UnLock the mutex after writing to the file
-    pthread_mutex_unlock(&file_mutex);
-    syslog(LOG_INFO, "Unlocked mutex and returning from write");
-    free(client_buffer);
-    return 0; // Return success
+    return status;
 }
 
-int return_socketdata_to_client(int client_fd, int file_fd)
+// Waits for the next request of a keep-alive client, giving up after the idle timeout or on shutdown
+static bool wait_for_client_data(int client_fd, const line_framer *framer)
 {
-    char *send_buffer;
-    size_t bytes_read;
-    lseek(file_fd, 0, SEEK_SET);
-    send_buffer = (char *)malloc(CLIENT_BUFFER_LEN);
-    if (send_buffer == NULL)
+    // The stop pipe wakes a worker whose client is idle when the server shuts down
+    struct pollfd waited[2] = {
+        {.fd = client_fd, .events = POLLIN},
+        {.fd = lifecycle_stop_fd(), .events = POLLIN},
+    };
+
+    while (true)
     {
-        syslog(LOG_INFO, "Client buffer was not allocated hence returning with error");
-        return -1;
+        // A started request is still completed, abort_active_clients() ends it at the drain deadline
+        if (exit_main_loop && !framer_has_partial(framer))
+        {
+            return false;
+        }
+        int ready = poll(waited, exit_main_loop ? 1 : 2, server_config.idle_timeout_ms);
+        if (ready == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (ready > 0 && !(waited[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        {
+            continue;
+        }
+        return ready > 0;
     }
+}
 
+// Keep-alive: every packet is stored and answered in order before the next one is looked at
+void serve_keep_alive_client(int client_fd, int file_fd, const char *client_ip)
+{
+    line_framer framer;
+    line_packet packet;
+    off_t cursor = 0;
+    int status;
 
-    // Lock the mutex while reading from the file
-    pthread_mutex_lock(&file_mutex);
-    // Read and send data
-    while ((bytes_read = read(file_fd, send_buffer, sizeof(send_buffer) - 1)) > 0)
+    framer_init(&framer);
+    while (true)
     {
-       
-        send_buffer[bytes_read] = '\0';
-        syslog(LOG_ERR, "Send to client is: %s", send_buffer);
-        // Send to client
-        if (send(client_fd, send_buffer, bytes_read, 0) == -1)
+        if (framer_next(&framer, &packet) == FRAME_PACKET)
+        {
+            status = store_client_packet(file_fd, &packet, &cursor);
+            if (status == -1 || answer_client(client_fd, file_fd, &cursor) == -1)
+            {
+                break;
+            }
+            continue;
+        }
+        if (!wait_for_client_data(client_fd, &framer))
+        {
+            aesd_log(LOG_INFO, "Connection from %s idle or server shutting down", client_ip);
+            break;
+        }
+
+        ssize_t received_no_of_bytes = framer_recv(&framer, client_fd);
+        if (received_no_of_bytes == -1 && errno == EINTR)
+        {
+            continue;
+        }
+        if (received_no_of_bytes <= 0)
         {
-            syslog(LOG_ERR, "Send to client failed: %s", strerror(errno));
+            // A last packet without a newline is answered like in the one-shot protocol
+            if (received_no_of_bytes == 0 && !clients_aborted() && framer_flush(&framer, &packet) == FRAME_PACKET)
+            {
+                status = store_client_packet(file_fd, &packet, &cursor);
+                if (status != -1)
+                {
+                    answer_client(client_fd, file_fd, &cursor);
+                }
+            }
             break;
         }
     }
-    //Unlock the mutex after reading from file
-    pthread_mutex_unlock(&file_mutex); 
-    syslog(LOG_INFO, "Unlocked the mutex and returning from send routine");
-    free(send_buffer);
-    return 0;
+    framer_release(&framer);
 }
 
-void *thread_function(void *args)
-
+void thread_function(ThreadArgs *threadArgs)
 {
-    ThreadArgs *threadArgs = (ThreadArgs *)args;
-    char client_ip[INET_ADDRSTRLEN];
+    char client_ip[INET6_ADDRSTRLEN] = "";
     // Convert binary IP address from binary to human readable format
 
     if (threadArgs->socket_addr.ss_family == AF_INET)
@@ -398,45 +491,516 @@ void *thread_function(void *args)
     }
 
     // Log the client ip
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
-    // Receive packets from the client and store in SOCKETDATA_FILE
-    if (receive_and_store_socket_data(threadArgs->client_fd, threadArgs->file_fd) == 0)
+    aesd_log(LOG_INFO, "Accepted connection from %s", client_ip);
+    if (!track_client(threadArgs->client_fd))
     {
-        // Send back the stored data of file back to the client
-        syslog(LOG_INFO, "Sending back the received data to client");
-        return_socketdata_to_client(threadArgs->client_fd, threadArgs->file_fd);
+        aesd_log(LOG_INFO, "Drain timeout expired, closing connection from %s", client_ip);
+        close(threadArgs->client_fd);
+        return;
     }
+    // The driver is opened once per client, the file backend shares one descriptor
+    if (storage_attach(&threadArgs->file_fd) == -1)
+    {
+        untrack_client(threadArgs->client_fd);
+        close(threadArgs->client_fd);
+        return;
+    }
+    metrics_gauge_add(METRIC_ACTIVE_CLIENTS, 1);
+    if (server_config.keep_alive)
+    {
+        serve_keep_alive_client(threadArgs->client_fd, threadArgs->file_fd, client_ip);
+    }
+    else
+    {
+        off_t cursor = 0;
+        // Receive packets from the client and store in SOCKETDATA_FILE
+        int status = receive_and_store_socket_data(threadArgs->client_fd, threadArgs->file_fd, &cursor);
+        if (status != -1)
+        {
+            // Send back the stored data of file back to the client
+            aesd_log(LOG_DEBUG, "Sending back the received data to client");
+            answer_client(threadArgs->client_fd, threadArgs->file_fd, &cursor);
+        }
+    }
+    untrack_client(threadArgs->client_fd);
     if (close(threadArgs->client_fd) == 0)
     {
-        syslog(LOG_INFO, "Closed connection from %s", client_ip);
+        aesd_log(LOG_INFO, "Closed connection from %s", client_ip);
     }
     else
     {
-        syslog(LOG_ERR, "Closing of connection from %s failed", client_ip);
+        aesd_log(LOG_ERR, "Closing of connection from %s failed", client_ip);
     }
-    // Exit from the thread
-   return 0;
+    metrics_gauge_add(METRIC_ACTIVE_CLIENTS, -1);
+    storage_detach(threadArgs->file_fd);
 }
 
-int main(int argc, char **argv)
+void run_thread_pool_server(int socket_fd)
 {
-    struct addrinfo inputs, *server_info;
-    int socket_fd, client_fd;
-    struct sockaddr_storage client_addr;
+    thread_pool pool;
+    ThreadArgs args;
     socklen_t client_addr_size;
-    int file_fd = -1;
+    sigset_t block_mask, orig_mask;
     int status;
+
+    // A listener handed over by an event loop server is still non-blocking
+    int flags = fcntl(socket_fd, F_GETFL, 0);
+    if (flags != -1 && (flags & O_NONBLOCK))
+    {
+        fcntl(socket_fd, F_SETFL, flags & ~O_NONBLOCK);
+    }
+    active_clients.fds = malloc(server_config.worker_threads * sizeof(int));
+    if (active_clients.fds == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate memory for the active clients");
+        return;
+    }
+    for (int i = 0; i < server_config.worker_threads; i++)
+    {
+        active_clients.fds[i] = -1;
+    }
+    active_clients.capacity = server_config.worker_threads;
+
+    // Workers inherit a blocked SIGINT/SIGTERM so blocking calls on their clients are not interrupted
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+    status = thread_pool_init(&pool, server_config.worker_threads, server_config.queue_depth, thread_function);
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    if (status == -1)
+    {
+        aesd_log(LOG_ERR, "Worker pool could not be started");
+        free(active_clients.fds);
+        return;
+    }
+
+    // The acceptor waits on the stop pipe and the timestamp timer next to the listening socket,
+    // poll() skips the timer when it is -1
+    struct pollfd waited[3] = {
+        {.fd = socket_fd, .events = POLLIN},
+        {.fd = lifecycle_stop_fd(), .events = POLLIN},
+        {.fd = timestamp_timer_open(), .events = POLLIN},
+    };
+
+    // Main server loop
+    while (!exit_main_loop)
+    {
+        // Backpressure: leave new connections in the listen backlog until a queue slot frees up
+        if (!server_config.reject_when_full && !thread_pool_wait_for_slot(&pool, 100))
+        {
+            if (waited[2].fd != -1)
+            {
+                timestamp_timer_expired(waited[2].fd);
+            }
+            continue;
+        }
+
+        if (poll(waited, 3, -1) == -1 || (waited[1].revents & POLLIN))
+        {
+            continue;
+        }
+        if (waited[2].revents & POLLIN)
+        {
+            timestamp_timer_expired(waited[2].fd);
+        }
+        if (!(waited[0].revents & POLLIN))
+        {
+            continue;
+        }
+
+        client_addr_size = sizeof(args.socket_addr);
+        args.client_fd = accept(socket_fd, (struct sockaddr *)&args.socket_addr, &client_addr_size);
+        if (args.client_fd == -1)
+        {
+            aesd_log(LOG_ERR, "Error occurred during accept operation: %s \n", strerror(errno));
+            continue;
+        }
+        metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+        // The worker attaches the client to the storage backend
+        args.file_fd = -1;
+
+        if (thread_pool_submit(&pool, &args) == -1)
+        {
+            aesd_log(LOG_ERR, "Worker queue is full, refusing connection");
+            close(args.client_fd);
+        }
+    }
+
+    // Clean up before exiting
+    lifecycle_log_stop();
+    if (waited[2].fd != -1)
+    {
+        close(waited[2].fd);
+    }
+    aesd_log(LOG_INFO, "Waiting for queued connections to be served");
+    if (!thread_pool_drain(&pool, server_config.drain_timeout_ms))
+    {
+        // Workers blocked on a slow client would otherwise hold up the shutdown forever
+        aesd_log(LOG_WARNING, "Drain timeout expired, closing the remaining connections");
+        abort_active_clients();
+    }
+    thread_pool_shutdown(&pool);
+    free(active_clients.fds);
+}
+
+void print_usage(const char *program)
+{
+    fprintf(stderr, "usage: %s [-d] [-m thread|epoll|uring] [--backend file|chardev|memory] [-t threads] [-q depth]\n"
+                    "       [--reject-when-full] [--commit-window usec] [--commit-bytes n] [-k] [--idle-timeout msec]\n"
+                    "       [-i] [--metrics-port port] [-l level] [--backlog n] [--reuseport]\n"
+                    "       [--segment-bytes n] [--retain-bytes n] [--ring-records n] [--ring-bytes n]\n"
+                    "       [--timestamp-interval sec] [--drain-timeout msec] [--handoff path]\n", program);
+    fprintf(stderr, "  -d, --daemon          run as a daemon\n");
+    fprintf(stderr, "  -m, --mode MODE       thread: pool of worker threads (default)\n");
+    fprintf(stderr, "                        epoll: edge triggered epoll reactors\n");
+    fprintf(stderr, "                        uring: io_uring engines, epoll when the kernel lacks support\n");
+    fprintf(stderr, "      --backend NAME    file: %s with timestamps, or the segmented log\n", SOCKETDATA_FILE);
+    fprintf(stderr, "                        chardev: the aesdchar driver at %s\n", AESD_CHAR_DEVICE);
+    fprintf(stderr, "                        memory: the newest records in memory, lost on exit\n");
+    fprintf(stderr, "                        (default: %s)\n", storage_name(server_config.storage));
+    fprintf(stderr, "  -t, --threads N       number of worker or reactor threads\n");
+    fprintf(stderr, "                        (default: 2 per CPU, at least 4, for thread mode; 1 per CPU otherwise)\n");
+    fprintf(stderr, "  -q, --queue-depth N   connections queued for the worker pool (default: 64)\n");
+    fprintf(stderr, "      --reject-when-full close new connections when the queue is full\n");
+    fprintf(stderr, "                        instead of delaying accept()\n");
+    fprintf(stderr, "      --commit-window USEC  time the writer waits to batch more packets into one\n");
+    fprintf(stderr, "                        fdatasync (default: 0, batch whatever queued during the last sync)\n");
+    fprintf(stderr, "      --commit-bytes N  write a batch as soon as N bytes are queued (default: 1048576)\n");
+    fprintf(stderr, "  -k, --keep-alive      answer every packet and keep the connection open for more\n");
+    fprintf(stderr, "      --idle-timeout MSEC  close keep-alive connections idle this long (default: 30000)\n");
+    fprintf(stderr, "  -i, --incremental     answer with the data appended since the client's last answer;\n");
+    fprintf(stderr, "                        an AESDCURSOR:N packet asks for the data from byte N onwards\n");
+    fprintf(stderr, "      --metrics-port PORT  serve Prometheus metrics on PORT (default: off)\n");
+    fprintf(stderr, "  -l, --log-level LEVEL err, warning, notice, info or debug (default: info)\n");
+    fprintf(stderr, "      --backlog N       pending connections per listening socket (default: 20)\n");
+    fprintf(stderr, "      --reuseport       epoll and uring modes: one SO_REUSEPORT listener per thread,\n");
+    fprintf(stderr, "                        each thread pinned to its own CPU\n");
+    fprintf(stderr, "      --segment-bytes N file backend: keep the data in segments of N bytes under\n");
+    fprintf(stderr, "                        %s, kept and recovered across restarts\n", SEGLOG_DIR);
+    fprintf(stderr, "      --retain-bytes N  segmented log: drop the oldest segments while N bytes remain\n");
+    fprintf(stderr, "                        (default: 0, keep everything)\n");
+    fprintf(stderr, "      --ring-records N  memory backend: records kept (default: %d)\n", MEMRING_DEFAULT_RECORDS);
+    fprintf(stderr, "      --ring-bytes N    memory backend: drop the oldest records beyond N bytes\n");
+    fprintf(stderr, "                        (default: 0, only --ring-records applies)\n");
+    fprintf(stderr, "      --timestamp-interval SEC  file backend: store a timestamp record every SEC\n");
+    fprintf(stderr, "                        seconds, 0 for none (default: 10)\n");
+    fprintf(stderr, "      --drain-timeout MSEC  on shutdown, time given to the connections in progress\n");
+    fprintf(stderr, "                        before they are closed (default: 5000)\n");
+    fprintf(stderr, "      --handoff PATH    take the listening sockets over from the server offering them on\n");
+    fprintf(stderr, "                        the Unix socket PATH, then offer them there to the next one\n");
+}
+
+bool parse_arguments(int argc, char **argv)
+{
+    static const struct option long_options[] = {
+        {"daemon", no_argument, NULL, 'd'},
+        {"mode", required_argument, NULL, 'm'},
+        {"backend", required_argument, NULL, 'D'},
+        {"threads", required_argument, NULL, 't'},
+        {"queue-depth", required_argument, NULL, 'q'},
+        {"reject-when-full", no_argument, NULL, 'R'},
+        {"commit-window", required_argument, NULL, 'W'},
+        {"commit-bytes", required_argument, NULL, 'B'},
+        {"keep-alive", no_argument, NULL, 'k'},
+        {"idle-timeout", required_argument, NULL, 'I'},
+        {"incremental", no_argument, NULL, 'i'},
+        {"metrics-port", required_argument, NULL, 'P'},
+        {"log-level", required_argument, NULL, 'l'},
+        {"backlog", required_argument, NULL, 'b'},
+        {"reuseport", no_argument, NULL, 'u'},
+        {"segment-bytes", required_argument, NULL, 'S'},
+        {"retain-bytes", required_argument, NULL, 'r'},
+        {"ring-records", required_argument, NULL, 'N'},
+        {"ring-bytes", required_argument, NULL, 'Z'},
+        {"timestamp-interval", required_argument, NULL, 'T'},
+        {"drain-timeout", required_argument, NULL, 'G'},
+        {"handoff", required_argument, NULL, 'H'},
+        {"help", no_argument, NULL, 'h'},
+        {NULL, 0, NULL, 0}};
+    int option;
+    char *end;
+
+    while ((option = getopt_long(argc, argv, "dm:t:q:kil:h", long_options, NULL)) != -1)
+    {
+        switch (option)
+        {
+        case 'd':
+            server_config.daemon_mode = true;
+            break;
+        case 'm':
+            if (strcmp(optarg, "thread") == 0)
+            {
+                server_config.mode = AESD_MODE_THREAD;
+            }
+            else if (strcmp(optarg, "epoll") == 0)
+            {
+                server_config.mode = AESD_MODE_EPOLL;
+            }
+            else if (strcmp(optarg, "uring") == 0)
+            {
+                server_config.mode = AESD_MODE_URING;
+            }
+            else
+            {
+                fprintf(stderr, "Unknown mode %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'D':
+        {
+            int storage = storage_parse(optarg);
+            if (storage == -1)
+            {
+                fprintf(stderr, "Unknown backend %s\n", optarg);
+                return false;
+            }
+            server_config.storage = storage;
+            break;
+        }
+        case 't':
+            server_config.worker_threads = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.worker_threads <= 0)
+            {
+                fprintf(stderr, "Invalid thread count %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'q':
+            server_config.queue_depth = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.queue_depth <= 0)
+            {
+                fprintf(stderr, "Invalid queue depth %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'R':
+            server_config.reject_when_full = true;
+            break;
+        case 'W':
+            server_config.commit_window_usec = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.commit_window_usec < 0)
+            {
+                fprintf(stderr, "Invalid commit window %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'B':
+            server_config.commit_max_bytes = strtoul(optarg, &end, 10);
+            if (*end != '\0' || server_config.commit_max_bytes == 0)
+            {
+                fprintf(stderr, "Invalid commit batch size %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'k':
+            server_config.keep_alive = true;
+            break;
+        case 'i':
+            server_config.incremental_replay = true;
+            break;
+        case 'P':
+            server_config.metrics_port = optarg;
+            break;
+        case 'l':
+        {
+            int level = log_parse_level(optarg);
+            if (level == -1)
+            {
+                fprintf(stderr, "Unknown log level %s\n", optarg);
+                return false;
+            }
+            log_set_level(level);
+            break;
+        }
+        case 'I':
+            server_config.idle_timeout_ms = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.idle_timeout_ms <= 0)
+            {
+                fprintf(stderr, "Invalid idle timeout %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'T':
+            server_config.timestamp_interval = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.timestamp_interval < 0)
+            {
+                fprintf(stderr, "Invalid timestamp interval %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'G':
+            server_config.drain_timeout_ms = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.drain_timeout_ms < 0)
+            {
+                fprintf(stderr, "Invalid drain timeout %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'H':
+            // The daemon changes to / before it offers the listeners
+            if (optarg[0] != '/')
+            {
+                fprintf(stderr, "--handoff needs an absolute path\n");
+                return false;
+            }
+            server_config.handoff_path = optarg;
+            break;
+        case 'b':
+            server_config.listen_backlog = strtol(optarg, &end, 10);
+            if (*end != '\0' || server_config.listen_backlog <= 0)
+            {
+                fprintf(stderr, "Invalid backlog %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'u':
+            server_config.reuse_port = true;
+            break;
+        case 'S':
+            server_config.segment_bytes = strtoll(optarg, &end, 10);
+            if (*end != '\0' || server_config.segment_bytes <= 0 || server_config.segment_bytes > SEGLOG_MAX_SEGMENT_BYTES)
+            {
+                fprintf(stderr, "Invalid segment size %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'r':
+            server_config.retain_bytes = strtoll(optarg, &end, 10);
+            if (*end != '\0' || server_config.retain_bytes < 0)
+            {
+                fprintf(stderr, "Invalid retention %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'N':
+            server_config.ring_records = strtoul(optarg, &end, 10);
+            if (*end != '\0' || server_config.ring_records == 0)
+            {
+                fprintf(stderr, "Invalid ring size %s\n", optarg);
+                return false;
+            }
+            break;
+        case 'Z':
+            server_config.ring_bytes = strtoul(optarg, &end, 10);
+            if (*end != '\0')
+            {
+                fprintf(stderr, "Invalid ring byte limit %s\n", optarg);
+                return false;
+            }
+            break;
+        default:
+            return false;
+        }
+    }
+
+    // The worker pool has a single acceptor, only event loop threads get a listener each
+    if (server_config.reuse_port && server_config.mode == AESD_MODE_THREAD)
+    {
+        fprintf(stderr, "--reuseport needs -m epoll or -m uring\n");
+        return false;
+    }
+
+    // The driver keeps its own ring of writes
+    if (server_config.storage != AESD_STORAGE_FILE && (server_config.segment_bytes != 0 || server_config.retain_bytes != 0))
+    {
+        fprintf(stderr, "--segment-bytes and --retain-bytes need the file backend\n");
+        return false;
+    }
+    if (server_config.retain_bytes != 0 && server_config.segment_bytes == 0)
+    {
+        fprintf(stderr, "--retain-bytes needs --segment-bytes\n");
+        return false;
+    }
+    if (server_config.storage != AESD_STORAGE_MEMORY &&
+        (server_config.ring_records != MEMRING_DEFAULT_RECORDS || server_config.ring_bytes != 0))
+    {
+        fprintf(stderr, "--ring-records and --ring-bytes need the memory backend\n");
+        return false;
+    }
+
+    if (server_config.worker_threads == 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        if (cpus <= 0)
+        {
+            cpus = 1;
+        }
+        // Workers block on their client for the whole request, so the pool gets a few more threads than cores
+        server_config.worker_threads = server_config.mode != AESD_MODE_THREAD ? cpus : (cpus * 2 < 4 ? 4 : cpus * 2);
+    }
+    return true;
+}
+
+void bind_thread_to_cpu(pthread_t thread_id, int index)
+{
+    cpu_set_t allowed, target;
+    int count;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1 || (count = CPU_COUNT(&allowed)) == 0)
+    {
+        aesd_log(LOG_WARNING, "Could not read the CPU affinity mask: %s", strerror(errno));
+        return;
+    }
+    // The index-th allowed CPU, so restricted cpusets are respected
+    index %= count;
+    CPU_ZERO(&target);
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && index-- == 0)
+        {
+            CPU_SET(cpu, &target);
+            break;
+        }
+    }
+    int err = pthread_setaffinity_np(thread_id, sizeof(target), &target);
+    if (err != 0)
+    {
+        aesd_log(LOG_WARNING, "Could not pin thread to a CPU: %s", strerror(err));
+    }
+}
+
+/**
+ * Creates a socket bound to the server address. With --reuseport every call returns another
+ * socket of the same SO_REUSEPORT group and the kernel spreads new connections over them.
+ * @return the socket, -1 on error
+ */
+static int open_listener(const struct addrinfo *server_info)
+{
     int yes = 1;
-    bool daemon_mode = false;
 
-    // Check if the application to be run in daemon mode
-    if ((argc >= 2) && (strcmp(argv[1], "-d") == 0))
+    // Open a stream socket
+    int socket_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
+    if (socket_fd == -1)
     {
-        daemon_mode = true;
+        aesd_log(LOG_ERR, "Error occurred while creating a socket: %s\n", strerror(errno));
+        return -1;
     }
 
-    // Open a system logger connection for aesdsocket utility
-    openlog("aesdsocket", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+    // Set socket options
+    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        (server_config.reuse_port && setsockopt(socket_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes)) == -1))
+    {
+        aesd_log(LOG_ERR, "Error occurred while setting a socket option: %s \n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+
+    if (bind(socket_fd, server_info->ai_addr, server_info->ai_addrlen) == -1)
+    {
+        aesd_log(LOG_ERR, "Error occurred while binding a socket: %s \n", strerror(errno));
+        close(socket_fd);
+        return -1;
+    }
+    return socket_fd;
+}
+
+// Creates the listening sockets on port 9000, one per event loop thread with --reuseport
+static int *open_listeners(int *count)
+{
+    struct addrinfo inputs, *server_info;
+    int *listen_fds;
+    int status;
 
     /*Line  was partly referred from https://beej.us/guide/bgnet/html/#socket */
     memset(&inputs, 0, sizeof(inputs));
@@ -447,150 +1011,177 @@ int main(int argc, char **argv)
     // Get address info
     if ((status = getaddrinfo(NULL, "9000", &inputs, &server_info)) != 0)
     {
-        syslog(LOG_ERR, "Error occurred while getting the address info: %s \n", gai_strerror(status));
-        closelog();
-        exit(1);
+        aesd_log(LOG_ERR, "Error occurred while getting the address info: %s \n", gai_strerror(status));
+        return NULL;
     }
 
-    // Open a stream socket
-    socket_fd = socket(server_info->ai_family, server_info->ai_socktype, server_info->ai_protocol);
-    if (socket_fd == -1)
+    *count = server_config.reuse_port ? server_config.worker_threads : 1;
+    listen_fds = calloc(*count, sizeof(int));
+    if (listen_fds == NULL)
     {
-        syslog(LOG_ERR, "Error occurred while creating a socket: %s\n", strerror(errno));
+        aesd_log(LOG_ERR, "Failed to allocate memory for listening sockets");
         freeaddrinfo(server_info);
-        closelog();
-        exit(1);
+        return NULL;
+    }
+    for (int i = 0; i < *count; i++)
+    {
+        listen_fds[i] = open_listener(server_info);
+        if (listen_fds[i] == -1)
+        {
+            // The sockets already bound would keep the port taken
+            while (i-- > 0)
+            {
+                close(listen_fds[i]);
+            }
+            free(listen_fds);
+            freeaddrinfo(server_info);
+            return NULL;
+        }
     }
+    freeaddrinfo(server_info);
+    return listen_fds;
+}
 
-    // Set socket options
-    if (setsockopt(socket_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1)
+int main(int argc, char **argv)
+{
+    int *listen_fds = NULL;
+    int listen_count = 0;
+    int took_over = 0;
+
+    // Check if the application to be run in daemon mode and how clients are served
+    if (!parse_arguments(argc, argv))
     {
-        syslog(LOG_ERR, "Error occurred while setting a socket option: %s \n", strerror(errno));
-        freeaddrinfo(server_info);
-        closelog();
+        print_usage(argv[0]);
         exit(1);
     }
 
-    if (bind(socket_fd, server_info->ai_addr, server_info->ai_addrlen) == -1)
+    // Open a system logger connection for aesdsocket utility
+    openlog("aesdsocket", LOG_CONS | LOG_PID | LOG_PERROR, LOG_USER);
+
+    // A server already running on the handoff socket passes its listeners, no connection is refused
+    if (server_config.handoff_path != NULL)
     {
-        syslog(LOG_ERR, "Error occurred while binding a socket: %s \n", strerror(errno));
-        freeaddrinfo(server_info);
-        closelog();
-        exit(1);
+        took_over = lifecycle_take_over(server_config.handoff_path, &listen_fds, &listen_count);
+        if (took_over == -1)
+        {
+            closelog();
+            exit(1);
+        }
+    }
+    if (took_over == 0)
+    {
+        listen_fds = open_listeners(&listen_count);
+        if (listen_fds == NULL)
+        {
+            closelog();
+            exit(1);
+        }
+    }
+    else if (server_config.mode == AESD_MODE_THREAD && listen_count > 1)
+    {
+        aesd_log(LOG_WARNING, "The worker pool accepts from one of the %d listeners it took over", listen_count);
     }
 
     // Check if daemon needs to be created
-    if (daemon_mode)
+    if (server_config.daemon_mode)
     {
         if (!create_daemon())
         {
-            syslog(LOG_ERR, "Daemon creation failed, hence exiting");
-            freeaddrinfo(server_info);
+            aesd_log(LOG_ERR, "Daemon creation failed, hence exiting");
             closelog();
             exit(1);
         }
     }
 
-    if (listen(socket_fd, 20) == -1)
+    // Listeners taken over are listening already, listen() only applies our backlog
+    for (int i = 0; i < listen_count; i++)
     {
-        syslog(LOG_ERR, "Error occurred during listen operation: %s \n", strerror(errno));
-        freeaddrinfo(server_info);
+        if (listen(listen_fds[i], server_config.listen_backlog) == -1)
+        {
+            aesd_log(LOG_ERR, "Error occurred during listen operation: %s \n", strerror(errno));
+            closelog();
+            exit(1);
+        }
+    }
+
+    // After daemonizing, the logger thread would not survive the fork
+    if (log_start() == -1)
+    {
+        aesd_log(LOG_ERR, "Logger thread could not be started, logging synchronously");
+    }
+
+    if (lifecycle_init() == -1)
+    {
+        log_stop();
         closelog();
         exit(1);
     }
 
-    initialize_sigaction();
-    client_addr_size = sizeof(client_addr);
+    // The previous server still writes its data and holds the metrics port until it is done
+    if (took_over == 1 && !lifecycle_wait_for_predecessor())
+    {
+        aesd_log(LOG_INFO, "Stopped before the previous server was done");
+        log_stop();
+        closelog();
+        exit(1);
+    }
 
-    // Conditionally create a timer thread only if timestamping is enabled (i.e., when not using aesdchar)
-#if !USE_AESD_CHAR_DEVICE
-    pthread_t TimerthreadId;
-    ThreadArgs *timerargs = malloc(sizeof(ThreadArgs));
-    if (timerargs == NULL)
+    if (server_config.metrics_port != NULL && metrics_start(server_config.metrics_port) == -1)
     {
-        syslog(LOG_ERR, "Failed to allocate memory for thread arguments");
+        aesd_log(LOG_ERR, "Metrics endpoint could not be started, continuing without it");
     }
-    else
+
+    if (storage_open() == -1)
     {
-        // Open the file for writing data and timestamps
-        file_fd = open(SOCKETDATA_FILE, O_RDWR | O_CREAT | O_TRUNC, 0666);
-        if (file_fd == -1)
-        {
-            syslog(LOG_ERR, "Open/create of %s failed", SOCKETDATA_FILE);
-            freeaddrinfo(server_info);
-            closelog();
-            exit(1);
-        }
-        timerargs->file_fd = file_fd;
-        int err = pthread_create(&TimerthreadId, NULL, timestamp_appender, (void *)timerargs);
-        if (err != 0)
-        {
-            syslog(LOG_ERR, "Error creating timer thread: %s", strerror(err));
-            free(timerargs);
-        }
+        log_stop();
+        closelog();
+        exit(1);
     }
-#endif
 
-    // Main server loop
-    while (!exit_main_loop)
+    if (server_config.handoff_path != NULL &&
+        lifecycle_offer_listeners(server_config.handoff_path, listen_fds, listen_count) == -1)
     {
-        client_fd = accept(socket_fd, (struct sockaddr *)&client_addr, &client_addr_size);
-        if (client_fd == -1)
-        {
-            syslog(LOG_ERR, "Error occurred during accept operation: %s \n", strerror(errno));
-            continue;
-        }
+        aesd_log(LOG_ERR, "Listening sockets cannot be handed over, continuing without it");
+    }
 
-        pthread_t threadId;
-        ThreadArgs *args = malloc(sizeof(ThreadArgs));
-        if (args == NULL)
+    if (server_config.mode == AESD_MODE_URING)
+    {
+        int engine_status = run_uring_server(listen_fds, listen_count);
+        if (engine_status == 1)
         {
-            syslog(LOG_ERR, "Failed to allocate memory for thread arguments");
-            close(client_fd);
-            continue;
+            aesd_log(LOG_WARNING, "io_uring is not available, falling back to the epoll reactor");
+            server_config.mode = AESD_MODE_EPOLL;
         }
-
-        args->client_fd = client_fd;
-        args->socket_addr = client_addr;
-
-#if USE_AESD_CHAR_DEVICE
-        // Open file descriptor for /dev/aesdchar only when a client connects
-        args->file_fd = open(SOCKETDATA_FILE, O_RDWR);
-        if (args->file_fd == -1)
+        else if (engine_status == -1)
         {
-            syslog(LOG_ERR, "Failed to open %s", SOCKETDATA_FILE);
-            close(client_fd);
-            free(args);
-            continue;
+            aesd_log(LOG_ERR, "io_uring engine could not be started");
         }
-#else
-        // Use already opened file descriptor
-        args->file_fd = file_fd;
-#endif
+    }
 
-        syslog(LOG_INFO, "Creating a new thread");
-        int err = pthread_create(&threadId, NULL, thread_function, (void *)args);
-        if (err != 0)
+    if (server_config.mode == AESD_MODE_EPOLL)
+    {
+        if (run_epoll_reactor(listen_fds, listen_count) == -1)
         {
-            syslog(LOG_ERR, "Error creating thread: %s", strerror(err));
-            close(client_fd);
-            free(args);
-            continue;
+            aesd_log(LOG_ERR, "Epoll reactor could not be started");
         }
-
-        add_thread_node(threadId);
-        wait_for_all_threads_to_join();
     }
 
-    // Clean up before exiting
-    syslog(LOG_ERR, "Waiting for active threads to join");
-    wait_for_all_threads_to_join();
+    if (server_config.mode == AESD_MODE_THREAD)
+    {
+        run_thread_pool_server(listen_fds[0]);
+    }
 
-    close(file_fd);
-    // Remove the temporary file if it exists
-    unlink(SOCKETDATA_FILE);
+    // Every client is done, flush what is still queued and close the data
+    storage_close();
+    metrics_stop();
+    // Only now may a server that took the listeners over start serving
+    lifecycle_finish();
+    for (int i = 0; i < listen_count; i++)
+    {
+        close(listen_fds[i]);
+    }
+    free(listen_fds);
 
-    syslog(LOG_INFO, "Deleted the temporary socket data file before exiting.");
-    freeaddrinfo(server_info);
+    log_stop();
     closelog();
 }
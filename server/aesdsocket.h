@@ -0,0 +1,121 @@
+/******************************************************
+# Shared definitions for the aesdsocket server modules
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef AESDSOCKET_H
+#define AESDSOCKET_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include "framing.h"
+#include "storage.h"
+
+// Only picks the backend used when --backend is not given
+#ifndef USE_AESD_CHAR_DEVICE
+#define USE_AESD_CHAR_DEVICE 1
+#endif
+
+#define AESD_CHAR_DEVICE "/dev/aesdchar"
+#define SOCKETDATA_FILE "/var/tmp/aesdsocketdata"
+
+#define CLIENT_BUFFER_LEN 1024
+
+// How accepted connections are served
+typedef enum
+{
+    AESD_MODE_THREAD, // A fixed pool of worker threads serves queued connections
+    AESD_MODE_EPOLL,  // Edge triggered epoll reactors multiplex non-blocking clients
+    AESD_MODE_URING   // io_uring engines batch accepts, receives and polls per system call
+} aesd_server_mode;
+
+// Startup configuration, filled in from the command line in main()
+typedef struct
+{
+    bool daemon_mode;
+    aesd_server_mode mode;
+    aesd_storage storage;  // Backend the data is stored in
+    int worker_threads;    // Number of pool workers or epoll reactors
+    int queue_depth;       // Accepted connections waiting for a pool worker
+    bool reject_when_full; // Close new connections instead of delaying accept() when the queue is full
+    long commit_window_usec;  // Group commit: time the writer waits to grow a batch
+    size_t commit_max_bytes;  // Group commit: a batch is written once this many bytes are queued
+    bool keep_alive;          // Answer every packet and keep the connection open for the next one
+    int idle_timeout_ms;      // Keep-alive connections without traffic for this long are closed
+    bool incremental_replay;  // Answer with the data appended since the client's cursor only
+    const char *metrics_port; // Port of the metrics endpoint, NULL when disabled
+    int listen_backlog;       // Backlog passed to listen() for every listening socket
+    bool reuse_port;          // One SO_REUSEPORT listener per event loop thread, pinned to a CPU
+    off_t segment_bytes;      // File backend: size of the segments of the data log, 0 for a single file
+    off_t retain_bytes;       // File backend: bytes of old segments kept, 0 keeps every segment
+    size_t ring_records;      // Memory backend: records kept
+    size_t ring_bytes;        // Memory backend: bytes kept, 0 for no limit besides ring_records
+    int timestamp_interval;   // Seconds between timestamp records of backends that store them, 0 for none
+    int drain_timeout_ms;     // On shutdown, time the connections in progress get to finish
+    const char *handoff_path; // Unix socket the listening sockets are handed over on, NULL when disabled
+} aesd_config;
+
+extern aesd_config server_config;
+// Set from the signal handler when the server should shut down
+extern volatile sig_atomic_t exit_main_loop;
+// Serializes writers of the data; file backend replays read the durable length instead, chardev replays hold it
+extern pthread_mutex_t file_mutex;
+
+/**
+ * Stores one newline terminated packet received from a client.
+ * AESDCHAR_IOCSEEKTO:X,Y packets move *cursor, see handle_seek_command().
+ * @return 0 when the packet was written, 1 when a seek was performed, -1 on error
+ */
+int store_socket_packet(int file_fd, const char *packet, size_t length, off_t *cursor);
+
+/**
+ * Handles an AESDCHAR_IOCSEEKTO:X,Y command, byte Y of write command X, see storage_seek().
+ * *cursor receives the offset the client's next replay starts from.
+ * @return 1 when a seek was performed, 0 when the packet is not a seek command, -1 on error
+ */
+int handle_seek_command(int file_fd, const char *packet, size_t length, off_t *cursor);
+
+/**
+ * Parses an AESDCURSOR:N packet, which asks for the data from byte offset N onwards
+ * in incremental replay mode.
+ * @return true and the offset in *cursor when the packet is a cursor command
+ */
+bool handle_cursor_command(const char *packet, size_t length, off_t *cursor);
+
+/**
+ * Appends a packet to the data without checking for commands, through the group commit
+ * writer when it is running.
+ * @return 0 on success, -1 on error
+ */
+int write_framed_packet(int file_fd, const line_packet *packet);
+
+/**
+ * Stores a packet produced by the line framer, oversized packets included.
+ * @return same values as store_socket_packet()
+ */
+int store_framed_packet(int file_fd, const line_packet *packet, off_t *cursor);
+
+/**
+ * Pins an event loop thread to the index-th CPU the process may run on, wrapping around
+ * when there are more threads than CPUs. Failures are logged and otherwise ignored.
+ */
+void bind_thread_to_cpu(pthread_t thread_id, int index);
+
+/**
+ * Serves clients with server_config.worker_threads epoll reactors until exit_main_loop
+ * is set. Reactor i accepts from listen_fds[i % listen_count].
+ * @return 0 on clean shutdown, -1 when the reactors could not be started
+ */
+int run_epoll_reactor(const int *listen_fds, int listen_count);
+
+/**
+ * Serves clients with server_config.worker_threads io_uring engines until exit_main_loop
+ * is set. Engine i accepts from listen_fds[i % listen_count].
+ * @return 0 on clean shutdown, 1 when the kernel lacks io_uring support and nothing was
+ *         served yet, -1 when the engines could not be started
+ */
+int run_uring_server(const int *listen_fds, int listen_count);
+
+#endif /* AESDSOCKET_H */
@@ -0,0 +1,463 @@
+/******************************************************
+# Group commit writer for the aesdsocket data file
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <syslog.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "aesdsocket.h"
+#include "commit.h"
+#include "metrics.h"
+#include "seglog.h"
+#include "log.h"
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+#define COMMIT_COPY_CHUNK (64 * 1024)
+
+STAILQ_HEAD(CommitQueue, commit_request);
+
+static struct
+{
+    pthread_t thread_id;
+    pthread_mutex_t lock;
+    pthread_cond_t queued;    // Signalled when requests are added or the writer should stop
+    pthread_cond_t committed; // Broadcast after every batch for commit_write() callers
+    struct CommitQueue queue;
+    size_t queued_bytes;
+    int file_fd;
+    long window_usec;
+    size_t max_bytes;
+    bool running;
+    bool stop;
+} committer = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .queued = PTHREAD_COND_INITIALIZER,
+    .committed = PTHREAD_COND_INITIALIZER,
+    .queue = STAILQ_HEAD_INITIALIZER(committer.queue),
+    .file_fd = -1,
+};
+
+// Only ever grows, readers snapshot it instead of holding file_mutex for the whole replay
+static _Atomic off_t durable_length;
+// End of the records reported by the serialized writer, durable or not
+static off_t appended_length;
+
+static int write_all(int fd, const char *data, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t written = write(fd, data, len);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+    }
+    return 0;
+}
+
+static int writev_all(int fd, struct iovec *iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t written = writev(fd, iov, count);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        // Skip fully written vectors and trim a partially written one
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int copy_spill(int file_fd, const commit_request *request, char *chunk)
+{
+    off_t copied = 0;
+
+    while (copied < request->spill_len)
+    {
+        ssize_t bytes_read = pread(request->spill_fd, chunk, COMMIT_COPY_CHUNK, copied);
+        if (bytes_read <= 0 || write_all(file_fd, chunk, bytes_read) == -1)
+        {
+            return -1;
+        }
+        copied += bytes_read;
+    }
+    return 0;
+}
+
+// Writes the queued vectors, then reports the records they end so the index only covers written data
+static int write_queued(int fd, struct iovec *iov, const off_t *record_lens, int *count, off_t *queued_len)
+{
+    if (writev_all(fd, iov, *count) == -1)
+    {
+        return -1;
+    }
+    for (int i = 0; i < *count; i++)
+    {
+        commit_record_appended(record_lens[i]);
+    }
+    *count = 0;
+    *queued_len = 0;
+    return 0;
+}
+
+// Writes the batch in queue order, collecting in-memory packets into as few writev() calls as possible
+static int write_batch(struct CommitQueue *batch, char **chunk)
+{
+    struct iovec iov[IOV_MAX];
+    off_t record_lens[IOV_MAX]; // Length of the record each vector ends
+    off_t queued_len = 0;
+    int count = 0;
+    int fd = committer.file_fd;
+    commit_request *request;
+
+    STAILQ_FOREACH(request, batch, entry)
+    {
+        off_t record_len = request->spill_len + request->len;
+        // With the segmented log a record may start a new segment file, which indexes the old one
+        if (count > 0 && commit_append_rotates(queued_len, record_len) &&
+            write_queued(fd, iov, record_lens, &count, &queued_len) == -1)
+        {
+            return -1;
+        }
+        int target_fd = commit_append_fd(committer.file_fd, record_len);
+        if (target_fd == -1)
+        {
+            return -1;
+        }
+        if (request->spill_len > 0 || count == IOV_MAX || target_fd != fd)
+        {
+            if (write_queued(fd, iov, record_lens, &count, &queued_len) == -1)
+            {
+                return -1;
+            }
+            fd = target_fd;
+        }
+        if (request->spill_len > 0)
+        {
+            if (*chunk == NULL && (*chunk = malloc(COMMIT_COPY_CHUNK)) == NULL)
+            {
+                return -1;
+            }
+            if (copy_spill(fd, request, *chunk) == -1)
+            {
+                return -1;
+            }
+        }
+        if (request->len > 0)
+        {
+            iov[count].iov_base = (void *)request->data;
+            iov[count].iov_len = request->len;
+            record_lens[count] = record_len;
+            queued_len += record_len;
+            count++;
+        }
+        else
+        {
+            commit_record_appended(record_len);
+        }
+    }
+    return write_queued(fd, iov, record_lens, &count, &queued_len);
+}
+
+static void wait_for_window(void)
+{
+    struct timespec deadline;
+
+    if (committer.window_usec <= 0)
+    {
+        return;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += committer.window_usec / 1000000;
+    deadline.tv_nsec += (committer.window_usec % 1000000) * 1000;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    while (committer.queued_bytes < committer.max_bytes && !committer.stop)
+    {
+        if (pthread_cond_timedwait(&committer.queued, &committer.lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+}
+
+static void *commit_thread(void *args)
+{
+    struct CommitQueue batch;
+    commit_request *request;
+    size_t batch_bytes;
+    int batch_count;
+    char *chunk = NULL;
+    (void)args;
+
+    pthread_mutex_lock(&committer.lock);
+    while (true)
+    {
+        while (STAILQ_EMPTY(&committer.queue) && !committer.stop)
+        {
+            pthread_cond_wait(&committer.queued, &committer.lock);
+        }
+        if (STAILQ_EMPTY(&committer.queue))
+        {
+            break;
+        }
+        wait_for_window();
+
+        // Everything queued while the previous fdatasync() ran joins this batch, up to max_bytes
+        STAILQ_INIT(&batch);
+        batch_bytes = 0;
+        batch_count = 0;
+        while (!STAILQ_EMPTY(&committer.queue) && (batch_count == 0 || batch_bytes < committer.max_bytes))
+        {
+            request = STAILQ_FIRST(&committer.queue);
+            STAILQ_REMOVE_HEAD(&committer.queue, entry);
+            STAILQ_INSERT_TAIL(&batch, request, entry);
+            batch_bytes += request->len + request->spill_len;
+            batch_count++;
+        }
+        committer.queued_bytes -= batch_bytes;
+        pthread_mutex_unlock(&committer.lock);
+
+        uint64_t start_usec = metrics_now_usec();
+        pthread_mutex_lock(&file_mutex);
+        int status = write_batch(&batch, &chunk);
+        pthread_mutex_unlock(&file_mutex);
+        metrics_observe_since(METRIC_WRITE_LATENCY, start_usec);
+        start_usec = metrics_now_usec();
+        if (status == 0 && commit_sync(committer.file_fd) == -1)
+        {
+            status = -1;
+        }
+        metrics_observe_since(METRIC_FDATASYNC_LATENCY, start_usec);
+        if (status == 0)
+        {
+            metrics_count(METRIC_PACKETS_STORED, batch_count);
+            // This thread is the only writer while it runs, replays now see the whole batch
+            commit_publish_length();
+        }
+        if (status == -1)
+        {
+            aesd_log(LOG_ERR, "Writing a batch of %d packets to the socketdata file failed: %s", batch_count, strerror(errno));
+            // Every request of the batch fails, none of its bytes may reach a replay or precede the next packet
+            pthread_mutex_lock(&file_mutex);
+            if (commit_discard_unsynced(committer.file_fd) == -1)
+            {
+                aesd_log(LOG_ERR, "Dropping the failed batch from the socketdata file failed: %s", strerror(errno));
+            }
+            pthread_mutex_unlock(&file_mutex);
+        }
+        aesd_log(LOG_DEBUG, "Committed %d packets (%zu bytes) with one fdatasync", batch_count, batch_bytes);
+
+        pthread_mutex_lock(&committer.lock);
+        while (!STAILQ_EMPTY(&batch))
+        {
+            request = STAILQ_FIRST(&batch);
+            STAILQ_REMOVE_HEAD(&batch, entry);
+            request->status = status;
+            if (request->on_complete != NULL)
+            {
+                // The callback may hand the request back to its owner, which can then reuse it
+                pthread_mutex_unlock(&committer.lock);
+                request->on_complete(request);
+                pthread_mutex_lock(&committer.lock);
+            }
+            else
+            {
+                request->done = true;
+            }
+        }
+        pthread_cond_broadcast(&committer.committed);
+    }
+    pthread_mutex_unlock(&committer.lock);
+    free(chunk);
+    return NULL;
+}
+
+int commit_start(int file_fd, long window_usec, size_t max_bytes)
+{
+    committer.file_fd = file_fd;
+    committer.window_usec = window_usec;
+    committer.max_bytes = max_bytes;
+    committer.stop = false;
+    committer.running = true;
+    int err = pthread_create(&committer.thread_id, NULL, commit_thread, NULL);
+    if (err != 0)
+    {
+        aesd_log(LOG_ERR, "Error creating commit thread: %s", strerror(err));
+        committer.running = false;
+        return -1;
+    }
+    aesd_log(LOG_INFO, "Group commit enabled, window %ld usec, up to %zu bytes per batch", window_usec, max_bytes);
+    return 0;
+}
+
+bool commit_enabled(void)
+{
+    return committer.running;
+}
+
+void commit_request_init(commit_request *request, const char *data, size_t len)
+{
+    memset(request, 0, sizeof(commit_request));
+    request->data = data;
+    request->len = len;
+    request->spill_fd = -1;
+}
+
+void commit_submit(commit_request *request)
+{
+    request->done = false;
+    pthread_mutex_lock(&committer.lock);
+    if (committer.stop || !committer.running)
+    {
+        // Nothing will write this request any more, fail it right away
+        pthread_mutex_unlock(&committer.lock);
+        request->status = -1;
+        request->done = true;
+        if (request->on_complete != NULL)
+        {
+            request->on_complete(request);
+        }
+        return;
+    }
+    bool was_below = committer.queued_bytes < committer.max_bytes;
+    STAILQ_INSERT_TAIL(&committer.queue, request, entry);
+    committer.queued_bytes += request->len + request->spill_len;
+    // Wake the writer for the first request, and again when a waiting batch reaches max_bytes
+    if (STAILQ_FIRST(&committer.queue) == request || (was_below && committer.queued_bytes >= committer.max_bytes))
+    {
+        pthread_cond_signal(&committer.queued);
+    }
+    pthread_mutex_unlock(&committer.lock);
+}
+
+int commit_write(commit_request *request)
+{
+    request->on_complete = NULL;
+    commit_submit(request);
+    pthread_mutex_lock(&committer.lock);
+    while (!request->done)
+    {
+        pthread_cond_wait(&committer.committed, &committer.lock);
+    }
+    pthread_mutex_unlock(&committer.lock);
+    return request->status;
+}
+
+void commit_stop(void)
+{
+    if (!committer.running)
+    {
+        return;
+    }
+    pthread_mutex_lock(&committer.lock);
+    committer.stop = true;
+    pthread_cond_signal(&committer.queued);
+    pthread_mutex_unlock(&committer.lock);
+    pthread_join(committer.thread_id, NULL);
+    pthread_mutex_lock(&committer.lock);
+    committer.running = false;
+    pthread_mutex_unlock(&committer.lock);
+}
+
+int commit_append_fd(int file_fd, off_t record_len)
+{
+    return seglog_enabled() ? seglog_append_fd(record_len) : file_fd;
+}
+
+bool commit_append_rotates(off_t unaccounted_len, off_t record_len)
+{
+    return seglog_enabled() && seglog_append_rotates(unaccounted_len, record_len);
+}
+
+void commit_record_appended(off_t record_len)
+{
+    appended_length += record_len;
+    if (seglog_enabled())
+    {
+        seglog_record_appended(record_len);
+    }
+}
+
+int commit_sync(int file_fd)
+{
+    if (seglog_enabled())
+    {
+        return seglog_sync();
+    }
+    return fdatasync(file_fd) == -1 && errno != EINVAL ? -1 : 0;
+}
+
+void commit_reset_length(int file_fd)
+{
+    struct stat file_stat;
+
+    if (seglog_enabled())
+    {
+        appended_length = seglog_length();
+    }
+    else if (fstat(file_fd, &file_stat) == 0)
+    {
+        appended_length = file_stat.st_size;
+    }
+    atomic_store(&durable_length, appended_length);
+}
+
+void commit_publish_length(void)
+{
+    // Not the file size, which may still hold the torn part of a failed write
+    atomic_store(&durable_length, seglog_enabled() ? seglog_length() : appended_length);
+}
+
+int commit_discard_unsynced(int file_fd)
+{
+    off_t length = atomic_load(&durable_length);
+
+    appended_length = length;
+    if (seglog_enabled())
+    {
+        return seglog_discard_unsynced();
+    }
+    // The descriptor is O_APPEND, the next record is written at the new end
+    return ftruncate(file_fd, length);
+}
+
+off_t commit_durable_length(void)
+{
+    return atomic_load(&durable_length);
+}
@@ -0,0 +1,99 @@
+/******************************************************
+# Group commit writer for the aesdsocket data file
+# Packets from all clients are queued to one writer thread which
+# writes a whole batch with writev() and makes it durable with a
+# single fdatasync(). Clients are acknowledged once their batch is
+# on disk.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef COMMIT_H
+#define COMMIT_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/queue.h>
+
+typedef struct commit_request
+{
+    const char *data;    // Packet bytes, must stay valid until the request completes
+    size_t len;
+    int spill_fd;        // Head of an oversized packet written before data, -1 if none
+    off_t spill_len;
+    int status;          // 0 once durable, -1 when the write failed
+    bool done;
+    // Called from the writer thread once durable, NULL for commit_write() callers
+    void (*on_complete)(struct commit_request *request);
+    void *context;
+    STAILQ_ENTRY(commit_request) entry;
+} commit_request;
+
+/**
+ * Starts the writer thread for file_fd.
+ * @param window_usec how long the writer waits for more packets after the first one of a batch
+ * @param max_bytes a batch is written as soon as this many bytes are queued
+ * @return 0 on success, -1 on failure
+ */
+int commit_start(int file_fd, long window_usec, size_t max_bytes);
+
+// True while a writer thread is running
+bool commit_enabled(void);
+
+void commit_request_init(commit_request *request, const char *data, size_t len);
+
+// Queues request, on_complete is called from the writer thread
+void commit_submit(commit_request *request);
+
+/**
+ * Queues request and waits until its batch is durable.
+ * @return 0 on success, -1 when the write failed
+ */
+int commit_write(commit_request *request);
+
+// Writes everything still queued, then stops the writer thread
+void commit_stop(void);
+
+/**
+ * Descriptor the next record of record_len bytes is appended to: file_fd, or the active
+ * segment when the segmented log is enabled. Writers must be serialized, and report each
+ * record with commit_record_appended() once its data is written, before calling this again
+ * for a record that starts a new segment and before calling commit_sync().
+ * @return the descriptor, -1 on failure
+ */
+int commit_append_fd(int file_fd, off_t record_len);
+
+// True when the record needs a new segment, with unaccounted_len bytes written but not yet reported
+bool commit_append_rotates(off_t unaccounted_len, off_t record_len);
+
+void commit_record_appended(off_t record_len);
+
+/**
+ * fdatasync() for file_fd, or for the segments written since the last sync.
+ * @return 0 on success, -1 on failure
+ */
+int commit_sync(int file_fd);
+
+/**
+ * Starts accounting the records of file_fd at its current size and publishes that as the end
+ * of the durable data. Called once the data is opened, before any record is appended.
+ */
+void commit_reset_length(int file_fd);
+
+/**
+ * Publishes the end of the records reported with commit_record_appended() as the end of the
+ * durable data. Writers call it once their data is synced.
+ */
+void commit_publish_length(void);
+
+/**
+ * Drops everything written to file_fd since the durable end was last published, including the
+ * torn part of a failed write, so the next record starts where the durable data ends. Writers
+ * call it when a write or sync fails.
+ * @return 0 on success, -1 on failure
+ */
+int commit_discard_unsynced(int file_fd);
+
+// End of the durable data, replays of the file backend read up to here without file_mutex
+off_t commit_durable_length(void);
+
+#endif /* COMMIT_H */
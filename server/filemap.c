@@ -0,0 +1,126 @@
+/******************************************************
+# Shared read-only mappings of the aesdsocket data files
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <syslog.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "filemap.h"
+#include "log.h"
+
+// Current mapping of every descriptor, indexed by the descriptor number
+static struct
+{
+    pthread_mutex_t lock;
+    file_map **maps;
+    int count;
+} registry = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Called with registry.lock held
+static void put_map(file_map *map)
+{
+    if (--map->refs == 0)
+    {
+        munmap((void *)map->data, map->capacity);
+        free(map);
+    }
+}
+
+// Called with registry.lock held
+static file_map *map_file(int fd, off_t length)
+{
+    size_t capacity = FILE_MAP_MIN_BYTES;
+
+    while (capacity < (size_t)length)
+    {
+        capacity *= 2;
+    }
+    file_map *map = malloc(sizeof(file_map));
+    if (map == NULL)
+    {
+        return NULL;
+    }
+    // Address space past the end of the file is reserved now and becomes readable as the file grows
+    void *data = mmap(NULL, capacity, PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        aesd_log(LOG_DEBUG, "Mapping the data file failed: %s", strerror(errno));
+        free(map);
+        return NULL;
+    }
+    map->data = data;
+    map->capacity = capacity;
+    map->refs = 1;
+    return map;
+}
+
+file_map *file_map_acquire(int fd, off_t length)
+{
+    file_map *map = NULL;
+
+    if (fd < 0 || length < 0)
+    {
+        return NULL;
+    }
+    pthread_mutex_lock(&registry.lock);
+    if (fd >= registry.count)
+    {
+        int count = fd + 16;
+        file_map **maps = realloc(registry.maps, count * sizeof(file_map *));
+        if (maps == NULL)
+        {
+            pthread_mutex_unlock(&registry.lock);
+            return NULL;
+        }
+        memset(maps + registry.count, 0, (count - registry.count) * sizeof(file_map *));
+        registry.maps = maps;
+        registry.count = count;
+    }
+    map = registry.maps[fd];
+    if (map == NULL || map->capacity < (size_t)length)
+    {
+        // Readers of the outgrown mapping keep it until they release it
+        map = map_file(fd, length);
+        if (map != NULL)
+        {
+            if (registry.maps[fd] != NULL)
+            {
+                put_map(registry.maps[fd]);
+            }
+            registry.maps[fd] = map;
+        }
+    }
+    if (map != NULL)
+    {
+        map->refs++;
+    }
+    pthread_mutex_unlock(&registry.lock);
+    return map;
+}
+
+void file_map_release(file_map *map)
+{
+    if (map == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&registry.lock);
+    put_map(map);
+    pthread_mutex_unlock(&registry.lock);
+}
+
+void file_map_forget(int fd)
+{
+    pthread_mutex_lock(&registry.lock);
+    if (fd >= 0 && fd < registry.count && registry.maps[fd] != NULL)
+    {
+        put_map(registry.maps[fd]);
+        registry.maps[fd] = NULL;
+    }
+    pthread_mutex_unlock(&registry.lock);
+}
@@ -0,0 +1,37 @@
+/******************************************************
+# Shared read-only mappings of the aesdsocket data files
+# Every regular data file gets one mapping that all replays share. The
+# durable part of a file never changes, so a mapping is never invalidated:
+# once the data outgrows it a larger one is created, and the old one is
+# unmapped when its last reader releases it.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef FILEMAP_H
+#define FILEMAP_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+// Mappings reserve address space in powers of two starting at this size
+#define FILE_MAP_MIN_BYTES (1024 * 1024)
+
+typedef struct
+{
+    const char *data;
+    size_t capacity; // Bytes of address space reserved, only the written part may be read
+    int refs;
+} file_map;
+
+/**
+ * Returns the mapping of fd, covering at least its first length bytes. Bytes past the end of
+ * the file must not be touched.
+ * @return the mapping, NULL when fd cannot be mapped
+ */
+file_map *file_map_acquire(int fd, off_t length);
+
+void file_map_release(file_map *map);
+
+// Drops the mapping of fd, must be called before fd is closed
+void file_map_forget(int fd);
+
+#endif /* FILEMAP_H */
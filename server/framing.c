@@ -0,0 +1,222 @@
+/******************************************************
+# Incremental newline framing of client data
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include "aesdsocket.h"
+#include "framing.h"
+#include "metrics.h"
+#include "pool.h"
+#include "log.h"
+
+void framer_init(line_framer *framer)
+{
+    memset(framer, 0, sizeof(line_framer));
+    framer->spill_fd = -1;
+}
+
+void framer_release(line_framer *framer)
+{
+    if (framer->spill_fd != -1)
+    {
+        close(framer->spill_fd);
+    }
+    buffer_put(framer->buffer, framer->capacity);
+    framer_init(framer);
+}
+
+static int open_spill_file(void)
+{
+    int fd = open(FRAMER_SPILL_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd == -1)
+    {
+        // Filesystems without O_TMPFILE support get a named file that is unlinked right away
+        char path[] = FRAMER_SPILL_DIR "/aesdsocket-spill-XXXXXX";
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1)
+        {
+            unlink(path);
+        }
+    }
+    return fd;
+}
+
+// Moves the buffered head of an oversized packet to the spill file
+static int spill_pending(line_framer *framer)
+{
+    size_t pending = framer->len - framer->start;
+    size_t written = 0;
+
+    if (framer->spill_fd == -1)
+    {
+        framer->spill_fd = open_spill_file();
+        if (framer->spill_fd == -1)
+        {
+            aesd_log(LOG_ERR, "Creating a spill file for an oversized packet failed: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    while (written < pending)
+    {
+        ssize_t result = pwrite(framer->spill_fd, framer->buffer + framer->start + written, pending - written, framer->spill_len);
+        if (result == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "Spilling an oversized packet failed: %s", strerror(errno));
+            return -1;
+        }
+        written += result;
+        framer->spill_len += result;
+    }
+    framer->start = 0;
+    framer->len = 0;
+    framer->scan_pos = 0;
+    return 0;
+}
+
+// Drops the spill file contents of a packet the caller has already stored
+static void reset_consumed_spill(line_framer *framer)
+{
+    if (framer->spill_consumed)
+    {
+        if (ftruncate(framer->spill_fd, 0) == -1)
+        {
+            // Start over with a fresh file rather than keep growing this one
+            close(framer->spill_fd);
+            framer->spill_fd = -1;
+        }
+        framer->spill_len = 0;
+        framer->spill_consumed = false;
+    }
+}
+
+// Makes room for more data after the unreturned tail, growing the buffer or spilling
+static int reserve_space(line_framer *framer)
+{
+    reset_consumed_spill(framer);
+
+    // Keep only the unreturned tail, moved to the front of the buffer
+    if (framer->start > 0)
+    {
+        memmove(framer->buffer, framer->buffer + framer->start, framer->len - framer->start);
+        framer->len -= framer->start;
+        framer->scan_pos -= framer->start;
+        framer->start = 0;
+    }
+
+    if (framer->len == framer->capacity)
+    {
+        size_t new_capacity = framer->capacity ? framer->capacity * 2 : CLIENT_BUFFER_LEN;
+        if (new_capacity > FRAMER_MAX_BUFFERED)
+        {
+            new_capacity = FRAMER_MAX_BUFFERED;
+        }
+        if (new_capacity > framer->capacity)
+        {
+            // Size classed buffers from the thread's pool instead of realloc()
+            char *new_buffer = buffer_get(new_capacity, &new_capacity);
+            if (new_buffer == NULL)
+            {
+                aesd_log(LOG_ERR, "Reallocation of client buffer failed");
+                errno = ENOMEM;
+                return -1;
+            }
+            memcpy(new_buffer, framer->buffer, framer->len);
+            buffer_put(framer->buffer, framer->capacity);
+            framer->buffer = new_buffer;
+            framer->capacity = new_capacity;
+        }
+        else if (spill_pending(framer) == -1)
+        {
+            errno = EIO;
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+ssize_t framer_recv(line_framer *framer, int client_fd)
+{
+    if (reserve_space(framer) == -1)
+    {
+        return -1;
+    }
+    ssize_t received = recv(client_fd, framer->buffer + framer->len, framer->capacity - framer->len, 0);
+    if (received > 0)
+    {
+        framer->len += received;
+        metrics_count(METRIC_RECEIVED_BYTES, received);
+    }
+    return received;
+}
+
+ssize_t framer_append(line_framer *framer, const char *data, size_t len)
+{
+    if (reserve_space(framer) == -1)
+    {
+        return -1;
+    }
+    size_t copied = framer->capacity - framer->len < len ? framer->capacity - framer->len : len;
+    memcpy(framer->buffer + framer->len, data, copied);
+    framer->len += copied;
+    return copied;
+}
+
+static void fill_packet(line_framer *framer, line_packet *packet, size_t end)
+{
+    packet->data = framer->buffer + framer->start;
+    packet->len = end - framer->start;
+    packet->spill_fd = framer->spill_fd;
+    packet->spill_len = framer->spill_len;
+    framer->start = end;
+    framer->scan_pos = end;
+    framer->spill_consumed = framer->spill_len > 0;
+}
+
+frame_status framer_next(line_framer *framer, line_packet *packet)
+{
+    reset_consumed_spill(framer);
+
+    if (framer->scan_pos == framer->len)
+    {
+        return FRAME_NONE;
+    }
+    char *newline = memchr(framer->buffer + framer->scan_pos, '\n', framer->len - framer->scan_pos);
+    if (newline == NULL)
+    {
+        framer->scan_pos = framer->len;
+        return FRAME_NONE;
+    }
+    fill_packet(framer, packet, newline - framer->buffer + 1);
+    return FRAME_PACKET;
+}
+
+frame_status framer_flush(line_framer *framer, line_packet *packet)
+{
+    reset_consumed_spill(framer);
+
+    if (framer->len == framer->start && framer->spill_len == 0)
+    {
+        return FRAME_NONE;
+    }
+    fill_packet(framer, packet, framer->len);
+    return FRAME_PACKET;
+}
+
+bool framer_has_partial(const line_framer *framer)
+{
+    return framer->len > framer->start || (framer->spill_len > 0 && !framer->spill_consumed);
+}
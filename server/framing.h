@@ -0,0 +1,77 @@
+/******************************************************
+# Incremental newline framing of client data
+# Only newly received bytes are scanned for the packet terminator,
+# several packets may be extracted from one recv(), and packets larger
+# than FRAMER_MAX_BUFFERED are spilled to an unlinked temporary file so
+# per-connection memory stays bounded.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef FRAMING_H
+#define FRAMING_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define FRAMER_MAX_BUFFERED (64 * 1024)
+#define FRAMER_SPILL_DIR "/var/tmp"
+
+typedef struct
+{
+    char *buffer;
+    size_t capacity;
+    size_t start;    // First byte not yet returned in a packet
+    size_t len;      // End of the received data
+    size_t scan_pos; // Bytes before this position are known not to contain a newline
+    int spill_fd;    // Head of an oversized packet, -1 until first needed
+    off_t spill_len;
+    bool spill_consumed;
+} line_framer;
+
+// A complete packet. When spill_len is non zero the packet is the spill file contents followed by data.
+typedef struct
+{
+    const char *data;
+    size_t len;
+    int spill_fd;
+    off_t spill_len;
+} line_packet;
+
+typedef enum
+{
+    FRAME_NONE = 0,   // No complete packet is buffered
+    FRAME_PACKET = 1  // packet describes the next complete packet
+} frame_status;
+
+void framer_init(line_framer *framer);
+void framer_release(line_framer *framer);
+
+/**
+ * Receives once from client_fd into the framer.
+ * @return recv() result: bytes received, 0 on end of stream, -1 with errno set on error
+ */
+ssize_t framer_recv(line_framer *framer, int client_fd);
+
+/**
+ * Copies received data that arrived through another path, such as an io_uring provided
+ * buffer, into the framer. Like framer_recv() it must only be called once framer_next()
+ * returned FRAME_NONE.
+ * @return bytes taken from data, which may be fewer than len, -1 with errno set on error
+ */
+ssize_t framer_append(line_framer *framer, const char *data, size_t len);
+
+/**
+ * Extracts the next newline terminated packet. The packet stays valid until the next call
+ * to framer_recv(), framer_next() or framer_flush().
+ */
+frame_status framer_next(line_framer *framer, line_packet *packet);
+
+/**
+ * Returns the unterminated remainder as a final packet once the peer stopped sending.
+ */
+frame_status framer_flush(line_framer *framer, line_packet *packet);
+
+// True while received bytes wait for the newline that completes their packet
+bool framer_has_partial(const line_framer *framer);
+
+#endif /* FRAMING_H */
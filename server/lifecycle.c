@@ -0,0 +1,412 @@
+/******************************************************
+# Shutdown and restart of aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include "aesdsocket.h"
+#include "lifecycle.h"
+#include "log.h"
+
+// How long a new server waits for the running one to send its listeners
+#define LIFECYCLE_HANDOFF_TIMEOUT_SEC 5
+
+static int stop_pipe[2] = {-1, -1};
+static volatile sig_atomic_t stop_signal;
+
+static struct
+{
+    const char *path;
+    int listener_fd;    // Successors connect here, -1 when not offering
+    int successor_fd;   // Held until the data is closed, -1 until handed off
+    int predecessor_fd; // Reaches end of file once the previous server closed its data
+    const int *listen_fds;
+    int listen_count;
+    pthread_t thread_id;
+    bool thread_started;
+    _Atomic bool handed_off;
+    bool took_over;
+} handoff = {
+    .listener_fd = -1,
+    .successor_fd = -1,
+    .predecessor_fd = -1,
+};
+
+// Only async-signal-safe calls here, the stop is logged by lifecycle_log_stop()
+static void signal_handler(int signal)
+{
+    int saved_errno = errno;
+    char byte = 0;
+
+    stop_signal = signal;
+    // Set the global variable so the main server exits gracefully
+    exit_main_loop = true;
+    // One byte keeps the pipe readable for every waiter, a full pipe already is
+    ssize_t ignored = write(stop_pipe[1], &byte, 1);
+    (void)ignored;
+    errno = saved_errno;
+}
+
+int lifecycle_init(void)
+{
+    struct sigaction sighandle;
+
+    if (pipe2(stop_pipe, O_NONBLOCK | O_CLOEXEC) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to create the stop pipe: %s", strerror(errno));
+        return -1;
+    }
+
+    // Initialize sigaction
+    sighandle.sa_handler = signal_handler;
+    sigemptyset(&sighandle.sa_mask); // Initialize the signal set to empty
+    sighandle.sa_flags = 0;          // No special flags
+
+    // Catch SIGINT
+    if (sigaction(SIGINT, &sighandle, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "Error setting up signal handler SIGINT: %s", strerror(errno));
+    }
+
+    // Catch SIGTERM
+    if (sigaction(SIGTERM, &sighandle, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "Error setting up signal handler SIGTERM: %s", strerror(errno));
+    }
+
+    // sendfile() and splice() cannot pass MSG_NOSIGNAL, a client gone during a replay must only fail with EPIPE
+    sighandle.sa_handler = SIG_IGN;
+    if (sigaction(SIGPIPE, &sighandle, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "Error ignoring SIGPIPE: %s", strerror(errno));
+    }
+    return 0;
+}
+
+int lifecycle_stop_fd(void)
+{
+    return stop_pipe[0];
+}
+
+void lifecycle_request_stop(void)
+{
+    char byte = 0;
+
+    exit_main_loop = true;
+    if (write(stop_pipe[1], &byte, 1) == -1 && errno != EAGAIN)
+    {
+        aesd_log(LOG_ERR, "Failed to write to the stop pipe: %s", strerror(errno));
+    }
+}
+
+void lifecycle_wait_for_stop(void)
+{
+    struct pollfd stop = {.fd = stop_pipe[0], .events = POLLIN};
+
+    while (poll(&stop, 1, -1) != 1)
+    {
+        if (errno != EINTR)
+        {
+            aesd_log(LOG_ERR, "Waiting for the stop pipe failed: %s", strerror(errno));
+            return;
+        }
+    }
+}
+
+void lifecycle_log_stop(void)
+{
+    if (atomic_load(&handoff.handed_off))
+    {
+        aesd_log(LOG_INFO, "Listening sockets handed to a new server, draining clients");
+    }
+    else if (stop_signal == SIGINT)
+    {
+        aesd_log(LOG_INFO, "Caught SIGINT (Ctrl+C), exiting gracefully");
+    }
+    else if (stop_signal == SIGTERM)
+    {
+        aesd_log(LOG_INFO, "Caught SIGTERM, exiting gracefully");
+    }
+}
+
+static int handoff_address(const char *path, struct sockaddr_un *addr)
+{
+    if (strlen(path) >= sizeof(addr->sun_path))
+    {
+        aesd_log(LOG_ERR, "Handoff socket path %s is too long", path);
+        return -1;
+    }
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+int lifecycle_take_over(const char *path, int **listen_fds, int *count)
+{
+    struct sockaddr_un addr;
+    struct timeval timeout = {.tv_sec = LIFECYCLE_HANDOFF_TIMEOUT_SEC};
+    char control[CMSG_SPACE(sizeof(int) * LIFECYCLE_MAX_LISTENERS)];
+    int announced = 0;
+    struct iovec iov = {.iov_base = &announced, .iov_len = sizeof(announced)};
+    struct msghdr message;
+    int received = 0;
+
+    if (handoff_address(path, &addr) == -1)
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to create the handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
+    {
+        int connect_errno = errno;
+        close(fd);
+        // No socket, or one left behind by a server that is gone: start afresh
+        if (connect_errno == ENOENT || connect_errno == ECONNREFUSED)
+        {
+            return 0;
+        }
+        aesd_log(LOG_ERR, "Failed to connect to the handoff socket %s: %s", path, strerror(connect_errno));
+        return -1;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t length = recvmsg(fd, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = length > 0 ? CMSG_FIRSTHDR(&message) : NULL;
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+    {
+        received = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    }
+    *listen_fds = received > 0 ? malloc(received * sizeof(int)) : NULL;
+    if (*listen_fds != NULL)
+    {
+        memcpy(*listen_fds, CMSG_DATA(cmsg), received * sizeof(int));
+    }
+    if (length != sizeof(announced) || received != announced || *listen_fds == NULL || (message.msg_flags & MSG_CTRUNC))
+    {
+        aesd_log(LOG_ERR, "No listening sockets received from %s", path);
+        for (int i = 0; i < received; i++)
+        {
+            close(((int *)CMSG_DATA(cmsg))[i]);
+        }
+        free(*listen_fds);
+        close(fd);
+        return -1;
+    }
+    *count = received;
+    handoff.predecessor_fd = fd;
+    handoff.took_over = true;
+    aesd_log(LOG_INFO, "Took over %d listening sockets from the server on %s", received, path);
+    return 1;
+}
+
+bool lifecycle_wait_for_predecessor(void)
+{
+    struct pollfd waited[2] = {
+        {.fd = handoff.predecessor_fd, .events = POLLIN},
+        {.fd = stop_pipe[0], .events = POLLIN},
+    };
+    char byte;
+
+    aesd_log(LOG_INFO, "Waiting for the previous server to drain its clients");
+    while (!(waited[0].revents & (POLLIN | POLLHUP | POLLERR)))
+    {
+        if (poll(waited, 2, -1) == -1 && errno != EINTR)
+        {
+            aesd_log(LOG_ERR, "Waiting for the previous server failed: %s", strerror(errno));
+            return false;
+        }
+        if (waited[1].revents & POLLIN)
+        {
+            return false;
+        }
+    }
+    // The previous server never writes, the connection only reports that it is done
+    if (read(handoff.predecessor_fd, &byte, 1) == -1)
+    {
+        aesd_log(LOG_WARNING, "Previous server connection failed: %s", strerror(errno));
+    }
+    close(handoff.predecessor_fd);
+    handoff.predecessor_fd = -1;
+    return true;
+}
+
+static int send_listeners(int successor_fd)
+{
+    int announced = handoff.listen_count;
+    size_t fds_len = handoff.listen_count * sizeof(int);
+    struct iovec iov = {.iov_base = &announced, .iov_len = sizeof(announced)};
+    struct msghdr message;
+
+    char *control = calloc(1, CMSG_SPACE(fds_len));
+    if (control == NULL)
+    {
+        return -1;
+    }
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = CMSG_SPACE(fds_len);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(fds_len);
+    memcpy(CMSG_DATA(cmsg), handoff.listen_fds, fds_len);
+    ssize_t sent = sendmsg(successor_fd, &message, MSG_NOSIGNAL);
+    free(control);
+    return sent == sizeof(announced) ? 0 : -1;
+}
+
+static void stop_offering(void)
+{
+    close(handoff.listener_fd);
+    handoff.listener_fd = -1;
+    unlink(handoff.path);
+}
+
+static void *handoff_thread(void *args)
+{
+    struct pollfd waited[2] = {
+        {.fd = handoff.listener_fd, .events = POLLIN},
+        {.fd = stop_pipe[0], .events = POLLIN},
+    };
+
+    (void)args;
+    while (true)
+    {
+        if (poll(waited, 2, -1) == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "Waiting for a successor failed: %s", strerror(errno));
+            break;
+        }
+        // Stopping for another reason, lifecycle_finish() removes the socket
+        if (waited[1].revents & POLLIN)
+        {
+            break;
+        }
+        if (!(waited[0].revents & POLLIN))
+        {
+            continue;
+        }
+        int successor_fd = accept4(handoff.listener_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (successor_fd == -1)
+        {
+            continue;
+        }
+        if (send_listeners(successor_fd) == -1)
+        {
+            aesd_log(LOG_ERR, "Handing the listening sockets over failed: %s", strerror(errno));
+            close(successor_fd);
+            continue;
+        }
+        handoff.successor_fd = successor_fd;
+        atomic_store(&handoff.handed_off, true);
+        // The successor offers the listeners from now on
+        stop_offering();
+        lifecycle_request_stop();
+        break;
+    }
+    return NULL;
+}
+
+int lifecycle_offer_listeners(const char *path, const int *listen_fds, int count)
+{
+    struct sockaddr_un addr;
+
+    if (count > LIFECYCLE_MAX_LISTENERS)
+    {
+        aesd_log(LOG_ERR, "Too many listening sockets to hand over: %d", count);
+        return -1;
+    }
+    if (handoff_address(path, &addr) == -1)
+    {
+        return -1;
+    }
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to create the handoff socket: %s", strerror(errno));
+        return -1;
+    }
+    // A socket left behind by a server that did not exit cleanly
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 || chmod(path, 0600) == -1 || listen(fd, 1) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to listen on the handoff socket %s: %s", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    handoff.path = path;
+    handoff.listener_fd = fd;
+    handoff.listen_fds = listen_fds;
+    handoff.listen_count = count;
+    int err = pthread_create(&handoff.thread_id, NULL, handoff_thread, NULL);
+    if (err != 0)
+    {
+        aesd_log(LOG_ERR, "Error creating handoff thread: %s", strerror(err));
+        stop_offering();
+        return -1;
+    }
+    handoff.thread_started = true;
+    aesd_log(LOG_INFO, "Offering the listening sockets to a new server on %s", path);
+    return 0;
+}
+
+void lifecycle_finish(void)
+{
+    if (handoff.thread_started)
+    {
+        // Wakes the handoff thread when the server stopped on its own
+        lifecycle_request_stop();
+        pthread_join(handoff.thread_id, NULL);
+        handoff.thread_started = false;
+    }
+    if (handoff.listener_fd != -1)
+    {
+        stop_offering();
+    }
+    if (handoff.successor_fd != -1)
+    {
+        // Everything is flushed and closed, the successor starts serving on end of file
+        close(handoff.successor_fd);
+        handoff.successor_fd = -1;
+        aesd_log(LOG_INFO, "Data closed, the new server takes over");
+    }
+}
+
+bool lifecycle_handed_off(void)
+{
+    return atomic_load(&handoff.handed_off);
+}
+
+bool lifecycle_took_over(void)
+{
+    return handoff.took_over;
+}
@@ -0,0 +1,71 @@
+/******************************************************
+# Shutdown and restart of aesdsocket
+# SIGINT/SIGTERM only set exit_main_loop and write to a self-pipe
+# that every event loop watches, so accepting stops at once whichever
+# thread the signal lands on; the loops then drain their clients
+# within --drain-timeout. With --handoff PATH a server offers its
+# listening sockets on a Unix socket: a new process started with the
+# same PATH receives them with SCM_RIGHTS and starts serving once the
+# old one has drained and closed its data, so connections wait in the
+# listen backlog instead of being refused.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef LIFECYCLE_H
+#define LIFECYCLE_H
+
+#include <stdbool.h>
+
+// Most listening sockets passed in one handoff, the kernel's limit per message
+#define LIFECYCLE_MAX_LISTENERS 253
+
+/**
+ * Creates the self-pipe and installs the SIGINT/SIGTERM handlers.
+ * @return 0 on success, -1 on failure
+ */
+int lifecycle_init(void);
+
+// Readable once a stop was requested, it is never drained so every waiter sees it
+int lifecycle_stop_fd(void);
+
+// Requests the same stop as SIGTERM
+void lifecycle_request_stop(void);
+
+// Blocks until a stop was requested
+void lifecycle_wait_for_stop(void);
+
+// Logs why the server is stopping, from a regular thread rather than the signal handler
+void lifecycle_log_stop(void);
+
+/**
+ * Asks the server offering its listeners on path to hand them over. The caller owns
+ * the descriptors returned in *listen_fds, a malloc()ed array of *count entries.
+ * @return 1 when listeners were received, 0 when no server answered on path, -1 on error
+ */
+int lifecycle_take_over(const char *path, int **listen_fds, int *count);
+
+/**
+ * After lifecycle_take_over(): waits until the previous server has flushed and closed its
+ * data, or until a stop is requested.
+ * @return true when the previous server is done
+ */
+bool lifecycle_wait_for_predecessor(void);
+
+/**
+ * Listens on path for a successor and hands it listen_fds, then requests a stop.
+ * @return 0 on success, -1 on failure
+ */
+int lifecycle_offer_listeners(const char *path, const int *listen_fds, int count);
+
+/**
+ * Called once the data is closed. Stops offering the listeners, and lets a successor
+ * that received them start serving.
+ */
+void lifecycle_finish(void);
+
+// True once a successor received the listeners, the data must be left for it
+bool lifecycle_handed_off(void);
+
+// True when the listeners came from a previous server, its data is continued
+bool lifecycle_took_over(void);
+
+#endif /* LIFECYCLE_H */
@@ -0,0 +1,249 @@
+/******************************************************
+# Asynchronous logging for aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <errno.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#include "log.h"
+
+#define LOG_IDLE_POLL_MS 100
+
+// A slot can be claimed by the producer whose position equals sequence and read by
+// the logger once sequence is position + 1 (bounded MPMC queue by D. Vyukov)
+typedef struct
+{
+    _Atomic size_t sequence;
+    int priority;
+    char message[LOG_RECORD_LEN];
+} log_record;
+
+static struct
+{
+    log_record records[LOG_RING_RECORDS];
+    _Atomic size_t tail __attribute__((aligned(64))); // Next position a producer claims
+    size_t head __attribute__((aligned(64)));         // Next position the logger reads, logger only
+    _Atomic unsigned long dropped;
+    atomic_bool sleeping; // Logger is waiting on wakeup_fd
+    atomic_bool running;
+    atomic_bool stop;
+    atomic_int level;
+    int wakeup_fd;
+    pthread_t thread_id;
+} ring = {
+    .level = LOG_INFO,
+    .wakeup_fd = -1,
+};
+
+void log_set_level(int level)
+{
+    atomic_store(&ring.level, level);
+}
+
+int log_parse_level(const char *name)
+{
+    static const struct
+    {
+        const char *name;
+        int level;
+    } levels[] = {
+        {"err", LOG_ERR},
+        {"error", LOG_ERR},
+        {"warning", LOG_WARNING},
+        {"notice", LOG_NOTICE},
+        {"info", LOG_INFO},
+        {"debug", LOG_DEBUG},
+    };
+
+    for (size_t i = 0; i < sizeof(levels) / sizeof(levels[0]); i++)
+    {
+        if (strcasecmp(name, levels[i].name) == 0)
+        {
+            return levels[i].level;
+        }
+    }
+    return -1;
+}
+
+// @return true when a record was written to syslog
+static bool drain_one(void)
+{
+    log_record *record = &ring.records[ring.head & (LOG_RING_RECORDS - 1)];
+
+    if (atomic_load_explicit(&record->sequence, memory_order_acquire) != ring.head + 1)
+    {
+        return false;
+    }
+    syslog(record->priority, "%s", record->message);
+    // Hand the slot to the producer one lap ahead
+    atomic_store_explicit(&record->sequence, ring.head + LOG_RING_RECORDS, memory_order_release);
+    ring.head++;
+    return true;
+}
+
+static void *logger_thread(void *args)
+{
+    struct pollfd wakeup = {.fd = ring.wakeup_fd, .events = POLLIN};
+    uint64_t count;
+    (void)args;
+
+    while (true)
+    {
+        while (drain_one())
+        {
+        }
+        unsigned long dropped = atomic_exchange(&ring.dropped, 0);
+        if (dropped > 0)
+        {
+            syslog(LOG_WARNING, "Log ring full, %lu messages dropped", dropped);
+        }
+        if (atomic_load(&ring.stop))
+        {
+            break;
+        }
+
+        atomic_store(&ring.sleeping, true);
+        atomic_thread_fence(memory_order_seq_cst);
+        // A record published before the flag was visible would otherwise wait for the poll timeout
+        if (drain_one())
+        {
+            atomic_store(&ring.sleeping, false);
+            continue;
+        }
+        if (poll(&wakeup, 1, LOG_IDLE_POLL_MS) > 0 && read(ring.wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+        {
+            break;
+        }
+        atomic_store(&ring.sleeping, false);
+    }
+    // Whatever was queued while stopping
+    while (drain_one())
+    {
+    }
+    return NULL;
+}
+
+int log_start(void)
+{
+    sigset_t block_mask, orig_mask;
+
+    for (size_t i = 0; i < LOG_RING_RECORDS; i++)
+    {
+        atomic_init(&ring.records[i].sequence, i);
+    }
+    atomic_store(&ring.tail, 0);
+    ring.head = 0;
+    atomic_store(&ring.stop, false);
+    ring.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring.wakeup_fd == -1)
+    {
+        syslog(LOG_ERR, "eventfd for the logger failed: %s", strerror(errno));
+        return -1;
+    }
+
+    // Signals stay with the main thread
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+    int err = pthread_create(&ring.thread_id, NULL, logger_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    if (err != 0)
+    {
+        syslog(LOG_ERR, "Error creating logger thread: %s", strerror(err));
+        close(ring.wakeup_fd);
+        ring.wakeup_fd = -1;
+        return -1;
+    }
+    atomic_store(&ring.running, true);
+    return 0;
+}
+
+void log_stop(void)
+{
+    uint64_t wake = 1;
+
+    if (!atomic_load(&ring.running))
+    {
+        return;
+    }
+    atomic_store(&ring.stop, true);
+    if (write(ring.wakeup_fd, &wake, sizeof(wake)) == -1)
+    {
+        // The logger still notices stop within LOG_IDLE_POLL_MS
+    }
+    pthread_join(ring.thread_id, NULL);
+    atomic_store(&ring.running, false);
+    close(ring.wakeup_fd);
+    ring.wakeup_fd = -1;
+}
+
+void aesd_log(int priority, const char *format, ...)
+{
+    va_list args;
+    log_record *record;
+    size_t position;
+    uint64_t wake = 1;
+
+    if (LOG_PRI(priority) > atomic_load_explicit(&ring.level, memory_order_relaxed))
+    {
+        return;
+    }
+    va_start(args, format);
+    if (!atomic_load_explicit(&ring.running, memory_order_acquire))
+    {
+        vsyslog(priority, format, args);
+        va_end(args);
+        return;
+    }
+
+    position = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+    while (true)
+    {
+        record = &ring.records[position & (LOG_RING_RECORDS - 1)];
+        size_t sequence = atomic_load_explicit(&record->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+        if (diff == 0)
+        {
+            if (atomic_compare_exchange_weak_explicit(&ring.tail, &position, position + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                break;
+            }
+        }
+        else if (diff < 0)
+        {
+            // The logger is a full lap behind, drop instead of blocking the caller
+            atomic_fetch_add_explicit(&ring.dropped, 1, memory_order_relaxed);
+            va_end(args);
+            return;
+        }
+        else
+        {
+            position = atomic_load_explicit(&ring.tail, memory_order_relaxed);
+        }
+    }
+
+    record->priority = priority;
+    vsnprintf(record->message, sizeof(record->message), format, args);
+    va_end(args);
+    atomic_store_explicit(&record->sequence, position + 1, memory_order_release);
+
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ring.sleeping, memory_order_relaxed) && atomic_exchange(&ring.sleeping, false))
+    {
+        if (write(ring.wakeup_fd, &wake, sizeof(wake)) == -1)
+        {
+            // Counter saturated, the logger is awake anyway
+        }
+    }
+}
@@ -0,0 +1,39 @@
+/******************************************************
+# Asynchronous logging for aesdsocket
+# Producers format a fixed size record straight into a slot of a
+# lock-free multi producer ring and return; one logger thread drains
+# the ring to syslog. When the ring is full, records are dropped and
+# counted instead of blocking the caller.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef LOG_H
+#define LOG_H
+
+#include <syslog.h>
+
+#define LOG_RING_RECORDS 4096 // Must be a power of two
+#define LOG_RECORD_LEN 240
+
+// Messages less important than level are discarded before they are formatted
+void log_set_level(int level);
+
+/**
+ * Parses a level name: err, warning, notice, info or debug.
+ * @return the syslog priority, -1 when the name is unknown
+ */
+int log_parse_level(const char *name);
+
+/**
+ * Starts the logger thread. Until then, and after log_stop(), aesd_log() calls syslog()
+ * directly. Must be called after daemonizing, a forked child has no logger thread.
+ * @return 0 on success, -1 on failure
+ */
+int log_start(void);
+
+// Writes every queued record to syslog, then stops the logger thread
+void log_stop(void);
+
+// syslog() replacement that never blocks on /dev/log
+void aesd_log(int priority, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#endif /* LOG_H */
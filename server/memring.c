@@ -0,0 +1,257 @@
+/******************************************************
+# In-memory record ring for the aesdsocket memory backend
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <syslog.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "memring.h"
+#include "metrics.h"
+#include "log.h"
+
+// Records handed to one sendmsg()
+#define MEMRING_IOV 32
+
+typedef struct
+{
+    int refs;   // The ring's reference plus one per replay sending the record
+    off_t base; // Stream offset of the first byte
+    size_t size;
+    char data[];
+} memring_record;
+
+static struct
+{
+    pthread_mutex_t lock;
+    memring_record **records;
+    size_t capacity;
+    size_t head;  // Slot of the oldest record
+    size_t count;
+    size_t max_bytes;
+    size_t bytes;
+    off_t end;    // Stream offset just past the newest record
+} ring = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Called with ring.lock held, index 0 is the oldest record
+static memring_record *record_at(size_t index)
+{
+    return ring.records[(ring.head + index) % ring.capacity];
+}
+
+// Called with ring.lock held
+static void put_record(memring_record *record)
+{
+    if (--record->refs == 0)
+    {
+        free(record);
+    }
+}
+
+// Called with ring.lock held
+static void drop_oldest(void)
+{
+    memring_record *record = record_at(0);
+
+    ring.head = (ring.head + 1) % ring.capacity;
+    ring.count--;
+    ring.bytes -= record->size;
+    put_record(record);
+}
+
+int memring_open(size_t max_records, size_t max_bytes)
+{
+    ring.records = calloc(max_records, sizeof(memring_record *));
+    if (ring.records == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate the record ring");
+        return -1;
+    }
+    ring.capacity = max_records;
+    ring.head = 0;
+    ring.count = 0;
+    ring.max_bytes = max_bytes;
+    ring.bytes = 0;
+    ring.end = 0;
+    return 0;
+}
+
+void memring_close(void)
+{
+    pthread_mutex_lock(&ring.lock);
+    while (ring.count > 0)
+    {
+        drop_oldest();
+    }
+    free(ring.records);
+    ring.records = NULL;
+    pthread_mutex_unlock(&ring.lock);
+}
+
+int memring_append(const line_packet *packet)
+{
+    size_t size = packet->spill_len + packet->len;
+    off_t copied = 0;
+
+    if (size == 0)
+    {
+        return 0;
+    }
+    // The copy is made before the lock is taken, readers only wait for the slot update
+    memring_record *record = malloc(sizeof(memring_record) + size);
+    if (record == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate a %zu byte record", size);
+        return -1;
+    }
+    while (copied < packet->spill_len)
+    {
+        ssize_t bytes_read = pread(packet->spill_fd, record->data + copied, packet->spill_len - copied, copied);
+        if (bytes_read <= 0)
+        {
+            free(record);
+            return -1;
+        }
+        copied += bytes_read;
+    }
+    memcpy(record->data + packet->spill_len, packet->data, packet->len);
+    record->refs = 1;
+    record->size = size;
+
+    pthread_mutex_lock(&ring.lock);
+    // A record larger than the whole budget still replaces everything else
+    while (ring.count > 0 && (ring.count == ring.capacity || (ring.max_bytes > 0 && ring.bytes + size > ring.max_bytes)))
+    {
+        drop_oldest();
+    }
+    record->base = ring.end;
+    ring.records[(ring.head + ring.count) % ring.capacity] = record;
+    ring.count++;
+    ring.bytes += size;
+    ring.end += size;
+    pthread_mutex_unlock(&ring.lock);
+    return 0;
+}
+
+off_t memring_end(void)
+{
+    pthread_mutex_lock(&ring.lock);
+    off_t end = ring.end;
+    pthread_mutex_unlock(&ring.lock);
+    return end;
+}
+
+int memring_find_record(uint64_t record, off_t *offset, off_t *length)
+{
+    int status = -1;
+
+    pthread_mutex_lock(&ring.lock);
+    if (record < ring.count)
+    {
+        *offset = record_at(record)->base;
+        *length = record_at(record)->size;
+        status = 0;
+    }
+    pthread_mutex_unlock(&ring.lock);
+    return status;
+}
+
+// Called with ring.lock held, pins the records from *offset on and fills iov with their bytes
+static size_t pin_records(off_t *offset, off_t end, memring_record **pinned, struct iovec *iov)
+{
+    size_t low = 0, high = ring.count, count = 0;
+
+    if (ring.count == 0)
+    {
+        return 0;
+    }
+    if (*offset < record_at(0)->base)
+    {
+        // Dropped from the ring already, go on with the oldest record kept
+        *offset = record_at(0)->base;
+    }
+    // First record ending after offset
+    while (low < high)
+    {
+        size_t middle = (low + high) / 2;
+        memring_record *record = record_at(middle);
+        if (record->base + (off_t)record->size <= *offset)
+        {
+            low = middle + 1;
+        }
+        else
+        {
+            high = middle;
+        }
+    }
+    for (size_t index = low; index < ring.count && count < MEMRING_IOV; index++)
+    {
+        memring_record *record = record_at(index);
+        off_t start = *offset > record->base ? *offset - record->base : 0;
+        off_t stop = end < record->base + (off_t)record->size ? end - record->base : (off_t)record->size;
+        if (stop <= start)
+        {
+            break;
+        }
+        record->refs++;
+        pinned[count] = record;
+        iov[count].iov_base = record->data + start;
+        iov[count].iov_len = stop - start;
+        count++;
+    }
+    return count;
+}
+
+replay_status memring_replay(int client_fd, off_t *offset, off_t end)
+{
+    memring_record *pinned[MEMRING_IOV];
+    struct iovec iov[MEMRING_IOV];
+    struct msghdr message;
+
+    while (true)
+    {
+        pthread_mutex_lock(&ring.lock);
+        size_t count = pin_records(offset, end == -1 ? ring.end : end, pinned, iov);
+        pthread_mutex_unlock(&ring.lock);
+        if (count == 0)
+        {
+            return REPLAY_DONE;
+        }
+
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = iov;
+        message.msg_iovlen = count;
+        ssize_t sent = sendmsg(client_fd, &message, MSG_NOSIGNAL);
+        int send_errno = errno;
+
+        pthread_mutex_lock(&ring.lock);
+        for (size_t i = 0; i < count; i++)
+        {
+            put_record(pinned[i]);
+        }
+        pthread_mutex_unlock(&ring.lock);
+
+        if (sent == -1)
+        {
+            if (send_errno == EINTR)
+            {
+                continue;
+            }
+            if (send_errno == EAGAIN || send_errno == EWOULDBLOCK)
+            {
+                return REPLAY_AGAIN;
+            }
+            aesd_log(LOG_ERR, "Send to client failed: %s", strerror(send_errno));
+            return REPLAY_ERROR;
+        }
+        // Records are never modified, the next call resumes by offset alone
+        *offset += sent;
+        metrics_count(METRIC_SENT_BYTES, sent);
+    }
+}
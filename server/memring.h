@@ -0,0 +1,55 @@
+/******************************************************
+# In-memory record ring for the aesdsocket memory backend
+# Modelled on the aesdchar driver's aesd_circular_buffer: the newest
+# records are kept in a fixed number of slots and the oldest one is
+# dropped when a new record does not fit, here also when the ring
+# would exceed its byte budget. Nothing touches the filesystem.
+# Records are immutable and reference counted, so replays send them
+# without holding the ring lock while the socket is written.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef MEMRING_H
+#define MEMRING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include "framing.h"
+#include "replay.h"
+
+// Same number of records the aesdchar driver keeps
+#define MEMRING_DEFAULT_RECORDS 10
+
+/**
+ * Allocates the ring.
+ * @param max_records slots of the ring
+ * @param max_bytes the oldest records are dropped while the ring would hold more, 0 for no limit
+ * @return 0 on success, -1 on failure
+ */
+int memring_open(size_t max_records, size_t max_bytes);
+
+// Frees the ring, no replay may be running
+void memring_close(void);
+
+/**
+ * Copies a packet into a new record, dropping the oldest records to make room.
+ * @return 0 on success, -1 when out of memory or the spilled head cannot be read
+ */
+int memring_append(const line_packet *packet);
+
+// Stream offset just past the newest record
+off_t memring_end(void);
+
+/**
+ * Locates a record, counted from the oldest record kept.
+ * @return 0 with the stream offset and length of the record, -1 when there is no such record
+ */
+int memring_find_record(uint64_t record, off_t *offset, off_t *length);
+
+/**
+ * Sends the records from stream offset *offset up to end, or to the newest record when end
+ * is -1, advancing *offset. Data already dropped from the ring is skipped.
+ */
+replay_status memring_replay(int client_fd, off_t *offset, off_t end);
+
+#endif /* MEMRING_H */
@@ -0,0 +1,339 @@
+/******************************************************
+# Prometheus style metrics for aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/queue.h>
+#include "metrics.h"
+#include "log.h"
+
+// Counters of one thread, only that thread writes them
+typedef struct metrics_shard
+{
+    _Atomic uint64_t counters[METRIC_COUNTER_COUNT];
+    _Atomic int64_t gauges[METRIC_GAUGE_COUNT];
+    struct
+    {
+        _Atomic uint64_t buckets[METRICS_BUCKETS];
+        _Atomic uint64_t sum_usec;
+    } histograms[METRIC_HISTOGRAM_COUNT];
+    SLIST_ENTRY(metrics_shard) entry;
+} __attribute__((aligned(64))) metrics_shard;
+
+static const struct
+{
+    const char *name;
+    const char *help;
+} counter_info[METRIC_COUNTER_COUNT] = {
+    [METRIC_CONNECTIONS_ACCEPTED] = {"aesd_connections_accepted_total", "Client connections accepted."},
+    [METRIC_RECEIVED_BYTES] = {"aesd_received_bytes_total", "Bytes received from clients."},
+    [METRIC_SENT_BYTES] = {"aesd_sent_bytes_total", "Bytes replayed to clients."},
+    [METRIC_PACKETS_STORED] = {"aesd_packets_stored_total", "Packets and timestamps appended to the data."},
+},
+  gauge_info[METRIC_GAUGE_COUNT] = {
+      [METRIC_ACTIVE_CLIENTS] = {"aesd_active_clients", "Client connections currently served."},
+      [METRIC_QUEUED_CONNECTIONS] = {"aesd_queued_connections", "Accepted connections waiting for a worker thread."},
+},
+  histogram_info[METRIC_HISTOGRAM_COUNT] = {
+      [METRIC_WRITE_LATENCY] = {"aesd_write_latency_seconds", "Time spent writing a packet or batch to the data."},
+      [METRIC_FDATASYNC_LATENCY] = {"aesd_fdatasync_latency_seconds", "Time spent in fdatasync() of the data file."},
+      [METRIC_REPLAY_LATENCY] = {"aesd_replay_latency_seconds", "Time to replay the data to a client."},
+};
+
+static struct
+{
+    pthread_t thread_id;
+    pthread_mutex_t lock; // Protects the shard list, never taken on the hot path
+    SLIST_HEAD(ShardList, metrics_shard) shards;
+    int listen_fd;
+    atomic_bool enabled;
+} metrics = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .shards = SLIST_HEAD_INITIALIZER(metrics.shards),
+    .listen_fd = -1,
+};
+
+static __thread metrics_shard *local_shard;
+
+static metrics_shard *get_shard(void)
+{
+    if (local_shard == NULL)
+    {
+        // Shards outlive their thread so the counters never go backwards
+        local_shard = aligned_alloc(64, sizeof(metrics_shard));
+        if (local_shard == NULL)
+        {
+            return NULL;
+        }
+        memset(local_shard, 0, sizeof(metrics_shard));
+        pthread_mutex_lock(&metrics.lock);
+        SLIST_INSERT_HEAD(&metrics.shards, local_shard, entry);
+        pthread_mutex_unlock(&metrics.lock);
+    }
+    return local_shard;
+}
+
+void metrics_count(metric_counter counter, uint64_t value)
+{
+    metrics_shard *shard;
+
+    if (atomic_load_explicit(&metrics.enabled, memory_order_relaxed) && (shard = get_shard()) != NULL)
+    {
+        atomic_fetch_add_explicit(&shard->counters[counter], value, memory_order_relaxed);
+    }
+}
+
+void metrics_gauge_add(metric_gauge gauge, int64_t delta)
+{
+    metrics_shard *shard;
+
+    if (atomic_load_explicit(&metrics.enabled, memory_order_relaxed) && (shard = get_shard()) != NULL)
+    {
+        atomic_fetch_add_explicit(&shard->gauges[gauge], delta, memory_order_relaxed);
+    }
+}
+
+void metrics_observe(metric_histogram histogram, uint64_t usec)
+{
+    metrics_shard *shard;
+
+    if (!atomic_load_explicit(&metrics.enabled, memory_order_relaxed) || (shard = get_shard()) == NULL)
+    {
+        return;
+    }
+    // Bucket i counts values up to 2^i us
+    int bucket = usec <= 1 ? 0 : 64 - __builtin_clzll(usec - 1);
+    if (bucket >= METRICS_BUCKETS)
+    {
+        bucket = METRICS_BUCKETS - 1;
+    }
+    atomic_fetch_add_explicit(&shard->histograms[histogram].buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&shard->histograms[histogram].sum_usec, usec, memory_order_relaxed);
+}
+
+uint64_t metrics_now_usec(void)
+{
+    struct timespec now;
+
+    if (!atomic_load_explicit(&metrics.enabled, memory_order_relaxed))
+    {
+        return 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void metrics_observe_since(metric_histogram histogram, uint64_t start_usec)
+{
+    uint64_t now = metrics_now_usec();
+
+    if (start_usec != 0 && now >= start_usec)
+    {
+        metrics_observe(histogram, now - start_usec);
+    }
+}
+
+static void write_metrics(FILE *out)
+{
+    uint64_t counters[METRIC_COUNTER_COUNT] = {0};
+    int64_t gauges[METRIC_GAUGE_COUNT] = {0};
+    uint64_t buckets[METRIC_HISTOGRAM_COUNT][METRICS_BUCKETS] = {{0}};
+    uint64_t sums[METRIC_HISTOGRAM_COUNT] = {0};
+    metrics_shard *shard;
+
+    pthread_mutex_lock(&metrics.lock);
+    SLIST_FOREACH(shard, &metrics.shards, entry)
+    {
+        for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+        {
+            counters[i] += atomic_load_explicit(&shard->counters[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+        {
+            gauges[i] += atomic_load_explicit(&shard->gauges[i], memory_order_relaxed);
+        }
+        for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+        {
+            for (int b = 0; b < METRICS_BUCKETS; b++)
+            {
+                buckets[i][b] += atomic_load_explicit(&shard->histograms[i].buckets[b], memory_order_relaxed);
+            }
+            sums[i] += atomic_load_explicit(&shard->histograms[i].sum_usec, memory_order_relaxed);
+        }
+    }
+    pthread_mutex_unlock(&metrics.lock);
+
+    for (int i = 0; i < METRIC_COUNTER_COUNT; i++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n", counter_info[i].name, counter_info[i].help,
+                counter_info[i].name, counter_info[i].name, (unsigned long long)counters[i]);
+    }
+    for (int i = 0; i < METRIC_GAUGE_COUNT; i++)
+    {
+        fprintf(out, "# HELP %s %s\n# TYPE %s gauge\n%s %lld\n", gauge_info[i].name, gauge_info[i].help,
+                gauge_info[i].name, gauge_info[i].name, (long long)gauges[i]);
+    }
+    for (int i = 0; i < METRIC_HISTOGRAM_COUNT; i++)
+    {
+        const char *name = histogram_info[i].name;
+        uint64_t cumulative = 0;
+
+        fprintf(out, "# HELP %s %s\n# TYPE %s histogram\n", name, histogram_info[i].help, name);
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+        {
+            cumulative += buckets[i][b];
+            fprintf(out, "%s_bucket{le=\"%.6f\"} %llu\n", name, (double)(1ULL << b) / 1e6, (unsigned long long)cumulative);
+        }
+        cumulative += buckets[i][METRICS_BUCKETS - 1];
+        fprintf(out, "%s_bucket{le=\"+Inf\"} %llu\n", name, (unsigned long long)cumulative);
+        fprintf(out, "%s_sum %.6f\n%s_count %llu\n", name, (double)sums[i] / 1e6, name, (unsigned long long)cumulative);
+    }
+}
+
+static void serve_scrape(int client_fd)
+{
+    char request[1024];
+    char *body = NULL;
+    size_t body_len = 0;
+    char header[160];
+    struct timeval timeout = {.tv_sec = 1};
+
+    // Whatever the request is, the answer is the metrics page
+    setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if (recv(client_fd, request, sizeof(request), 0) == -1)
+    {
+        return;
+    }
+
+    FILE *out = open_memstream(&body, &body_len);
+    if (out == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate the metrics page: %s", strerror(errno));
+        return;
+    }
+    write_metrics(out);
+    fclose(out);
+
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\nConnection: close\r\n\r\n",
+                              body_len);
+    if (send(client_fd, header, header_len, MSG_NOSIGNAL | MSG_MORE) == header_len)
+    {
+        size_t sent = 0;
+        while (sent < body_len)
+        {
+            ssize_t n = send(client_fd, body + sent, body_len - sent, MSG_NOSIGNAL);
+            if (n == -1 && errno == EINTR)
+            {
+                continue;
+            }
+            if (n <= 0)
+            {
+                break;
+            }
+            sent += n;
+        }
+    }
+    free(body);
+}
+
+static void *metrics_thread(void *args)
+{
+    (void)args;
+
+    while (true)
+    {
+        int client_fd = accept4(metrics.listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            // metrics_stop() shuts the listening socket down
+            break;
+        }
+        serve_scrape(client_fd);
+        close(client_fd);
+    }
+    return NULL;
+}
+
+int metrics_start(const char *port)
+{
+    struct addrinfo inputs, *address_info;
+    sigset_t block_mask, orig_mask;
+    int yes = 1;
+    int status;
+
+    memset(&inputs, 0, sizeof(inputs));
+    inputs.ai_family = AF_UNSPEC;
+    inputs.ai_socktype = SOCK_STREAM;
+    inputs.ai_flags = AI_PASSIVE;
+    if ((status = getaddrinfo(NULL, port, &inputs, &address_info)) != 0)
+    {
+        aesd_log(LOG_ERR, "Error occurred while getting the metrics address info: %s", gai_strerror(status));
+        return -1;
+    }
+    metrics.listen_fd = socket(address_info->ai_family, address_info->ai_socktype | SOCK_CLOEXEC, address_info->ai_protocol);
+    if (metrics.listen_fd == -1 ||
+        setsockopt(metrics.listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes)) == -1 ||
+        bind(metrics.listen_fd, address_info->ai_addr, address_info->ai_addrlen) == -1 ||
+        listen(metrics.listen_fd, 8) == -1)
+    {
+        aesd_log(LOG_ERR, "Metrics listener on port %s failed: %s", port, strerror(errno));
+        freeaddrinfo(address_info);
+        if (metrics.listen_fd != -1)
+        {
+            close(metrics.listen_fd);
+            metrics.listen_fd = -1;
+        }
+        return -1;
+    }
+    freeaddrinfo(address_info);
+
+    atomic_store(&metrics.enabled, true);
+    // The listener must not take SIGINT/SIGTERM away from the main thread
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+    int err = pthread_create(&metrics.thread_id, NULL, metrics_thread, NULL);
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    if (err != 0)
+    {
+        aesd_log(LOG_ERR, "Error creating metrics thread: %s", strerror(err));
+        atomic_store(&metrics.enabled, false);
+        close(metrics.listen_fd);
+        metrics.listen_fd = -1;
+        return -1;
+    }
+    aesd_log(LOG_INFO, "Serving metrics on port %s", port);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    if (metrics.listen_fd == -1)
+    {
+        return;
+    }
+    // Wakes the blocked accept() of the metrics thread
+    shutdown(metrics.listen_fd, SHUT_RDWR);
+    pthread_join(metrics.thread_id, NULL);
+    close(metrics.listen_fd);
+    metrics.listen_fd = -1;
+}
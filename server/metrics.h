@@ -0,0 +1,62 @@
+/******************************************************
+# Prometheus style metrics for aesdsocket
+# Every thread updates its own cache line aligned shard with relaxed
+# atomics, so instrumenting the hot path adds no shared lock or
+# contended cache line. A scrape sums all shards and answers in the
+# Prometheus text exposition format on a separate port.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+typedef enum
+{
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_RECEIVED_BYTES,
+    METRIC_SENT_BYTES,
+    METRIC_PACKETS_STORED,
+    METRIC_COUNTER_COUNT
+} metric_counter;
+
+typedef enum
+{
+    METRIC_ACTIVE_CLIENTS,
+    METRIC_QUEUED_CONNECTIONS, // Accepted connections waiting for a pool worker
+    METRIC_GAUGE_COUNT
+} metric_gauge;
+
+typedef enum
+{
+    METRIC_WRITE_LATENCY,     // write()/writev() of a packet or batch to the data file
+    METRIC_FDATASYNC_LATENCY,
+    METRIC_REPLAY_LATENCY,    // Whole replay of the data to one client
+    METRIC_HISTOGRAM_COUNT
+} metric_histogram;
+
+// Power of two microsecond buckets, 1 us up to about 4 s, plus +Inf
+#define METRICS_BUCKETS 24
+
+/**
+ * Starts serving the metrics on port, collection is off until this succeeds.
+ * @return 0 on success, -1 on failure
+ */
+int metrics_start(const char *port);
+
+// Stops the metrics listener
+void metrics_stop(void);
+
+void metrics_count(metric_counter counter, uint64_t value);
+void metrics_gauge_add(metric_gauge gauge, int64_t delta);
+void metrics_observe(metric_histogram histogram, uint64_t usec);
+
+/**
+ * @return monotonic time in microseconds for latency measurements, 0 while metrics are off
+ */
+uint64_t metrics_now_usec(void);
+
+// Records the time elapsed since start_usec, which came from metrics_now_usec()
+void metrics_observe_since(metric_histogram histogram, uint64_t start_usec);
+
+#endif /* METRICS_H */
@@ -0,0 +1,165 @@
+/******************************************************
+# Per-thread memory pools for aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "pool.h"
+
+#define POOL_CLASSES 8 // POOL_MIN_BUFFER << (POOL_CLASSES - 1) == POOL_MAX_BUFFER
+
+// Free objects and buffers are linked through their first bytes
+typedef struct free_node
+{
+    struct free_node *next;
+} free_node;
+
+typedef struct
+{
+    free_node *free_list[POOL_CLASSES];
+    size_t free_count[POOL_CLASSES];
+} buffer_cache;
+
+static __thread buffer_cache thread_cache;
+static __thread bool thread_cache_registered;
+static pthread_key_t cache_key;
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+
+void object_pool_init(object_pool *pool, size_t object_size, size_t max_free)
+{
+    pool->object_size = object_size < sizeof(free_node) ? sizeof(free_node) : object_size;
+    pool->free_list = NULL;
+    pool->free_count = 0;
+    pool->max_free = max_free;
+}
+
+void object_pool_destroy(object_pool *pool)
+{
+    free_node *node = pool->free_list;
+
+    while (node != NULL)
+    {
+        free_node *next = node->next;
+        free(node);
+        node = next;
+    }
+    pool->free_list = NULL;
+    pool->free_count = 0;
+}
+
+void *object_pool_get(object_pool *pool)
+{
+    free_node *node = pool->free_list;
+
+    if (node == NULL)
+    {
+        return calloc(1, pool->object_size);
+    }
+    pool->free_list = node->next;
+    pool->free_count--;
+    memset(node, 0, pool->object_size);
+    return node;
+}
+
+void object_pool_put(object_pool *pool, void *object)
+{
+    free_node *node = object;
+
+    if (object == NULL)
+    {
+        return;
+    }
+    if (pool->free_count >= pool->max_free)
+    {
+        free(object);
+        return;
+    }
+    node->next = pool->free_list;
+    pool->free_list = node;
+    pool->free_count++;
+}
+
+// Runs when a thread that cached buffers exits
+static void release_thread_cache(void *cache_pointer)
+{
+    buffer_cache *cache = cache_pointer;
+
+    for (int size_class = 0; size_class < POOL_CLASSES; size_class++)
+    {
+        free_node *node = cache->free_list[size_class];
+        while (node != NULL)
+        {
+            free_node *next = node->next;
+            free(node);
+            node = next;
+        }
+        cache->free_list[size_class] = NULL;
+        cache->free_count[size_class] = 0;
+    }
+}
+
+static void create_cache_key(void)
+{
+    pthread_key_create(&cache_key, release_thread_cache);
+}
+
+// @return the class holding size bytes, -1 when size is above POOL_MAX_BUFFER
+static int size_class_of(size_t size)
+{
+    int size_class = 0;
+
+    while (size_class < POOL_CLASSES && ((size_t)POOL_MIN_BUFFER << size_class) < size)
+    {
+        size_class++;
+    }
+    return size_class < POOL_CLASSES ? size_class : -1;
+}
+
+void *buffer_get(size_t size, size_t *capacity)
+{
+    int size_class = size_class_of(size);
+
+    if (size_class == -1)
+    {
+        *capacity = size;
+        return malloc(size);
+    }
+    *capacity = (size_t)POOL_MIN_BUFFER << size_class;
+    free_node *node = thread_cache.free_list[size_class];
+    if (node == NULL)
+    {
+        return malloc(*capacity);
+    }
+    thread_cache.free_list[size_class] = node->next;
+    thread_cache.free_count[size_class]--;
+    return node;
+}
+
+void buffer_put(void *buffer, size_t capacity)
+{
+    free_node *node = buffer;
+    int size_class = size_class_of(capacity);
+
+    if (buffer == NULL)
+    {
+        return;
+    }
+    // Only exact class sizes are cached, and only up to POOL_CACHE_BYTES per class
+    if (size_class == -1 || ((size_t)POOL_MIN_BUFFER << size_class) != capacity ||
+        thread_cache.free_count[size_class] * capacity >= POOL_CACHE_BYTES)
+    {
+        free(buffer);
+        return;
+    }
+    if (!thread_cache_registered)
+    {
+        pthread_once(&cache_key_once, create_cache_key);
+        pthread_setspecific(cache_key, &thread_cache);
+        thread_cache_registered = true;
+    }
+    node->next = thread_cache.free_list[size_class];
+    thread_cache.free_list[size_class] = node;
+    thread_cache.free_count[size_class]++;
+}
@@ -0,0 +1,52 @@
+/******************************************************
+# Per-thread memory pools for aesdsocket
+# Connection objects and I/O buffers are recycled through free lists
+# owned by a single thread, so a server in steady state handles
+# requests without calling malloc() and threads never contend on
+# allocator locks.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef POOL_H
+#define POOL_H
+
+#include <stddef.h>
+
+// Buffer size classes are the powers of two from POOL_MIN_BUFFER to POOL_MAX_BUFFER
+#define POOL_MIN_BUFFER 1024
+#define POOL_MAX_BUFFER (128 * 1024)
+// Bytes each thread keeps cached per buffer size class, the rest goes back to malloc
+#define POOL_CACHE_BYTES (1024 * 1024)
+
+// Free list of equally sized objects, used by one thread only
+typedef struct
+{
+    size_t object_size;
+    void *free_list;
+    size_t free_count;
+    size_t max_free;
+} object_pool;
+
+void object_pool_init(object_pool *pool, size_t object_size, size_t max_free);
+
+// Frees the cached objects, objects still handed out must be put back first
+void object_pool_destroy(object_pool *pool);
+
+/**
+ * Takes an object from the free list, falling back to malloc().
+ * @return a zeroed object, NULL when out of memory
+ */
+void *object_pool_get(object_pool *pool);
+
+void object_pool_put(object_pool *pool, void *object);
+
+/**
+ * Takes a buffer of at least size bytes from the calling thread's cache, falling back to
+ * malloc(). Sizes above POOL_MAX_BUFFER are always allocated with malloc().
+ * @return the buffer, NULL when out of memory; *capacity receives its usable size
+ */
+void *buffer_get(size_t size, size_t *capacity);
+
+// Returns a buffer obtained from buffer_get() to the calling thread's cache
+void buffer_put(void *buffer, size_t capacity);
+
+#endif /* POOL_H */
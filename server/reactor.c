@@ -0,0 +1,690 @@
+/******************************************************
+# Edge triggered epoll reactor for aesdsocket
+# A fixed set of reactor threads each own an epoll instance. The
+# listening socket is registered with EPOLLEXCLUSIVE in every reactor
+# so a new connection wakes only one of them, and the accepted
+# non-blocking client is then served entirely by that reactor.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/queue.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "aesdsocket.h"
+#include "replay.h"
+#include "commit.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+#include "timestamp.h"
+#include "lifecycle.h"
+
+#define REACTOR_MAX_EVENTS 64
+#define REACTOR_CACHED_CONNECTIONS 256 // Closed connection objects kept for reuse per reactor
+
+typedef struct reactor_conn
+{
+    int client_fd;
+    int file_fd;
+    char client_ip[INET6_ADDRSTRLEN];
+    line_framer framer;
+    bool stored;      // At least one packet of this connection is stored
+    bool peer_closed;
+    commit_request commit;
+    bool commit_pending; // The framer must not be touched until the writer is done with commit
+    bool replaying;
+    off_t replay_offset;
+    uint64_t replay_start_usec;
+    off_t cursor; // Incremental replay: end of the data the client already received
+    replay_state replay;
+    struct reactor *owner;
+    long last_active_ms; // Keep-alive idle timeout, connections are ordered by this
+    bool closed;         // Later events of the current epoll batch still point here
+    TAILQ_ENTRY(reactor_conn) entry;
+} reactor_conn;
+
+typedef struct reactor
+{
+    pthread_t thread_id;
+    int epoll_fd;
+    int listen_fd;
+    int stop_fd;
+    int notify_fd; // Signalled by the group commit writer when a request of this reactor is durable
+    int timer_fd;  // Timestamp timer, watched by the first reactor only, -1 elsewhere
+    bool draining; // Not accepting any more, closing each connection once its request is answered
+    long drain_deadline_ms;
+    TAILQ_HEAD(ConnList, reactor_conn) connections; // Least recently active first
+    struct ConnList closed;                         // Returned to conn_pool once the epoll batch is handled
+    pthread_mutex_t completed_lock;
+    STAILQ_HEAD(CompletedList, commit_request) completed;
+    int pending_commits;
+    object_pool conn_pool;
+} reactor;
+
+typedef enum
+{
+    CONN_AGAIN, // Waiting for the socket to become readable/writable again
+    CONN_DONE,  // Current stage finished
+    CONN_CLOSE  // Connection should be torn down
+} conn_status;
+
+// Tags used as epoll user data for the non-client descriptors
+static char listen_tag;
+static char stop_tag;
+static char notify_tag;
+static char timer_tag;
+
+static void get_client_ip(const struct sockaddr_storage *addr, char *client_ip, size_t len)
+{
+    client_ip[0] = '\0';
+    if (addr->ss_family == AF_INET)
+    {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, client_ip, len);
+    }
+    else if (addr->ss_family == AF_INET6)
+    {
+        inet_ntop(AF_INET6, &((const struct sockaddr_in6 *)addr)->sin6_addr, client_ip, len);
+    }
+}
+
+static long monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void close_connection(reactor *r, reactor_conn *conn)
+{
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, conn->client_fd, NULL);
+    if (close(conn->client_fd) == 0)
+    {
+        aesd_log(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    }
+    else
+    {
+        aesd_log(LOG_ERR, "Closing of connection from %s failed", conn->client_ip);
+    }
+    storage_detach(conn->file_fd);
+    TAILQ_REMOVE(&r->connections, conn, entry);
+    metrics_gauge_add(METRIC_ACTIVE_CLIENTS, -1);
+    framer_release(&conn->framer);
+    replay_state_release(&conn->replay);
+    conn->closed = true;
+    TAILQ_INSERT_TAIL(&r->closed, conn, entry);
+}
+
+// Recycles the connections closed while handling the last epoll batch
+static void release_closed(reactor *r)
+{
+    reactor_conn *conn;
+
+    while ((conn = TAILQ_FIRST(&r->closed)) != NULL)
+    {
+        TAILQ_REMOVE(&r->closed, conn, entry);
+        object_pool_put(&r->conn_pool, conn);
+    }
+}
+
+static void accept_connections(reactor *r)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size;
+    struct epoll_event event;
+
+    while (!exit_main_loop)
+    {
+        client_addr_size = sizeof(client_addr);
+        int client_fd = accept4(r->listen_fd, (struct sockaddr *)&client_addr, &client_addr_size, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_fd == -1)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                aesd_log(LOG_ERR, "Error occurred during accept operation: %s", strerror(errno));
+            }
+            return;
+        }
+
+        reactor_conn *conn = object_pool_get(&r->conn_pool);
+        if (conn == NULL)
+        {
+            aesd_log(LOG_ERR, "Failed to allocate memory for connection state");
+            close(client_fd);
+            continue;
+        }
+        conn->client_fd = client_fd;
+        conn->owner = r;
+        framer_init(&conn->framer);
+        replay_state_init(&conn->replay);
+        get_client_ip(&client_addr, conn->client_ip, sizeof(conn->client_ip));
+
+        // The driver is opened once per client, the file backend shares one descriptor
+        if (storage_attach(&conn->file_fd) == -1)
+        {
+            close(client_fd);
+            object_pool_put(&r->conn_pool, conn);
+            continue;
+        }
+
+        event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        event.data.ptr = conn;
+        if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, client_fd, &event) == -1)
+        {
+            aesd_log(LOG_ERR, "Failed to register client with epoll: %s", strerror(errno));
+            storage_detach(conn->file_fd);
+            close(client_fd);
+            object_pool_put(&r->conn_pool, conn);
+            continue;
+        }
+        conn->last_active_ms = monotonic_ms();
+        TAILQ_INSERT_TAIL(&r->connections, conn, entry);
+        metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+        metrics_gauge_add(METRIC_ACTIVE_CLIENTS, 1);
+        aesd_log(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+    }
+}
+
+// Runs on the group commit writer thread, hands the request back to its reactor
+static void commit_completed(commit_request *request)
+{
+    reactor *r = ((reactor_conn *)request->context)->owner;
+    uint64_t notify = 1;
+
+    pthread_mutex_lock(&r->completed_lock);
+    STAILQ_INSERT_TAIL(&r->completed, request, entry);
+    pthread_mutex_unlock(&r->completed_lock);
+    if (write(r->notify_fd, &notify, sizeof(notify)) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to notify reactor of a commit: %s", strerror(errno));
+    }
+}
+
+static int store_packet(reactor_conn *conn, const line_packet *packet)
+{
+    int status = 0;
+
+    if (server_config.incremental_replay && packet->spill_len == 0 && handle_cursor_command(packet->data, packet->len, &conn->cursor))
+    {
+        conn->stored = true;
+        return 0;
+    }
+    if (packet->spill_len == 0)
+    {
+        status = handle_seek_command(conn->file_fd, packet->data, packet->len, &conn->cursor);
+    }
+    if (status == 0 && commit_enabled())
+    {
+        // The packet stays in the framer buffer until the writer calls commit_completed()
+        commit_request_init(&conn->commit, packet->data, packet->len);
+        conn->commit.spill_fd = packet->spill_fd;
+        conn->commit.spill_len = packet->spill_len;
+        conn->commit.on_complete = commit_completed;
+        conn->commit.context = conn;
+        conn->commit_pending = true;
+        conn->owner->pending_commits++;
+        commit_submit(&conn->commit);
+        return 0;
+    }
+    if (status == 0)
+    {
+        status = write_framed_packet(conn->file_fd, packet);
+    }
+    conn->stored = status != -1;
+    return status;
+}
+
+// Reads everything available on the socket and stores each complete packet,
+// or only the next one in keep-alive mode
+static conn_status receive_packets(reactor_conn *conn)
+{
+    line_packet packet;
+
+    while (true)
+    {
+        if (conn->commit_pending)
+        {
+            return CONN_AGAIN;
+        }
+        // Keep-alive answers each packet before the next one is stored
+        if (conn->stored && server_config.keep_alive)
+        {
+            return CONN_DONE;
+        }
+        if (framer_next(&conn->framer, &packet) == FRAME_PACKET)
+        {
+            if (store_packet(conn, &packet) == -1)
+            {
+                return CONN_CLOSE;
+            }
+            continue;
+        }
+        if (conn->peer_closed)
+        {
+            return conn->stored ? CONN_DONE : CONN_CLOSE;
+        }
+
+        ssize_t received = framer_recv(&conn->framer, conn->client_fd);
+        if (received == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                return conn->stored ? CONN_DONE : CONN_AGAIN;
+            }
+            aesd_log(LOG_ERR, "Receive from %s failed: %s", conn->client_ip, strerror(errno));
+            return CONN_CLOSE;
+        }
+        if (received == 0)
+        {
+            // Peer finished sending, store whatever was received like the threaded server does
+            conn->peer_closed = true;
+            if (framer_flush(&conn->framer, &packet) == FRAME_PACKET && store_packet(conn, &packet) == -1)
+            {
+                return CONN_CLOSE;
+            }
+        }
+    }
+}
+
+// Streams the data file to the client, resuming where the last partial send stopped
+static conn_status replay_to_client(reactor_conn *conn)
+{
+    // Reads stop at the end snapshotted in start_replay()
+    replay_status status = storage_replay(conn->client_fd, conn->file_fd, &conn->replay_offset, &conn->replay);
+
+    if (status == REPLAY_AGAIN)
+    {
+        return CONN_AGAIN;
+    }
+    return status == REPLAY_DONE ? CONN_DONE : CONN_CLOSE;
+}
+
+static void start_replay(reactor_conn *conn)
+{
+    conn->replay_offset = conn->cursor;
+    conn->replay.end = storage_replay_end();
+    conn->replaying = true;
+    conn->replay_start_usec = metrics_now_usec();
+    conn->stored = false;
+    aesd_log(LOG_DEBUG, "Sending back the received data to client");
+}
+
+static void handle_connection(reactor *r, reactor_conn *conn, uint32_t events)
+{
+    conn_status status = CONN_DONE;
+
+    // The connection resumes from drain_completed(), errors then show up on the next recv/send
+    if (conn->closed || conn->commit_pending)
+    {
+        return;
+    }
+    if (events & EPOLLERR)
+    {
+        close_connection(r, conn);
+        return;
+    }
+
+    conn->last_active_ms = monotonic_ms();
+    TAILQ_REMOVE(&r->connections, conn, entry);
+    TAILQ_INSERT_TAIL(&r->connections, conn, entry);
+
+    while (status == CONN_DONE)
+    {
+        if (conn->replaying)
+        {
+            status = replay_to_client(conn);
+            if (status != CONN_DONE)
+            {
+                break;
+            }
+            conn->replaying = false;
+            metrics_observe_since(METRIC_REPLAY_LATENCY, conn->replay_start_usec);
+            // The next incremental replay starts where this one ended, otherwise at the beginning
+            conn->cursor = server_config.incremental_replay ? conn->replay_offset : 0;
+            if (!server_config.keep_alive || r->draining)
+            {
+                status = CONN_CLOSE;
+                break;
+            }
+        }
+        status = receive_packets(conn);
+        if (status == CONN_DONE)
+        {
+            start_replay(conn);
+        }
+    }
+    if (status == CONN_CLOSE)
+    {
+        close_connection(r, conn);
+    }
+}
+
+// Closes keep-alive connections idle for longer than the timeout
+// @return time in ms until the next connection may expire, -1 when nothing is waiting
+static int expire_idle_connections(reactor *r)
+{
+    long now = monotonic_ms();
+    reactor_conn *conn;
+
+    if (!server_config.keep_alive)
+    {
+        return -1;
+    }
+    while ((conn = TAILQ_FIRST(&r->connections)) != NULL)
+    {
+        long idle_ms = now - conn->last_active_ms;
+        if (idle_ms < server_config.idle_timeout_ms)
+        {
+            return server_config.idle_timeout_ms - idle_ms;
+        }
+        if (conn->commit_pending)
+        {
+            // Still referenced by the writer, check again after the commit
+            conn->last_active_ms = now;
+            TAILQ_REMOVE(&r->connections, conn, entry);
+            TAILQ_INSERT_TAIL(&r->connections, conn, entry);
+            continue;
+        }
+        aesd_log(LOG_INFO, "Connection from %s idle for %ld ms", conn->client_ip, idle_ms);
+        close_connection(r, conn);
+    }
+    return -1;
+}
+
+// Picks up requests made durable by the writer, resuming their connections unless shutting down
+static void drain_completed(reactor *r, bool resume)
+{
+    struct CompletedList completed;
+    commit_request *request;
+    uint64_t notify;
+
+    if (read(r->notify_fd, &notify, sizeof(notify)) == -1 && errno != EAGAIN)
+    {
+        aesd_log(LOG_ERR, "Failed to read commit notification: %s", strerror(errno));
+    }
+    pthread_mutex_lock(&r->completed_lock);
+    STAILQ_INIT(&completed);
+    STAILQ_CONCAT(&completed, &r->completed);
+    pthread_mutex_unlock(&r->completed_lock);
+
+    while (!STAILQ_EMPTY(&completed))
+    {
+        request = STAILQ_FIRST(&completed);
+        STAILQ_REMOVE_HEAD(&completed, entry);
+        reactor_conn *conn = (reactor_conn *)request->context;
+        conn->commit_pending = false;
+        r->pending_commits--;
+        if (request->status == -1)
+        {
+            aesd_log(LOG_ERR, "Writing received data to the socketdata file failed");
+            close_connection(r, conn);
+            continue;
+        }
+        conn->stored = true;
+        if (resume)
+        {
+            handle_connection(r, conn, 0);
+        }
+    }
+}
+
+// A keep-alive connection between two requests, nothing is lost by closing it
+static bool connection_idle(const reactor_conn *conn)
+{
+    return server_config.keep_alive && !conn->replaying && !conn->commit_pending && !conn->stored &&
+           !framer_has_partial(&conn->framer);
+}
+
+// Stops accepting and closes the idle connections, the others finish their request first
+static void start_drain(reactor *r)
+{
+    reactor_conn *conn, *next;
+
+    r->draining = true;
+    r->drain_deadline_ms = monotonic_ms() + server_config.drain_timeout_ms;
+    // Pending connections stay in the backlog, for a server that took the listener over
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->listen_fd, NULL);
+    // The stop pipe stays readable
+    epoll_ctl(r->epoll_fd, EPOLL_CTL_DEL, r->stop_fd, NULL);
+    for (conn = TAILQ_FIRST(&r->connections); conn != NULL; conn = next)
+    {
+        next = TAILQ_NEXT(conn, entry);
+        if (connection_idle(conn))
+        {
+            close_connection(r, conn);
+        }
+    }
+}
+
+static void *reactor_thread(void *args)
+{
+    reactor *r = (reactor *)args;
+    struct epoll_event events[REACTOR_MAX_EVENTS];
+
+    while (!r->draining || !TAILQ_EMPTY(&r->connections))
+    {
+        int timeout_ms = expire_idle_connections(r);
+        if (r->draining)
+        {
+            timeout_ms = r->drain_deadline_ms - monotonic_ms();
+            if (timeout_ms <= 0)
+            {
+                aesd_log(LOG_WARNING, "Drain timeout expired, closing the remaining connections");
+                break;
+            }
+        }
+        int ready = epoll_wait(r->epoll_fd, events, REACTOR_MAX_EVENTS, timeout_ms);
+        if (ready == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            aesd_log(LOG_ERR, "epoll_wait failed: %s", strerror(errno));
+            break;
+        }
+        for (int i = 0; i < ready; i++)
+        {
+            if (events[i].data.ptr == &stop_tag)
+            {
+                start_drain(r);
+                continue;
+            }
+            if (events[i].data.ptr == &notify_tag)
+            {
+                drain_completed(r, true);
+                continue;
+            }
+            if (events[i].data.ptr == &listen_tag)
+            {
+                accept_connections(r);
+                continue;
+            }
+            if (events[i].data.ptr == &timer_tag)
+            {
+                timestamp_timer_expired(r->timer_fd);
+                continue;
+            }
+            handle_connection(r, (reactor_conn *)events[i].data.ptr, events[i].events);
+        }
+        release_closed(r);
+    }
+
+    // The writer still references connections with a pending commit
+    while (r->pending_commits > 0)
+    {
+        struct pollfd notify = {.fd = r->notify_fd, .events = POLLIN};
+        if (poll(&notify, 1, -1) > 0)
+        {
+            drain_completed(r, false);
+        }
+    }
+    while (!TAILQ_EMPTY(&r->connections))
+    {
+        close_connection(r, TAILQ_FIRST(&r->connections));
+    }
+    release_closed(r);
+    return NULL;
+}
+
+static int setup_reactor(reactor *r, int socket_fd, int timer_fd)
+{
+    struct epoll_event event;
+
+    r->listen_fd = socket_fd;
+    r->stop_fd = lifecycle_stop_fd();
+    r->timer_fd = timer_fd;
+    TAILQ_INIT(&r->connections);
+    TAILQ_INIT(&r->closed);
+    STAILQ_INIT(&r->completed);
+    pthread_mutex_init(&r->completed_lock, NULL);
+    object_pool_init(&r->conn_pool, sizeof(reactor_conn), REACTOR_CACHED_CONNECTIONS);
+    r->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (r->notify_fd == -1)
+    {
+        aesd_log(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        return -1;
+    }
+    r->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (r->epoll_fd == -1)
+    {
+        aesd_log(LOG_ERR, "epoll_create1 failed: %s", strerror(errno));
+        close(r->notify_fd);
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &notify_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->notify_fd, &event) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to register commit notifications with epoll: %s", strerror(errno));
+        close(r->epoll_fd);
+        close(r->notify_fd);
+        return -1;
+    }
+
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.ptr = &listen_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, socket_fd, &event) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to register listening socket with epoll: %s", strerror(errno));
+        close(r->epoll_fd);
+        close(r->notify_fd);
+        return -1;
+    }
+
+    // Level triggered and never drained, so every reactor sees the shutdown request
+    event.events = EPOLLIN;
+    event.data.ptr = &stop_tag;
+    if (epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, r->stop_fd, &event) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to register the stop pipe with epoll: %s", strerror(errno));
+        close(r->epoll_fd);
+        close(r->notify_fd);
+        return -1;
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &timer_tag;
+    if (timer_fd != -1 && epoll_ctl(r->epoll_fd, EPOLL_CTL_ADD, timer_fd, &event) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to register timestamp timer with epoll: %s", strerror(errno));
+        close(r->epoll_fd);
+        close(r->notify_fd);
+        return -1;
+    }
+    return 0;
+}
+
+int run_epoll_reactor(const int *listen_fds, int listen_count)
+{
+    sigset_t block_mask, orig_mask;
+    int started = 0;
+    int timer_fd;
+    int flags;
+    reactor *reactors;
+
+    for (int i = 0; i < listen_count; i++)
+    {
+        flags = fcntl(listen_fds[i], F_GETFL, 0);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            aesd_log(LOG_ERR, "Failed to make listening socket non-blocking: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    reactors = calloc(server_config.worker_threads, sizeof(reactor));
+    if (reactors == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate memory for reactors");
+        return -1;
+    }
+    timer_fd = timestamp_timer_open();
+
+    // Reactors block the signals so their system calls are not interrupted, the stop pipe wakes them
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    for (started = 0; started < server_config.worker_threads; started++)
+    {
+        // One reactor stores the timestamps, alongside its clients' packets
+        if (setup_reactor(&reactors[started], listen_fds[started % listen_count], started == 0 ? timer_fd : -1) == -1)
+        {
+            break;
+        }
+        int err = pthread_create(&reactors[started].thread_id, NULL, reactor_thread, &reactors[started]);
+        if (err != 0)
+        {
+            aesd_log(LOG_ERR, "Error creating reactor thread: %s", strerror(err));
+            close(reactors[started].epoll_fd);
+            close(reactors[started].notify_fd);
+            break;
+        }
+        if (server_config.reuse_port)
+        {
+            bind_thread_to_cpu(reactors[started].thread_id, started);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+    aesd_log(LOG_INFO, "Started %d epoll reactor threads", started);
+
+    // The reactors drain their clients by themselves once a stop is requested
+    if (started > 0)
+    {
+        lifecycle_wait_for_stop();
+        lifecycle_log_stop();
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(reactors[i].thread_id, NULL);
+        close(reactors[i].epoll_fd);
+        close(reactors[i].notify_fd);
+        pthread_mutex_destroy(&reactors[i].completed_lock);
+        object_pool_destroy(&reactors[i].conn_pool);
+    }
+    free(reactors);
+    if (timer_fd != -1)
+    {
+        close(timer_fd);
+    }
+    return started > 0 ? 0 : -1;
+}
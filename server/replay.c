@@ -0,0 +1,382 @@
+/******************************************************
+# Replay of the stored socket data back to a client
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "replay.h"
+#include "metrics.h"
+#include "pool.h"
+#include "log.h"
+
+#define REPLAY_SENDFILE_CHUNK (1024 * 1024 * 1024)
+// Default pipe capacity, one splice fills the pipe completely
+#define REPLAY_SPLICE_CHUNK (64 * 1024)
+// Internal result meaning the zero copy path is not available for this descriptor
+#define REPLAY_UNSUPPORTED (-2)
+
+void replay_state_init(replay_state *state)
+{
+    memset(state, 0, sizeof(replay_state));
+    state->method = REPLAY_METHOD_AUTO;
+    state->pipe_fds[0] = -1;
+    state->pipe_fds[1] = -1;
+    state->end = -1;
+}
+
+void replay_state_release(replay_state *state)
+{
+    if (state->pipe_fds[0] != -1)
+    {
+        close(state->pipe_fds[0]);
+        close(state->pipe_fds[1]);
+    }
+    buffer_put(state->copy_buffer, state->copy_capacity);
+    file_map_release(state->map);
+    seglog_release(&state->segment);
+    replay_state_init(state);
+}
+
+static bool would_block(void)
+{
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+// Bytes to request next, 0 once the replay reached state->end
+static size_t replay_length(const replay_state *state, off_t offset, size_t chunk)
+{
+    if (state->end == -1)
+    {
+        return chunk;
+    }
+    if (offset >= state->end)
+    {
+        return 0;
+    }
+    return state->end - offset < (off_t)chunk ? (size_t)(state->end - offset) : chunk;
+}
+
+static int replay_sendfile(int client_fd, int file_fd, off_t *offset, const replay_state *state)
+{
+    bool sent_any = false;
+
+    while (true)
+    {
+        size_t length = replay_length(state, *offset, REPLAY_SENDFILE_CHUNK);
+        if (length == 0)
+        {
+            return REPLAY_DONE;
+        }
+        ssize_t sent = sendfile(client_fd, file_fd, offset, length);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (would_block())
+            {
+                return REPLAY_AGAIN;
+            }
+            if (!sent_any && (errno == EINVAL || errno == ENOSYS))
+            {
+                return REPLAY_UNSUPPORTED;
+            }
+            aesd_log(LOG_ERR, "sendfile to client failed: %s", strerror(errno));
+            return REPLAY_ERROR;
+        }
+        if (sent == 0)
+        {
+            return REPLAY_DONE;
+        }
+        metrics_count(METRIC_SENT_BYTES, sent);
+        sent_any = true;
+    }
+}
+
+// Sends straight from the shared mapping, the socket copies the bytes without a read() in between
+static int replay_mapped(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    // Keep-alive connections keep their state across replays while the file grows
+    if (state->map != NULL && state->map->capacity < (size_t)state->end)
+    {
+        file_map_release(state->map);
+        state->map = NULL;
+    }
+    if (state->map == NULL)
+    {
+        state->map = file_map_acquire(file_fd, state->end);
+        if (state->map == NULL)
+        {
+            return REPLAY_UNSUPPORTED;
+        }
+    }
+
+    while (true)
+    {
+        size_t length = replay_length(state, *offset, REPLAY_MMAP_MAX);
+        if (length == 0)
+        {
+            return REPLAY_DONE;
+        }
+        ssize_t sent = send(client_fd, state->map->data + *offset, length, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (would_block())
+            {
+                return REPLAY_AGAIN;
+            }
+            aesd_log(LOG_ERR, "Send to client failed: %s", strerror(errno));
+            return REPLAY_ERROR;
+        }
+        *offset += sent;
+        metrics_count(METRIC_SENT_BYTES, sent);
+    }
+}
+
+static int replay_splice(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    if (state->pipe_fds[0] == -1 && pipe2(state->pipe_fds, O_CLOEXEC | O_NONBLOCK) == -1)
+    {
+        aesd_log(LOG_ERR, "Creating the replay pipe failed: %s", strerror(errno));
+        return REPLAY_UNSUPPORTED;
+    }
+
+    while (true)
+    {
+        if (state->pipe_pending == 0)
+        {
+            loff_t position = *offset;
+            size_t length = replay_length(state, *offset, REPLAY_SPLICE_CHUNK);
+            if (length == 0)
+            {
+                return REPLAY_DONE;
+            }
+            ssize_t moved = splice(file_fd, &position, state->pipe_fds[1], NULL, length, SPLICE_F_MOVE);
+            if (moved == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                // Drivers without splice_read support report EINVAL
+                if (errno == EINVAL || errno == ENOSYS)
+                {
+                    return REPLAY_UNSUPPORTED;
+                }
+                aesd_log(LOG_ERR, "splice from the data file failed: %s", strerror(errno));
+                return REPLAY_ERROR;
+            }
+            if (moved == 0)
+            {
+                return REPLAY_DONE;
+            }
+            *offset = position;
+            state->pipe_pending = moved;
+        }
+
+        ssize_t sent = splice(state->pipe_fds[0], NULL, client_fd, NULL, state->pipe_pending, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (would_block())
+            {
+                return REPLAY_AGAIN;
+            }
+            aesd_log(LOG_ERR, "splice to client failed: %s", strerror(errno));
+            return REPLAY_ERROR;
+        }
+        state->pipe_pending -= sent;
+        metrics_count(METRIC_SENT_BYTES, sent);
+    }
+}
+
+static int replay_copy(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    if (state->copy_buffer == NULL)
+    {
+        state->copy_buffer = buffer_get(REPLAY_COPY_CHUNK, &state->copy_capacity);
+        if (state->copy_buffer == NULL)
+        {
+            aesd_log(LOG_ERR, "Replay buffer allocation failed");
+            return REPLAY_ERROR;
+        }
+    }
+
+    while (true)
+    {
+        if (state->copy_pos == state->copy_len)
+        {
+            size_t length = replay_length(state, *offset, REPLAY_COPY_CHUNK);
+            if (length == 0)
+            {
+                return REPLAY_DONE;
+            }
+            ssize_t bytes_read = pread(file_fd, state->copy_buffer, length, *offset);
+            if (bytes_read == -1)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                aesd_log(LOG_ERR, "Reading the data file for replay failed: %s", strerror(errno));
+                return REPLAY_ERROR;
+            }
+            if (bytes_read == 0)
+            {
+                return REPLAY_DONE;
+            }
+            *offset += bytes_read;
+            state->copy_len = bytes_read;
+            state->copy_pos = 0;
+        }
+
+        ssize_t sent = send(client_fd, state->copy_buffer + state->copy_pos, state->copy_len - state->copy_pos, MSG_NOSIGNAL);
+        if (sent == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (would_block())
+            {
+                return REPLAY_AGAIN;
+            }
+            aesd_log(LOG_ERR, "Send to client failed: %s", strerror(errno));
+            return REPLAY_ERROR;
+        }
+        state->copy_pos += sent;
+        metrics_count(METRIC_SENT_BYTES, sent);
+    }
+}
+
+static replay_method choose_method(int file_fd)
+{
+    struct stat file_stat;
+
+    if (fstat(file_fd, &file_stat) == -1)
+    {
+        return REPLAY_METHOD_COPY;
+    }
+    if (S_ISREG(file_stat.st_mode))
+    {
+        return REPLAY_METHOD_SENDFILE;
+    }
+    if (S_ISCHR(file_stat.st_mode))
+    {
+        return REPLAY_METHOD_SPLICE;
+    }
+    return REPLAY_METHOD_COPY;
+}
+
+static replay_status replay_file(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    int status;
+
+    if (state->method == REPLAY_METHOD_AUTO)
+    {
+        state->method = choose_method(file_fd);
+    }
+
+    if (state->method == REPLAY_METHOD_SENDFILE)
+    {
+        // A short range is cheaper to copy out of the page cache than to push through sendfile()
+        if (state->end != -1 && state->end - *offset <= REPLAY_MMAP_MAX)
+        {
+            status = replay_mapped(client_fd, file_fd, offset, state);
+            if (status != REPLAY_UNSUPPORTED)
+            {
+                return status;
+            }
+        }
+        status = replay_sendfile(client_fd, file_fd, offset, state);
+        if (status != REPLAY_UNSUPPORTED)
+        {
+            return status;
+        }
+        state->method = REPLAY_METHOD_COPY;
+    }
+    if (state->method == REPLAY_METHOD_SPLICE)
+    {
+        status = replay_splice(client_fd, file_fd, offset, state);
+        if (status != REPLAY_UNSUPPORTED)
+        {
+            return status;
+        }
+        aesd_log(LOG_DEBUG, "splice is not supported for the data file, copying instead");
+        state->method = REPLAY_METHOD_COPY;
+    }
+    return replay_copy(client_fd, file_fd, offset, state);
+}
+
+// Sends the log one segment at a time, each segment is a plain file for replay_file()
+static replay_status replay_segments(int client_fd, off_t *offset, replay_state *state)
+{
+    off_t requested_end = state->end;
+    off_t end = requested_end == -1 ? seglog_length() : requested_end;
+
+    while (*offset < end)
+    {
+        if (state->segment.segment == NULL)
+        {
+            if (!seglog_acquire(*offset, &state->segment))
+            {
+                break;
+            }
+            if (*offset < state->segment.base)
+            {
+                // Retention dropped the data at the client's position, go on with the oldest kept
+                *offset = state->segment.base;
+                continue;
+            }
+        }
+        off_t start = *offset;
+        off_t segment_offset = *offset - state->segment.base;
+        off_t segment_end = state->segment.base + state->segment.length;
+        // Never past the durable data of the segment, the mapping has nothing readable beyond it
+        state->end = (end < segment_end ? end : segment_end) - state->segment.base;
+        replay_status status = replay_file(client_fd, state->segment.fd, &segment_offset, state);
+        state->end = requested_end;
+        *offset = state->segment.base + segment_offset;
+        if (status != REPLAY_DONE)
+        {
+            // The segment stays pinned until the socket is writable again
+            return status;
+        }
+        // The next segment is another file with its own mapping
+        file_map_release(state->map);
+        state->map = NULL;
+        seglog_release(&state->segment);
+        if (*offset == start)
+        {
+            break;
+        }
+    }
+    seglog_release(&state->segment);
+    return REPLAY_DONE;
+}
+
+replay_status replay_socketdata(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    if (seglog_enabled())
+    {
+        return replay_segments(client_fd, offset, state);
+    }
+    return replay_file(client_fd, file_fd, offset, state);
+}
@@ -0,0 +1,61 @@
+/******************************************************
+# Replay of the stored socket data back to a client
+# Regular files are sent with sendfile(), short ranges of them straight
+# from a shared mapping, character devices are spliced through a pipe,
+# and anything else falls back to a large buffer copy.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include "seglog.h"
+#include "filemap.h"
+
+#define REPLAY_COPY_CHUNK (128 * 1024)
+// Replays of a regular file up to this long are sent from its mapping instead of with sendfile()
+#define REPLAY_MMAP_MAX (64 * 1024)
+
+typedef enum
+{
+    REPLAY_ERROR = -1, // Reading the data or sending to the client failed
+    REPLAY_AGAIN = 0,  // The non-blocking socket is full, call again once it is writable
+    REPLAY_DONE = 1    // Everything up to the end of the data was sent
+} replay_status;
+
+typedef enum
+{
+    REPLAY_METHOD_AUTO,
+    REPLAY_METHOD_SENDFILE,
+    REPLAY_METHOD_SPLICE,
+    REPLAY_METHOD_COPY
+} replay_method;
+
+// Progress of one replay, kept across calls when the socket would block
+typedef struct
+{
+    replay_method method;
+    int pipe_fds[2];     // Splice pipe, data moved into it but not yet sent stays there
+    size_t pipe_pending;
+    char *copy_buffer;   // Fallback buffer, allocated on first use
+    size_t copy_capacity;
+    size_t copy_len;
+    size_t copy_pos;
+    file_map *map;       // Mapping of the file being sent, taken on first use and replaced once outgrown
+    off_t end;           // Replay stops at this offset, -1 to send up to the current end of the data
+    seglog_view segment; // Segment being sent when the data lives in the segmented log
+} replay_state;
+
+void replay_state_init(replay_state *state);
+void replay_state_release(replay_state *state);
+
+/**
+ * Sends file_fd from *offset to state->end, or to its current end, to client_fd. *offset is
+ * advanced past the data that was read. Works with blocking and non-blocking sockets.
+ * Any necessary locking of file_fd must be performed by the caller. When the segmented log
+ * is enabled, offsets are stream offsets and file_fd is not used.
+ */
+replay_status replay_socketdata(int client_fd, int file_fd, off_t *offset, replay_state *state);
+
+#endif /* REPLAY_H */
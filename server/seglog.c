@@ -0,0 +1,654 @@
+/******************************************************
+# Segmented append-only log for the aesdsocket file backend
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "seglog.h"
+#include "filemap.h"
+#include "log.h"
+
+#define SEGLOG_NAME_DIGITS 20
+#define SEGLOG_SCAN_CHUNK (64 * 1024)
+
+typedef struct log_segment
+{
+    off_t base;
+    uint64_t first_record; // Number of the first record, counted from the oldest segment at startup
+    uint64_t records;      // Durable records
+    off_t length;          // Durable bytes
+    // Owned by the serialized writer
+    off_t written;
+    uint64_t written_records;
+    uint64_t indexed; // Entries already in the index file
+    int fd;
+    int index_fd;
+    int refs; // Readers, plus one while the segment is part of the log
+} log_segment;
+
+static struct
+{
+    pthread_mutex_t lock; // Segment list, durable lengths and reference counts
+    char dir[PATH_MAX];
+    off_t segment_bytes;
+    off_t retain_bytes;
+    log_segment **segments; // Oldest first, the last one is the active segment
+    size_t count;
+    size_t capacity;
+    off_t durable_end;
+    bool enabled;
+    // Owned by the serialized writer
+    size_t unsynced;   // First segment holding data that is not durable yet
+    uint32_t *pending; // Index entries of the active segment not yet in its index file
+    size_t pending_count;
+    size_t pending_capacity;
+    size_t reserved; // Entries of records handed a descriptor but not reported yet
+} seglog = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+};
+
+static void segment_path(char *path, size_t size, off_t base, const char *suffix)
+{
+    snprintf(path, size, "%s/%0*lld.%s", seglog.dir, SEGLOG_NAME_DIGITS, (long long)base, suffix);
+}
+
+static void unlink_segment(off_t base)
+{
+    char path[PATH_MAX];
+
+    segment_path(path, sizeof(path), base, "log");
+    unlink(path);
+    segment_path(path, sizeof(path), base, "idx");
+    unlink(path);
+}
+
+static void put_segment(log_segment *segment)
+{
+    if (--segment->refs == 0)
+    {
+        file_map_forget(segment->fd);
+        close(segment->fd);
+        close(segment->index_fd);
+        free(segment);
+    }
+}
+
+static int add_segment(log_segment *segment)
+{
+    if (seglog.count == seglog.capacity)
+    {
+        size_t capacity = seglog.capacity ? seglog.capacity * 2 : 16;
+        log_segment **segments = realloc(seglog.segments, capacity * sizeof(log_segment *));
+        if (segments == NULL)
+        {
+            return -1;
+        }
+        seglog.segments = segments;
+        seglog.capacity = capacity;
+    }
+    seglog.segments[seglog.count++] = segment;
+    return 0;
+}
+
+static log_segment *open_segment(off_t base, bool create)
+{
+    char path[PATH_MAX];
+    int flags = O_RDWR | O_APPEND | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0);
+
+    log_segment *segment = calloc(1, sizeof(log_segment));
+    if (segment == NULL)
+    {
+        return NULL;
+    }
+    segment->base = base;
+    segment->refs = 1;
+    segment_path(path, sizeof(path), base, "log");
+    segment->fd = open(path, flags, 0644);
+    if (segment->fd == -1)
+    {
+        aesd_log(LOG_ERR, "Opening log segment %s failed: %s", path, strerror(errno));
+        free(segment);
+        return NULL;
+    }
+    segment_path(path, sizeof(path), base, "idx");
+    segment->index_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (segment->index_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Opening segment index %s failed: %s", path, strerror(errno));
+        close(segment->fd);
+        free(segment);
+        return NULL;
+    }
+    return segment;
+}
+
+static int read_entry(const log_segment *segment, uint64_t entry, uint32_t *end)
+{
+    return pread(segment->index_fd, end, sizeof(*end), entry * sizeof(*end)) == sizeof(*end) ? 0 : -1;
+}
+
+static int write_entries(const log_segment *segment, uint64_t first, const uint32_t *ends, size_t count)
+{
+    const char *data = (const char *)ends;
+    size_t len = count * sizeof(*ends);
+    off_t position = first * sizeof(*ends);
+
+    while (len > 0)
+    {
+        ssize_t written = pwrite(segment->index_fd, data, len, position);
+        if (written == -1)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        data += written;
+        len -= written;
+        position += written;
+    }
+    return 0;
+}
+
+/**
+ * Brings the index of a recovered segment in line with its data: entries past the data are
+ * dropped and data past the last entry is split into records at newlines.
+ */
+static int recover_index(log_segment *segment)
+{
+    struct stat data_stat, index_stat;
+    uint32_t end = 0;
+    char chunk[SEGLOG_SCAN_CHUNK];
+
+    if (fstat(segment->fd, &data_stat) == -1 || fstat(segment->index_fd, &index_stat) == -1)
+    {
+        return -1;
+    }
+    segment->length = data_stat.st_size;
+    segment->records = index_stat.st_size / sizeof(uint32_t);
+    // Entries written after the data they describe was lost
+    while (segment->records > 0)
+    {
+        if (read_entry(segment, segment->records - 1, &end) == -1)
+        {
+            return -1;
+        }
+        if ((off_t)end <= segment->length)
+        {
+            break;
+        }
+        segment->records--;
+    }
+    if (segment->records == 0)
+    {
+        end = 0;
+    }
+    if (ftruncate(segment->index_fd, segment->records * sizeof(uint32_t)) == -1)
+    {
+        return -1;
+    }
+
+    // Records synced to the data file whose index entries were never written
+    off_t position = end;
+    while (position < segment->length)
+    {
+        ssize_t bytes_read = pread(segment->fd, chunk, sizeof(chunk), position);
+        if (bytes_read <= 0)
+        {
+            return -1;
+        }
+        for (ssize_t i = 0; i < bytes_read; i++)
+        {
+            if (chunk[i] == '\n')
+            {
+                end = position + i + 1;
+                if (write_entries(segment, segment->records, &end, 1) == -1)
+                {
+                    return -1;
+                }
+                segment->records++;
+            }
+        }
+        position += bytes_read;
+    }
+    // A final packet stored without a newline
+    if ((off_t)end < segment->length)
+    {
+        end = segment->length;
+        if (write_entries(segment, segment->records, &end, 1) == -1)
+        {
+            return -1;
+        }
+        segment->records++;
+    }
+    segment->written = segment->length;
+    segment->written_records = segment->records;
+    segment->indexed = segment->records;
+    return 0;
+}
+
+static int compare_offsets(const void *a, const void *b)
+{
+    off_t left = *(const off_t *)a;
+    off_t right = *(const off_t *)b;
+
+    return left < right ? -1 : left > right;
+}
+
+// Opens the segments left by a previous run in stream order
+static int recover_segments(void)
+{
+    DIR *dir;
+    struct dirent *entry;
+    off_t *bases = NULL;
+    size_t count = 0, capacity = 0;
+    int status = 0;
+
+    dir = opendir(seglog.dir);
+    if (dir == NULL)
+    {
+        aesd_log(LOG_ERR, "Opening %s failed: %s", seglog.dir, strerror(errno));
+        return -1;
+    }
+    while ((entry = readdir(dir)) != NULL)
+    {
+        char *end;
+        if (strlen(entry->d_name) != SEGLOG_NAME_DIGITS + 4 || strcmp(entry->d_name + SEGLOG_NAME_DIGITS, ".log") != 0)
+        {
+            continue;
+        }
+        long long base = strtoll(entry->d_name, &end, 10);
+        if (end != entry->d_name + SEGLOG_NAME_DIGITS || base < 0)
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 16;
+            off_t *grown = realloc(bases, capacity * sizeof(off_t));
+            if (grown == NULL)
+            {
+                status = -1;
+                break;
+            }
+            bases = grown;
+        }
+        bases[count++] = base;
+    }
+    closedir(dir);
+    if (status == 0 && count > 0)
+    {
+        qsort(bases, count, sizeof(off_t), compare_offsets);
+    }
+
+    for (size_t i = 0; i < count && status == 0; i++)
+    {
+        log_segment *previous = seglog.count ? seglog.segments[seglog.count - 1] : NULL;
+        log_segment *segment = open_segment(bases[i], false);
+        if (segment == NULL || recover_index(segment) == -1)
+        {
+            aesd_log(LOG_ERR, "Recovering log segment at offset %lld failed", (long long)bases[i]);
+            if (segment != NULL)
+            {
+                put_segment(segment);
+            }
+            status = -1;
+            break;
+        }
+        if (previous != NULL)
+        {
+            if (previous->base + previous->length != segment->base)
+            {
+                // The previous segment lost its unsynced tail, later segments were never acknowledged
+                aesd_log(LOG_WARNING, "Dropping log segments from offset %lld, the previous segment ends at %lld",
+                         (long long)segment->base, (long long)(previous->base + previous->length));
+                put_segment(segment);
+                for (size_t j = i; j < count; j++)
+                {
+                    unlink_segment(bases[j]);
+                }
+                break;
+            }
+            segment->first_record = previous->first_record + previous->records;
+        }
+        if (add_segment(segment) == -1)
+        {
+            put_segment(segment);
+            status = -1;
+        }
+    }
+    free(bases);
+    return status;
+}
+
+int seglog_open(const char *dir, off_t segment_bytes, off_t retain_bytes)
+{
+    snprintf(seglog.dir, sizeof(seglog.dir), "%s", dir);
+    seglog.segment_bytes = segment_bytes < SEGLOG_MAX_SEGMENT_BYTES ? segment_bytes : SEGLOG_MAX_SEGMENT_BYTES;
+    seglog.retain_bytes = retain_bytes;
+    if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+    {
+        aesd_log(LOG_ERR, "Creating %s failed: %s", dir, strerror(errno));
+        return -1;
+    }
+    if (recover_segments() == -1)
+    {
+        seglog_close();
+        return -1;
+    }
+    if (seglog.count == 0)
+    {
+        log_segment *segment = open_segment(0, true);
+        if (segment == NULL || add_segment(segment) == -1)
+        {
+            seglog_close();
+            return -1;
+        }
+    }
+    log_segment *active = seglog.segments[seglog.count - 1];
+    seglog.durable_end = active->base + active->length;
+    seglog.unsynced = seglog.count - 1;
+    seglog.enabled = true;
+    aesd_log(LOG_INFO, "Segmented log in %s: %zu segments, %llu records, %lld bytes", dir, seglog.count,
+             (unsigned long long)(active->first_record + active->records - seglog.segments[0]->first_record),
+             (long long)(active->base + active->length - seglog.segments[0]->base));
+    return 0;
+}
+
+void seglog_close(void)
+{
+    pthread_mutex_lock(&seglog.lock);
+    for (size_t i = 0; i < seglog.count; i++)
+    {
+        put_segment(seglog.segments[i]);
+    }
+    free(seglog.segments);
+    seglog.segments = NULL;
+    seglog.count = 0;
+    seglog.capacity = 0;
+    seglog.enabled = false;
+    pthread_mutex_unlock(&seglog.lock);
+    free(seglog.pending);
+    seglog.pending = NULL;
+    seglog.pending_count = 0;
+    seglog.pending_capacity = 0;
+    seglog.reserved = 0;
+}
+
+bool seglog_enabled(void)
+{
+    return seglog.enabled;
+}
+
+// Writes the index entries of the active segment's new records, the index is never synced
+static int flush_pending(log_segment *active)
+{
+    if (write_entries(active, active->indexed, seglog.pending, seglog.pending_count) == -1)
+    {
+        return -1;
+    }
+    active->indexed += seglog.pending_count;
+    seglog.pending_count = 0;
+    return 0;
+}
+
+bool seglog_append_rotates(off_t unaccounted_len, off_t record_len)
+{
+    off_t written = seglog.segments[seglog.count - 1]->written + unaccounted_len;
+
+    // An empty segment takes any record
+    return written != 0 && written + record_len > seglog.segment_bytes;
+}
+
+// Makes room for the index entry of one more record before its data is written
+static int reserve_entry(void)
+{
+    if (seglog.pending_count + seglog.reserved == seglog.pending_capacity)
+    {
+        size_t capacity = seglog.pending_capacity ? seglog.pending_capacity * 2 : 256;
+        uint32_t *pending = realloc(seglog.pending, capacity * sizeof(uint32_t));
+        if (pending == NULL)
+        {
+            aesd_log(LOG_ERR, "Growing the pending index entries failed");
+            return -1;
+        }
+        seglog.pending = pending;
+        seglog.pending_capacity = capacity;
+    }
+    seglog.reserved++;
+    return 0;
+}
+
+int seglog_append_fd(off_t record_len)
+{
+    log_segment *active = seglog.segments[seglog.count - 1];
+
+    if (!seglog_append_rotates(0, record_len))
+    {
+        return reserve_entry() == -1 ? -1 : active->fd;
+    }
+
+    // Records never span segments, the full one is made durable by the next seglog_sync()
+    if (flush_pending(active) == -1)
+    {
+        return -1;
+    }
+    log_segment *segment = open_segment(active->base + active->written, true);
+    if (segment == NULL)
+    {
+        return -1;
+    }
+    segment->first_record = active->first_record + active->written_records;
+    pthread_mutex_lock(&seglog.lock);
+    int status = add_segment(segment);
+    pthread_mutex_unlock(&seglog.lock);
+    if (status == -1)
+    {
+        put_segment(segment);
+        return -1;
+    }
+    aesd_log(LOG_DEBUG, "Started log segment at offset %lld", (long long)segment->base);
+    return reserve_entry() == -1 ? -1 : segment->fd;
+}
+
+void seglog_record_appended(off_t record_len)
+{
+    log_segment *active = seglog.segments[seglog.count - 1];
+
+    // seglog_append_fd() reserved the entry, so accounting the record cannot fail
+    active->written += record_len;
+    seglog.reserved--;
+    seglog.pending[seglog.pending_count++] = (uint32_t)active->written;
+    active->written_records++;
+}
+
+// Deletes the oldest segments while the remaining ones still hold retain_bytes
+static void apply_retention(void)
+{
+    if (seglog.retain_bytes <= 0)
+    {
+        return;
+    }
+    pthread_mutex_lock(&seglog.lock);
+    log_segment *active = seglog.segments[seglog.count - 1];
+    while (seglog.count > 1 && active->base + active->length - seglog.segments[1]->base >= seglog.retain_bytes)
+    {
+        log_segment *oldest = seglog.segments[0];
+        unlink_segment(oldest->base);
+        memmove(seglog.segments, seglog.segments + 1, (seglog.count - 1) * sizeof(log_segment *));
+        seglog.count--;
+        aesd_log(LOG_DEBUG, "Retention dropped log segment at offset %lld", (long long)oldest->base);
+        // Readers still sending from it keep the descriptors open
+        put_segment(oldest);
+    }
+    pthread_mutex_unlock(&seglog.lock);
+}
+
+int seglog_sync(void)
+{
+    log_segment *active = seglog.segments[seglog.count - 1];
+
+    for (size_t i = seglog.unsynced; i < seglog.count; i++)
+    {
+        log_segment *segment = seglog.segments[i];
+        if (segment->written != segment->length && fdatasync(segment->fd) == -1 && errno != EINVAL)
+        {
+            return -1;
+        }
+    }
+    if (flush_pending(active) == -1)
+    {
+        return -1;
+    }
+    pthread_mutex_lock(&seglog.lock);
+    for (size_t i = seglog.unsynced; i < seglog.count; i++)
+    {
+        seglog.segments[i]->length = seglog.segments[i]->written;
+        seglog.segments[i]->records = seglog.segments[i]->written_records;
+    }
+    seglog.durable_end = active->base + active->length;
+    pthread_mutex_unlock(&seglog.lock);
+    apply_retention();
+    seglog.unsynced = seglog.count - 1;
+    return 0;
+}
+
+int seglog_discard_unsynced(void)
+{
+    int status = 0;
+
+    seglog.pending_count = 0;
+    seglog.reserved = 0;
+    pthread_mutex_lock(&seglog.lock);
+    // Segments started since the last sync hold no durable data, no reader can have acquired them
+    while (seglog.count - 1 > seglog.unsynced)
+    {
+        log_segment *segment = seglog.segments[--seglog.count];
+        unlink_segment(segment->base);
+        put_segment(segment);
+    }
+    log_segment *active = seglog.segments[seglog.count - 1];
+    pthread_mutex_unlock(&seglog.lock);
+
+    if (ftruncate(active->fd, active->length) == -1)
+    {
+        status = -1;
+    }
+    // Entries flushed when a new segment was started describe dropped records
+    if (active->indexed > active->records && ftruncate(active->index_fd, active->records * sizeof(uint32_t)) == -1)
+    {
+        status = -1;
+    }
+    active->written = active->length;
+    active->written_records = active->records;
+    if (active->indexed > active->records)
+    {
+        active->indexed = active->records;
+    }
+    return status;
+}
+
+off_t seglog_length(void)
+{
+    pthread_mutex_lock(&seglog.lock);
+    off_t length = seglog.durable_end;
+    pthread_mutex_unlock(&seglog.lock);
+    return length;
+}
+
+bool seglog_acquire(off_t offset, seglog_view *view)
+{
+    size_t low = 0, high;
+
+    pthread_mutex_lock(&seglog.lock);
+    if (seglog.count == 0)
+    {
+        pthread_mutex_unlock(&seglog.lock);
+        return false;
+    }
+    // Last segment starting at or before offset
+    high = seglog.count - 1;
+    while (low < high)
+    {
+        size_t middle = (low + high + 1) / 2;
+        if (seglog.segments[middle]->base <= offset)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    log_segment *segment = seglog.segments[low];
+    segment->refs++;
+    view->segment = segment;
+    view->fd = segment->fd;
+    view->base = segment->base;
+    view->length = segment->length;
+    pthread_mutex_unlock(&seglog.lock);
+    return true;
+}
+
+void seglog_release(seglog_view *view)
+{
+    if (view->segment == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&seglog.lock);
+    put_segment(view->segment);
+    pthread_mutex_unlock(&seglog.lock);
+    view->segment = NULL;
+}
+
+int seglog_find_record(uint64_t record, off_t *offset, off_t *length)
+{
+    size_t low = 0, high;
+    uint32_t start = 0, end;
+    int status = -1;
+
+    pthread_mutex_lock(&seglog.lock);
+    if (seglog.count == 0)
+    {
+        pthread_mutex_unlock(&seglog.lock);
+        return -1;
+    }
+    record += seglog.segments[0]->first_record;
+    // Last segment whose first record is at or before record
+    high = seglog.count - 1;
+    while (low < high)
+    {
+        size_t middle = (low + high + 1) / 2;
+        if (seglog.segments[middle]->first_record <= record)
+        {
+            low = middle;
+        }
+        else
+        {
+            high = middle - 1;
+        }
+    }
+    log_segment *segment = seglog.segments[low];
+    uint64_t entry = record - segment->first_record;
+    if (entry < segment->records && read_entry(segment, entry, &end) == 0 &&
+        (entry == 0 || read_entry(segment, entry - 1, &start) == 0))
+    {
+        *offset = segment->base + start;
+        *length = end - start;
+        status = 0;
+    }
+    pthread_mutex_unlock(&seglog.lock);
+    return status;
+}
@@ -0,0 +1,96 @@
+/******************************************************
+# Segmented append-only log for the aesdsocket file backend
+# The data stream is stored in segment files of a fixed size, named
+# after the stream offset of their first byte. Every segment has an
+# index file holding the end offset of each record it contains, so a
+# record is located without reading the data, old segments are
+# dropped as a whole, and a restart only rescans the unindexed tail
+# of the last segment.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef SEGLOG_H
+#define SEGLOG_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SEGLOG_DIR "/var/tmp/aesdsocketdata.d"
+// Index entries are 32 bit offsets relative to the segment
+#define SEGLOG_MAX_SEGMENT_BYTES ((off_t)UINT32_MAX)
+
+struct log_segment;
+
+// A segment pinned by a reader, see seglog_acquire()
+typedef struct
+{
+    struct log_segment *segment;
+    int fd;
+    off_t base;   // Stream offset of the first byte of the segment
+    off_t length; // Durable bytes of the segment when it was acquired
+} seglog_view;
+
+/**
+ * Opens the log in dir, recovering the segments a previous run left behind.
+ * @param segment_bytes a new segment is started once a record would not fit into the active one
+ * @param retain_bytes the oldest segments are deleted while the rest still holds this much, 0 keeps all
+ * @return 0 on success, -1 on failure
+ */
+int seglog_open(const char *dir, off_t segment_bytes, off_t retain_bytes);
+
+// Closes every segment, the files stay for the next run
+void seglog_close(void);
+
+bool seglog_enabled(void);
+
+/**
+ * Writer side: returns the descriptor a record of record_len bytes is appended to, starting
+ * a new segment when it would overflow the active one. Starting one writes the index of the
+ * active segment, so every record written to it must be accounted first. Writers must be
+ * serialized and call seglog_record_appended() once the record is written. The index entry
+ * of the record is reserved here, so a record is never written without one.
+ * @return the descriptor, -1 on failure
+ */
+int seglog_append_fd(off_t record_len);
+
+/**
+ * True when seglog_append_fd() would start a new segment for a record of record_len bytes,
+ * once unaccounted_len more bytes were appended to the active segment.
+ */
+bool seglog_append_rotates(off_t unaccounted_len, off_t record_len);
+
+// Accounts a record written to the descriptor seglog_append_fd() returned
+void seglog_record_appended(off_t record_len);
+
+/**
+ * Writer side: truncates the segments and their indexes back to the durable data and deletes
+ * the segments started since the last seglog_sync(), after a failed write or sync.
+ * @return 0 on success, -1 on failure
+ */
+int seglog_discard_unsynced(void);
+
+/**
+ * Makes the appended records durable and visible to readers, then applies retention.
+ * @return 0 on success, -1 on failure
+ */
+int seglog_sync(void);
+
+// Stream offset just past the last durable record
+off_t seglog_length(void);
+
+/**
+ * Pins the segment holding stream offset, or the oldest retained segment when offset was
+ * already trimmed, so it stays readable until seglog_release().
+ * @return true when such a segment exists
+ */
+bool seglog_acquire(off_t offset, seglog_view *view);
+
+void seglog_release(seglog_view *view);
+
+/**
+ * Locates a durable record, counted from the oldest retained record.
+ * @return 0 with the stream offset and length of the record, -1 when there is no such record
+ */
+int seglog_find_record(uint64_t record, off_t *offset, off_t *length);
+
+#endif /* SEGLOG_H */
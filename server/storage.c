@@ -0,0 +1,436 @@
+/******************************************************
+# Storage backends for the aesdsocket data stream
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include "storage.h"
+#include "aesdsocket.h"
+#include "commit.h"
+#include "seglog.h"
+#include "filemap.h"
+#include "memring.h"
+#include "lifecycle.h"
+#include "metrics.h"
+#include "pool.h"
+#include "log.h"
+
+// Operations every backend provides, see the storage_* functions in storage.h
+typedef struct
+{
+    const char *name;
+    bool timestamps;
+    int (*open)(void);
+    void (*close)(void);
+    int (*attach)(int *file_fd);
+    void (*detach)(int file_fd);
+    int (*append)(int file_fd, const line_packet *packet);
+    int (*seek)(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor);
+    off_t (*replay_end)(void);
+    replay_status (*replay)(int client_fd, int file_fd, off_t *offset, replay_state *state);
+} storage_backend;
+
+// Shared descriptor of the file backend, -1 while the segmented log is used
+static int data_file_fd = -1;
+
+// Writes the spilled head of an oversized packet in chunks, then the buffered tail
+static int write_packet(int fd, const line_packet *packet)
+{
+    char *chunk;
+    size_t chunk_capacity;
+    off_t copied = 0;
+    int status = 0;
+
+    if (packet->spill_len > 0)
+    {
+        chunk = buffer_get(FRAMER_MAX_BUFFERED, &chunk_capacity);
+        if (chunk == NULL)
+        {
+            aesd_log(LOG_ERR, "Copy buffer allocation failed, returning with error");
+            return -1;
+        }
+        aesd_log(LOG_DEBUG, "Writing %lld byte packet in chunks", (long long)(packet->spill_len + packet->len));
+        while (copied < packet->spill_len)
+        {
+            ssize_t bytes_read = pread(packet->spill_fd, chunk, FRAMER_MAX_BUFFERED, copied);
+            if (bytes_read <= 0 || write(fd, chunk, bytes_read) != bytes_read)
+            {
+                status = -1;
+                break;
+            }
+            copied += bytes_read;
+        }
+        buffer_put(chunk, chunk_capacity);
+    }
+    if (status == 0 && packet->len > 0 && write(fd, packet->data, packet->len) != (ssize_t)packet->len)
+    {
+        status = -1;
+    }
+    return status;
+}
+
+static int file_open(void)
+{
+    if (server_config.segment_bytes > 0)
+    {
+        // Segments survive restarts, whatever a previous run stored is served again
+        if (seglog_open(SEGLOG_DIR, server_config.segment_bytes, server_config.retain_bytes) == -1)
+        {
+            aesd_log(LOG_ERR, "Segmented log in %s could not be opened", SEGLOG_DIR);
+            return -1;
+        }
+    }
+    else
+    {
+        // Open the file for writing data and timestamps, a server taking over continues the previous one's
+        // O_APPEND keeps concurrent writers from overwriting each other after a replay rewinds the descriptor
+        int truncate = lifecycle_took_over() ? 0 : O_TRUNC;
+        data_file_fd = open(SOCKETDATA_FILE, O_RDWR | O_CREAT | truncate | O_APPEND | O_CLOEXEC, 0666);
+        if (data_file_fd == -1)
+        {
+            aesd_log(LOG_ERR, "Open/create of %s failed", SOCKETDATA_FILE);
+            return -1;
+        }
+    }
+    commit_reset_length(data_file_fd);
+    // All writes to the shared file go through the group commit writer
+    if (commit_start(data_file_fd, server_config.commit_window_usec, server_config.commit_max_bytes) == -1)
+    {
+        aesd_log(LOG_ERR, "Group commit could not be started, writing packets directly");
+    }
+    return 0;
+}
+
+static void file_close(void)
+{
+    // Every client is done, flush what is still queued for the writer
+    commit_stop();
+    if (seglog_enabled())
+    {
+        // The segments are kept, the next run recovers them
+        seglog_close();
+        return;
+    }
+    file_map_forget(data_file_fd);
+    close(data_file_fd);
+    data_file_fd = -1;
+    if (lifecycle_handed_off())
+    {
+        // The server that took over goes on appending to it
+        return;
+    }
+    // Remove the temporary file if it exists
+    unlink(SOCKETDATA_FILE);
+    aesd_log(LOG_INFO, "Deleted the temporary socket data file before exiting.");
+}
+
+static int file_attach(int *file_fd)
+{
+    *file_fd = data_file_fd;
+    return 0;
+}
+
+// Clients of a shared descriptor, or of none, have nothing to release
+static void shared_detach(int file_fd)
+{
+    (void)file_fd;
+}
+
+static int file_append(int file_fd, const line_packet *packet)
+{
+    off_t record_len = packet->spill_len + packet->len;
+    int status = -1;
+
+    // Lock the mutex before writing to the file
+    pthread_mutex_lock(&file_mutex);
+    uint64_t start_usec = metrics_now_usec();
+    int append_fd = commit_append_fd(file_fd, record_len);
+    if (append_fd != -1 && write_packet(append_fd, packet) == 0)
+    {
+        commit_record_appended(record_len);
+        metrics_observe_since(METRIC_WRITE_LATENCY, start_usec);
+        aesd_log(LOG_DEBUG, "Syncing data to the disk");
+        start_usec = metrics_now_usec();
+        // Like the group commit writer, a packet is only reported stored once it is durable
+        if (commit_sync(file_fd) == 0)
+        {
+            status = 0;
+        }
+        metrics_observe_since(METRIC_FDATASYNC_LATENCY, start_usec);
+        if (status == 0)
+        {
+            metrics_count(METRIC_PACKETS_STORED, 1);
+            commit_publish_length();
+        }
+        else
+        {
+            aesd_log(LOG_ERR, "Syncing the socketdata file failed: %s", strerror(errno));
+        }
+    }
+    // The packet is reported failed, so it must not stay in the data either
+    if (status == -1 && commit_discard_unsynced(file_fd) == -1)
+    {
+        aesd_log(LOG_ERR, "Dropping the failed packet from the socketdata file failed: %s", strerror(errno));
+    }
+    // UnLock the mutex after writing to the file
+    pthread_mutex_unlock(&file_mutex);
+    return status;
+}
+
+static int file_seek(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor)
+{
+    off_t record_offset, record_len;
+
+    (void)file_fd;
+    // The record index of the segmented log stands in for the driver's command table
+    if (!seglog_enabled())
+    {
+        aesd_log(LOG_ERR, "AESDCHAR_IOCSEEKTO needs --segment-bytes on the file backend");
+        return -1;
+    }
+    if (seglog_find_record(seek_to->write_cmd, &record_offset, &record_len) == -1 || seek_to->write_cmd_offset >= record_len)
+    {
+        aesd_log(LOG_ERR, "AESDCHAR_IOCSEEKTO beyond the stored records");
+        return -1;
+    }
+    *cursor = record_offset + seek_to->write_cmd_offset;
+    return 0;
+}
+
+static off_t file_replay_end(void)
+{
+    // Appends never modify the durable part of the file, so it is read without file_mutex
+    return commit_durable_length();
+}
+
+static int chardev_open(void)
+{
+    return 0;
+}
+
+static void chardev_close(void)
+{
+}
+
+static int chardev_attach(int *file_fd)
+{
+    // Every client gets its own descriptor of the driver, which keeps the file position of a seek
+    *file_fd = open(AESD_CHAR_DEVICE, O_RDWR | O_CLOEXEC);
+    if (*file_fd == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to open %s", AESD_CHAR_DEVICE);
+        return -1;
+    }
+    return 0;
+}
+
+static void chardev_detach(int file_fd)
+{
+    close(file_fd);
+}
+
+static int chardev_append(int file_fd, const line_packet *packet)
+{
+    pthread_mutex_lock(&file_mutex);
+    uint64_t start_usec = metrics_now_usec();
+    // The driver completes a record at the newline, a chunked write still ends up as one entry
+    int status = write_packet(file_fd, packet);
+    if (status == 0)
+    {
+        metrics_observe_since(METRIC_WRITE_LATENCY, start_usec);
+        metrics_count(METRIC_PACKETS_STORED, 1);
+    }
+    pthread_mutex_unlock(&file_mutex);
+    return status;
+}
+
+static int chardev_seek(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor)
+{
+    struct aesd_seekto request = *seek_to;
+
+    // Perform the ioctl operation
+    if (ioctl(file_fd, AESDCHAR_IOCSEEKTO, &request) == -1)
+    {
+        aesd_log(LOG_ERR, "ioctl AESDCHAR_IOCSEEKTO failed: %s", strerror(errno));
+        return -1;
+    }
+    aesd_log(LOG_INFO, "Seek operation successful");
+    // The driver moved this descriptor's file position to the requested byte
+    off_t position = lseek(file_fd, 0, SEEK_CUR);
+    if (position != -1)
+    {
+        *cursor = position;
+    }
+    return 0;
+}
+
+static off_t chardev_replay_end(void)
+{
+    return -1;
+}
+
+static replay_status chardev_replay(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    // A replay takes several reads, each one looks up its offset from the oldest entry; a write
+    // evicting that entry in between would shift the offsets and skip or repeat records
+    pthread_mutex_lock(&file_mutex);
+    replay_status status = replay_socketdata(client_fd, file_fd, offset, state);
+    pthread_mutex_unlock(&file_mutex);
+    return status;
+}
+
+static int memory_open(void)
+{
+    return memring_open(server_config.ring_records, server_config.ring_bytes);
+}
+
+static int memory_attach(int *file_fd)
+{
+    // The records are sent straight from memory, there is no descriptor of the data
+    *file_fd = -1;
+    return 0;
+}
+
+static int memory_append(int file_fd, const line_packet *packet)
+{
+    (void)file_fd;
+    uint64_t start_usec = metrics_now_usec();
+    if (memring_append(packet) == -1)
+    {
+        return -1;
+    }
+    metrics_observe_since(METRIC_WRITE_LATENCY, start_usec);
+    metrics_count(METRIC_PACKETS_STORED, 1);
+    return 0;
+}
+
+static int memory_seek(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor)
+{
+    off_t record_offset, record_len;
+
+    (void)file_fd;
+    if (memring_find_record(seek_to->write_cmd, &record_offset, &record_len) == -1 || seek_to->write_cmd_offset >= record_len)
+    {
+        aesd_log(LOG_ERR, "AESDCHAR_IOCSEEKTO beyond the stored records");
+        return -1;
+    }
+    *cursor = record_offset + seek_to->write_cmd_offset;
+    return 0;
+}
+
+static replay_status memory_replay(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    (void)file_fd;
+    return memring_replay(client_fd, offset, state->end);
+}
+
+static const storage_backend backends[] = {
+    [AESD_STORAGE_FILE] = {
+        .name = "file",
+        .timestamps = true,
+        .open = file_open,
+        .close = file_close,
+        .attach = file_attach,
+        .detach = shared_detach,
+        .append = file_append,
+        .seek = file_seek,
+        .replay_end = file_replay_end,
+        .replay = replay_socketdata,
+    },
+    [AESD_STORAGE_CHARDEV] = {
+        .name = "chardev",
+        .timestamps = false,
+        .open = chardev_open,
+        .close = chardev_close,
+        .attach = chardev_attach,
+        .detach = chardev_detach,
+        .append = chardev_append,
+        .seek = chardev_seek,
+        .replay_end = chardev_replay_end,
+        .replay = chardev_replay,
+    },
+    [AESD_STORAGE_MEMORY] = {
+        .name = "memory",
+        .timestamps = false,
+        .open = memory_open,
+        .close = memring_close,
+        .attach = memory_attach,
+        .detach = shared_detach,
+        .append = memory_append,
+        .seek = memory_seek,
+        .replay_end = memring_end,
+        .replay = memory_replay,
+    },
+};
+
+static const storage_backend *backend = &backends[AESD_STORAGE_FILE];
+
+int storage_parse(const char *name)
+{
+    for (size_t kind = 0; kind < sizeof(backends) / sizeof(backends[0]); kind++)
+    {
+        if (strcmp(name, backends[kind].name) == 0)
+        {
+            return kind;
+        }
+    }
+    return -1;
+}
+
+const char *storage_name(aesd_storage kind)
+{
+    return backends[kind].name;
+}
+
+int storage_open(void)
+{
+    backend = &backends[server_config.storage];
+    aesd_log(LOG_INFO, "Storing data in the %s backend", backend->name);
+    return backend->open();
+}
+
+void storage_close(void)
+{
+    backend->close();
+}
+
+int storage_attach(int *file_fd)
+{
+    return backend->attach(file_fd);
+}
+
+void storage_detach(int file_fd)
+{
+    backend->detach(file_fd);
+}
+
+bool storage_timestamps(void)
+{
+    return backend->timestamps;
+}
+
+int storage_append(int file_fd, const line_packet *packet)
+{
+    return backend->append(file_fd, packet);
+}
+
+int storage_seek(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor)
+{
+    return backend->seek(file_fd, seek_to, cursor);
+}
+
+off_t storage_replay_end(void)
+{
+    return backend->replay_end();
+}
+
+replay_status storage_replay(int client_fd, int file_fd, off_t *offset, replay_state *state)
+{
+    return backend->replay(client_fd, file_fd, offset, state);
+}
@@ -0,0 +1,77 @@
+/******************************************************
+# Storage backends for the aesdsocket data stream
+# The server stores packets and replays them through these functions
+# only; the backend chosen with --backend decides where the data lives
+# and how it is appended, replayed and seeked into.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "../aesd-char-driver/aesd_ioctl.h"
+#include "framing.h"
+#include "replay.h"
+
+// Where the data stream is stored
+typedef enum
+{
+    AESD_STORAGE_FILE,    // /var/tmp/aesdsocketdata or the segmented log, with timestamps and group commit
+    AESD_STORAGE_CHARDEV, // The aesdchar driver's ring, opened once per client
+    AESD_STORAGE_MEMORY   // The newest records in an in-process ring, never written to disk
+} aesd_storage;
+
+/**
+ * Parses a backend name given on the command line.
+ * @return the backend, -1 when the name is unknown
+ */
+int storage_parse(const char *name);
+
+const char *storage_name(aesd_storage kind);
+
+/**
+ * Opens the backend set in server_config. The file backend also starts the group commit
+ * writer.
+ * @return 0 on success, -1 on failure
+ */
+int storage_open(void);
+
+// Flushes what is still queued and closes the backend
+void storage_close(void);
+
+/**
+ * Gives a client its descriptor of the data. Backends without one per client hand out
+ * their shared descriptor, or -1 when the data has no single descriptor.
+ * @return 0 on success, -1 on failure
+ */
+int storage_attach(int *file_fd);
+
+void storage_detach(int file_fd);
+
+// Whether the periodic timestamp records are stored in this backend
+bool storage_timestamps(void);
+
+/**
+ * Appends a packet and makes it durable before returning. Callers that use the group
+ * commit writer go through commit_write() instead.
+ * @return 0 on success, -1 on failure
+ */
+int storage_append(int file_fd, const line_packet *packet);
+
+/**
+ * Moves *cursor to byte seek_to->write_cmd_offset of record seek_to->write_cmd.
+ * @return 0 on success, -1 when the backend cannot seek there
+ */
+int storage_seek(int file_fd, const struct aesd_seekto *seek_to, off_t *cursor);
+
+// End a replay that starts now stops at, -1 for the end of the data at every call
+off_t storage_replay_end(void);
+
+/**
+ * Sends the data from *offset to client_fd, see replay_socketdata(). Takes whatever lock
+ * the backend needs around its readers.
+ */
+replay_status storage_replay(int client_fd, int file_fd, off_t *offset, replay_state *state);
+
+#endif /* STORAGE_H */
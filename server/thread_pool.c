@@ -0,0 +1,182 @@
+/******************************************************
+# Fixed size worker thread pool for aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <syslog.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "thread_pool.h"
+#include "metrics.h"
+#include "log.h"
+
+static void *worker_thread(void *args)
+{
+    thread_pool *pool = (thread_pool *)args;
+    ThreadArgs work;
+
+    while (true)
+    {
+        pthread_mutex_lock(&pool->lock);
+        while (pool->count == 0 && !pool->shutdown)
+        {
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        }
+        // Queued connections are still served after shutdown was requested
+        if (pool->count == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        work = pool->queue[pool->head];
+        pool->head = (pool->head + 1) % pool->capacity;
+        pool->count--;
+        pool->busy++;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+        metrics_gauge_add(METRIC_QUEUED_CONNECTIONS, -1);
+
+        pool->handler(&work);
+
+        pthread_mutex_lock(&pool->lock);
+        pool->busy--;
+        if (pool->busy == 0 && pool->count == 0)
+        {
+            pthread_cond_broadcast(&pool->drained);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+int thread_pool_init(thread_pool *pool, int thread_count, size_t queue_depth, thread_pool_handler handler)
+{
+    memset(pool, 0, sizeof(thread_pool));
+    pool->capacity = queue_depth;
+    pool->handler = handler;
+    pool->queue = calloc(queue_depth, sizeof(ThreadArgs));
+    pool->threads = calloc(thread_count, sizeof(pthread_t));
+    if (pool->queue == NULL || pool->threads == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate memory for the thread pool");
+        free(pool->queue);
+        free(pool->threads);
+        return -1;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->drained, NULL);
+
+    for (pool->thread_count = 0; pool->thread_count < thread_count; pool->thread_count++)
+    {
+        int err = pthread_create(&pool->threads[pool->thread_count], NULL, worker_thread, pool);
+        if (err != 0)
+        {
+            aesd_log(LOG_ERR, "Error creating worker thread: %s", strerror(err));
+            break;
+        }
+    }
+    if (pool->thread_count == 0)
+    {
+        thread_pool_shutdown(pool);
+        return -1;
+    }
+    aesd_log(LOG_INFO, "Started %d worker threads with a queue depth of %zu", pool->thread_count, queue_depth);
+    return 0;
+}
+
+bool thread_pool_wait_for_slot(thread_pool *pool, int timeout_ms)
+{
+    struct timespec deadline;
+    bool available;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->count == pool->capacity && !pool->shutdown)
+    {
+        if (pthread_cond_timedwait(&pool->not_full, &pool->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    available = pool->count < pool->capacity && !pool->shutdown;
+    pthread_mutex_unlock(&pool->lock);
+    return available;
+}
+
+int thread_pool_submit(thread_pool *pool, const ThreadArgs *args)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->count == pool->capacity || pool->shutdown)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return -1;
+    }
+    pool->queue[(pool->head + pool->count) % pool->capacity] = *args;
+    pool->count++;
+    // Counted before a worker can take it, so the gauge never dips below zero
+    metrics_gauge_add(METRIC_QUEUED_CONNECTIONS, 1);
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+bool thread_pool_drain(thread_pool *pool, int timeout_ms)
+{
+    struct timespec deadline;
+    bool drained;
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    while (pool->busy > 0 || pool->count > 0)
+    {
+        if (pthread_cond_timedwait(&pool->drained, &pool->lock, &deadline) == ETIMEDOUT)
+        {
+            break;
+        }
+    }
+    drained = pool->busy == 0 && pool->count == 0;
+    pthread_mutex_unlock(&pool->lock);
+    return drained;
+}
+
+void thread_pool_shutdown(thread_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_cond_broadcast(&pool->not_full);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i = 0; i < pool->thread_count; i++)
+    {
+        pthread_join(pool->threads[i], NULL);
+    }
+    pthread_cond_destroy(&pool->drained);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool->queue);
+}
@@ -0,0 +1,72 @@
+/******************************************************
+# Fixed size worker thread pool for aesdsocket
+# Accepted connections are queued in a bounded ring and served by a
+# set of workers created once at startup.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+// One accepted connection waiting for a worker
+typedef struct
+{
+    int client_fd;
+    int file_fd;
+    struct sockaddr_storage socket_addr;
+} ThreadArgs;
+
+typedef void (*thread_pool_handler)(ThreadArgs *args);
+
+typedef struct
+{
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    pthread_cond_t drained; // Signalled when the queue is empty and no worker is busy
+    ThreadArgs *queue;
+    size_t capacity;
+    size_t head;
+    size_t count;
+    int busy; // Workers inside the handler
+    pthread_t *threads;
+    int thread_count;
+    bool shutdown;
+    thread_pool_handler handler;
+} thread_pool;
+
+/**
+ * Starts thread_count workers which call handler for every queued connection.
+ * @return 0 on success, -1 if no worker could be started
+ */
+int thread_pool_init(thread_pool *pool, int thread_count, size_t queue_depth, thread_pool_handler handler);
+
+/**
+ * Waits up to timeout_ms for a free queue slot.
+ * @return true when a slot is available, false on timeout or shutdown
+ */
+bool thread_pool_wait_for_slot(thread_pool *pool, int timeout_ms);
+
+/**
+ * Queues a connection without blocking.
+ * @return 0 when queued, -1 when the queue is full or the pool is shutting down
+ */
+int thread_pool_submit(thread_pool *pool, const ThreadArgs *args);
+
+/**
+ * Stops taking new connections and waits up to timeout_ms for the queued and running
+ * ones to be served.
+ * @return true when every connection was served
+ */
+bool thread_pool_drain(thread_pool *pool, int timeout_ms);
+
+/**
+ * Lets the workers finish every queued connection, then joins them and frees the pool.
+ */
+void thread_pool_shutdown(thread_pool *pool);
+
+#endif /* THREAD_POOL_H */
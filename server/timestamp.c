@@ -0,0 +1,130 @@
+/******************************************************
+# Periodic timestamp records for aesdsocket
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#include <syslog.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+#include "aesdsocket.h"
+#include "timestamp.h"
+#include "commit.h"
+#include "log.h"
+
+#define TIMESTAMP_LEN 100
+
+// A record in flight to the writer, freed once it is durable
+typedef struct
+{
+    commit_request request;
+    char text[TIMESTAMP_LEN];
+} timestamp_record;
+
+static void timestamp_committed(commit_request *request)
+{
+    if (request->status == -1)
+    {
+        aesd_log(LOG_INFO, "Timestamp write has failed");
+    }
+    free(request->context);
+}
+
+// Without the writer the record is appended directly, the caller waits for the sync once per interval
+static void append_directly(const char *text, size_t len)
+{
+    int file_fd;
+    line_packet packet = {
+        .data = text,
+        .len = len,
+        .spill_fd = -1,
+        .spill_len = 0,
+    };
+
+    if (storage_attach(&file_fd) == -1)
+    {
+        return;
+    }
+    if (write_framed_packet(file_fd, &packet) == -1)
+    {
+        aesd_log(LOG_INFO, "Timestamp write has failed");
+    }
+    storage_detach(file_fd);
+}
+
+int timestamp_timer_open(void)
+{
+    struct itimerspec interval;
+
+    if (!storage_timestamps() || server_config.timestamp_interval == 0)
+    {
+        return -1;
+    }
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd == -1)
+    {
+        aesd_log(LOG_ERR, "timerfd_create failed, no timestamps are stored: %s", strerror(errno));
+        return -1;
+    }
+    memset(&interval, 0, sizeof(interval));
+    interval.it_value.tv_sec = server_config.timestamp_interval;
+    interval.it_interval.tv_sec = server_config.timestamp_interval;
+    if (timerfd_settime(timer_fd, 0, &interval, NULL) == -1)
+    {
+        aesd_log(LOG_ERR, "timerfd_settime failed, no timestamps are stored: %s", strerror(errno));
+        close(timer_fd);
+        return -1;
+    }
+    return timer_fd;
+}
+
+void timestamp_timer_expired(int timer_fd)
+{
+    uint64_t expirations;
+    time_t current_time;
+    struct tm tm_info;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) != sizeof(expirations))
+    {
+        // Not due yet
+        return;
+    }
+    // Extract timestamp
+    current_time = time(NULL);
+    if (localtime_r(&current_time, &tm_info) == NULL)
+    {
+        aesd_log(LOG_ERR, "Unable to get local time");
+        return;
+    }
+
+    timestamp_record *record = malloc(sizeof(timestamp_record));
+    if (record == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate a timestamp record");
+        return;
+    }
+    //Format the string to RFC 2822
+    size_t len = strftime(record->text, sizeof(record->text), "timestamp:%Y-%m-%d %H:%M:%S\n", &tm_info);
+    if (len == 0)
+    {
+        aesd_log(LOG_ERR, "strftime failed");
+        free(record);
+        return;
+    }
+    aesd_log(LOG_INFO, "%ds has elapsed saving the time in socketdata file,time is %s", server_config.timestamp_interval, record->text);
+
+    if (!commit_enabled())
+    {
+        append_directly(record->text, len);
+        free(record);
+        return;
+    }
+    // Batched with the client packets queued meanwhile, the writer frees the record
+    commit_request_init(&record->request, record->text, len);
+    record->request.on_complete = timestamp_committed;
+    record->request.context = record;
+    commit_submit(&record->request);
+}
@@ -0,0 +1,26 @@
+/******************************************************
+# Periodic timestamp records for aesdsocket
+# A timerfd expires every --timestamp-interval seconds and is watched
+# by the server's own event loop; each expiry queues one
+# "timestamp:" record to the group commit writer, so it shares the
+# fdatasync of whatever client packets are batched with it.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#ifndef TIMESTAMP_H
+#define TIMESTAMP_H
+
+/**
+ * Creates the non-blocking timerfd that becomes readable every server_config.timestamp_interval
+ * seconds.
+ * @return the descriptor, -1 when the backend stores no timestamps, the interval is 0 or the
+ *         timer could not be created
+ */
+int timestamp_timer_open(void);
+
+/**
+ * Called whenever timer_fd may be readable. Appends one record however many intervals have
+ * elapsed, and returns right away when none has. Never waits for the record to be durable.
+ */
+void timestamp_timer_expired(int timer_fd);
+
+#endif /* TIMESTAMP_H */
@@ -0,0 +1,1188 @@
+/******************************************************
+# io_uring engine for aesdsocket
+# Each engine thread owns a ring. Connections arrive through a
+# multishot accept on the shared listening socket, client data through
+# multishot recv into a ring of provided buffers, and all requests of
+# one loop iteration are submitted and reaped with a single
+# io_uring_enter(). Packets are stored through the group commit
+# writer; replays use sendfile()/splice() and wait for socket space
+# with a poll request. Kernels without io_uring, or without provided
+# buffer rings, make run_uring_server() ask for the epoll reactor.
+# Author: Induja Narayanan <Induja.Narayanan@colorado.edu>
+******************************************************/
+#define _GNU_SOURCE
+#include <syslog.h>
+#include <errno.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/queue.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "aesdsocket.h"
+#include "replay.h"
+#include "commit.h"
+#include "metrics.h"
+#include "log.h"
+#include "pool.h"
+#include "timestamp.h"
+#include "lifecycle.h"
+
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#endif
+
+#ifdef IORING_RECV_MULTISHOT
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_COUNT 128 // Provided receive buffers per ring, power of two
+#define URING_BUFFER_SIZE (16 * 1024)
+#define URING_BUFFER_GROUP 0
+// A connection holding this many unprocessed buffers stops receiving until it catches up
+#define URING_HELD_LIMIT (URING_BUFFER_COUNT / 8)
+
+// Request kind, kept in the low bits of the user data next to the connection pointer
+typedef enum
+{
+    URING_OP_ACCEPT,
+    URING_OP_RECV,
+    URING_OP_POLL_OUT,
+    URING_OP_NOTIFY,
+    URING_OP_STOP,
+    URING_OP_TIMEOUT,
+    URING_OP_TIMESTAMP,
+    URING_OP_IGNORE // Cancellations, their result does not matter
+} uring_op;
+#define URING_OP_MASK 7ULL
+#define URING_CACHED_CONNECTIONS 256 // Freed connection objects kept for reuse per engine
+
+// Submission and completion queues shared with the kernel
+typedef struct
+{
+    int fd;
+    unsigned *sq_head;
+    unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned sq_local_tail; // Prepared entries, published by uring_enter()
+    struct io_uring_sqe *sqes;
+    unsigned *cq_head;
+    unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    void *sq_map;
+    size_t sq_map_len;
+    void *cq_map;
+    size_t cq_map_len;
+    size_t sqes_len;
+} uring_queue;
+
+typedef struct uring_conn
+{
+    int client_fd;
+    int file_fd;
+    char client_ip[INET6_ADDRSTRLEN];
+    line_framer framer;
+    int held_head; // Provided buffers received but not yet copied into the framer, -1 if none
+    int held_tail;
+    int held_count;
+    int inflight;  // Ring requests that still refer to this connection
+    bool recv_armed;
+    bool recv_cancelling;
+    bool starved;  // Recv stopped because the ring ran out of provided buffers
+    bool peer_closed;
+    bool closing;
+    bool stored;
+    commit_request commit;
+    bool commit_pending;
+    bool replaying;
+    off_t replay_offset;
+    uint64_t replay_start_usec;
+    off_t cursor;
+    replay_state replay;
+    struct uring_engine *owner;
+    long last_active_ms;
+    TAILQ_ENTRY(uring_conn) entry;
+    LIST_ENTRY(uring_conn) starved_entry;
+} uring_conn;
+
+typedef struct uring_engine
+{
+    pthread_t thread_id;
+    uring_queue ring;
+    int listen_fd;
+    int stop_fd;
+    int notify_fd;
+    uint64_t notify_value;
+    int timer_fd; // Timestamp timer, watched by the first engine only, -1 elsewhere
+    struct io_uring_buf_ring *buffers;
+    size_t buffers_len;
+    char *buffer_memory;
+    unsigned short buffer_tail;
+    int buffers_free;
+    // Per provided buffer: next buffer held by the same connection, its length and read position
+    int held_next[URING_BUFFER_COUNT];
+    unsigned held_len[URING_BUFFER_COUNT];
+    unsigned held_pos[URING_BUFFER_COUNT];
+    bool single_shot_recv; // The kernel rejected multishot recv
+    bool timeout_armed;
+    struct __kernel_timespec timeout;
+    bool stopping;         // Not accepting any more, closing each connection once its request is answered
+    long drain_deadline_ms;
+    int closing_count;     // Closed connections waiting for their last completion
+    TAILQ_HEAD(UringConnList, uring_conn) connections; // Least recently active first
+    LIST_HEAD(StarvedList, uring_conn) starved;
+    pthread_mutex_t completed_lock;
+    STAILQ_HEAD(UringCompletedList, commit_request) completed;
+    int pending_commits;
+    object_pool conn_pool;
+} uring_engine;
+
+typedef enum
+{
+    CONN_AGAIN, // Waiting for data, a commit or socket space
+    CONN_DONE,  // Current stage finished
+    CONN_CLOSE  // Connection should be torn down
+} conn_status;
+
+static int uring_setup(unsigned entries, struct io_uring_params *params)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_register(int fd, unsigned opcode, void *arg, unsigned nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static long monotonic_ms(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int queue_init(uring_queue *ring)
+{
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof(uring_queue));
+    memset(&params, 0, sizeof(params));
+    ring->fd = uring_setup(URING_ENTRIES, &params);
+    if (ring->fd == -1)
+    {
+        return -1;
+    }
+    if (!(params.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        close(ring->fd);
+        errno = ENOSYS;
+        return -1;
+    }
+
+    ring->sq_map_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_map_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (ring->cq_map_len > ring->sq_map_len)
+    {
+        ring->sq_map_len = ring->cq_map_len;
+    }
+    ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sq_map == MAP_FAILED)
+    {
+        close(ring->fd);
+        return -1;
+    }
+    // One mapping holds both rings
+    ring->cq_map = ring->sq_map;
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+    {
+        munmap(ring->sq_map, ring->sq_map_len);
+        close(ring->fd);
+        return -1;
+    }
+
+    char *sq = ring->sq_map;
+    char *cq = ring->cq_map;
+    ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+    ring->sq_mask = *(unsigned *)(sq + params.sq_off.ring_mask);
+    ring->sq_entries = params.sq_entries;
+    ring->sq_local_tail = *ring->sq_tail;
+    ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+    ring->cq_mask = *(unsigned *)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+    // Submission slots are used in order, so the index array is the identity
+    unsigned *array = (unsigned *)(sq + params.sq_off.array);
+    for (unsigned i = 0; i < params.sq_entries; i++)
+    {
+        array[i] = i;
+    }
+    return 0;
+}
+
+static void queue_exit(uring_queue *ring)
+{
+    munmap(ring->sqes, ring->sqes_len);
+    munmap(ring->sq_map, ring->sq_map_len);
+    close(ring->fd);
+}
+
+/**
+ * Publishes the prepared submissions and optionally waits for completions.
+ * @return 0 on success, -1 with errno set on failure
+ */
+static int uring_enter(uring_queue *ring, unsigned wait_nr)
+{
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    unsigned to_submit = ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait_nr == 0)
+    {
+        return 0;
+    }
+    return syscall(__NR_io_uring_enter, ring->fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0) == -1 ? -1 : 0;
+}
+
+static struct io_uring_sqe *get_sqe(uring_queue *ring)
+{
+    // A full queue is submitted right away to make room
+    while (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >= ring->sq_entries)
+    {
+        if (uring_enter(ring, 0) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            return NULL;
+        }
+    }
+    struct io_uring_sqe *sqe = &ring->sqes[ring->sq_local_tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ring->sq_local_tail++;
+    return sqe;
+}
+
+static uint64_t user_data(void *pointer, uring_op op)
+{
+    return (uint64_t)(uintptr_t)pointer | op;
+}
+
+static void recycle_buffer(uring_engine *e, int bid)
+{
+    struct io_uring_buf *buf = &e->buffers->bufs[e->buffer_tail & (URING_BUFFER_COUNT - 1)];
+
+    buf->addr = (uint64_t)(uintptr_t)(e->buffer_memory + (size_t)bid * URING_BUFFER_SIZE);
+    buf->len = URING_BUFFER_SIZE;
+    buf->bid = bid;
+    e->buffer_tail++;
+    __atomic_store_n(&e->buffers->tail, e->buffer_tail, __ATOMIC_RELEASE);
+    e->buffers_free++;
+}
+
+static int setup_buffers(uring_engine *e)
+{
+    struct io_uring_buf_reg reg;
+
+    e->buffers_len = URING_BUFFER_COUNT * sizeof(struct io_uring_buf);
+    e->buffers = mmap(NULL, e->buffers_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (e->buffers == MAP_FAILED)
+    {
+        return -1;
+    }
+    e->buffer_memory = malloc((size_t)URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    if (e->buffer_memory == NULL)
+    {
+        munmap(e->buffers, e->buffers_len);
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)e->buffers;
+    reg.ring_entries = URING_BUFFER_COUNT;
+    reg.bgid = URING_BUFFER_GROUP;
+    // Provided buffer rings need Linux 5.19, which also brought multishot accept
+    if (uring_register(e->ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+    {
+        free(e->buffer_memory);
+        munmap(e->buffers, e->buffers_len);
+        return -1;
+    }
+    e->buffer_tail = 0;
+    e->buffers_free = 0;
+    for (int bid = 0; bid < URING_BUFFER_COUNT; bid++)
+    {
+        recycle_buffer(e, bid);
+    }
+    return 0;
+}
+
+static void arm_accept(uring_engine *e)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = e->listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+    sqe->user_data = user_data(NULL, URING_OP_ACCEPT);
+}
+
+static void arm_notify(uring_engine *e)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = e->notify_fd;
+    sqe->addr = (uint64_t)(uintptr_t)&e->notify_value;
+    sqe->len = sizeof(e->notify_value);
+    sqe->user_data = user_data(NULL, URING_OP_NOTIFY);
+}
+
+static void arm_stop(uring_engine *e)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    // The stop pipe is never drained, so every engine sees it
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->stop_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, URING_OP_STOP);
+}
+
+// Cancels the request with the given user data, see cancel_recv()
+static void cancel_request(uring_engine *e, uint8_t opcode, uint64_t target)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = opcode;
+    sqe->addr = target;
+    sqe->user_data = user_data(NULL, URING_OP_IGNORE);
+}
+
+static void arm_timestamp(uring_engine *e)
+{
+    struct io_uring_sqe *sqe;
+
+    if (e->timer_fd == -1 || (sqe = get_sqe(&e->ring)) == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = e->timer_fd;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = user_data(NULL, URING_OP_TIMESTAMP);
+}
+
+static void arm_recv(uring_engine *e, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = conn->client_fd;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->ioprio = e->single_shot_recv ? 0 : IORING_RECV_MULTISHOT;
+    sqe->user_data = user_data(conn, URING_OP_RECV);
+    conn->recv_armed = true;
+    conn->inflight++;
+}
+
+static void cancel_recv(uring_engine *e, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = user_data(conn, URING_OP_RECV);
+    sqe->user_data = user_data(NULL, URING_OP_IGNORE);
+    conn->recv_cancelling = true;
+}
+
+static void arm_poll_out(uring_engine *e, uring_conn *conn)
+{
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+
+    if (sqe == NULL)
+    {
+        return;
+    }
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = conn->client_fd;
+    sqe->poll32_events = POLLOUT;
+    sqe->user_data = user_data(conn, URING_OP_POLL_OUT);
+    conn->inflight++;
+}
+
+// Keep-alive idle sweep, one timeout is armed for the least recently active connection
+static void arm_idle_timeout(uring_engine *e)
+{
+    uring_conn *oldest = TAILQ_FIRST(&e->connections);
+    long remaining_ms;
+
+    if (e->timeout_armed || oldest == NULL)
+    {
+        return;
+    }
+    if (e->stopping)
+    {
+        // The remaining connections are closed at the drain deadline
+        remaining_ms = e->drain_deadline_ms - monotonic_ms();
+    }
+    else if (server_config.keep_alive)
+    {
+        remaining_ms = oldest->last_active_ms + server_config.idle_timeout_ms - monotonic_ms();
+    }
+    else
+    {
+        return;
+    }
+    if (remaining_ms < 0)
+    {
+        remaining_ms = 0;
+    }
+    struct io_uring_sqe *sqe = get_sqe(&e->ring);
+    if (sqe == NULL)
+    {
+        return;
+    }
+    e->timeout.tv_sec = remaining_ms / 1000;
+    e->timeout.tv_nsec = (remaining_ms % 1000) * 1000000;
+    sqe->opcode = IORING_OP_TIMEOUT;
+    sqe->addr = (uint64_t)(uintptr_t)&e->timeout;
+    sqe->len = 1;
+    sqe->user_data = user_data(NULL, URING_OP_TIMEOUT);
+    e->timeout_armed = true;
+}
+
+static void release_held_buffers(uring_engine *e, uring_conn *conn)
+{
+    while (conn->held_head != -1)
+    {
+        int bid = conn->held_head;
+        conn->held_head = e->held_next[bid];
+        recycle_buffer(e, bid);
+    }
+    conn->held_tail = -1;
+    conn->held_count = 0;
+}
+
+static void free_connection(uring_engine *e, uring_conn *conn)
+{
+    close(conn->client_fd);
+    storage_detach(conn->file_fd);
+    framer_release(&conn->framer);
+    replay_state_release(&conn->replay);
+    e->closing_count--;
+    object_pool_put(&e->conn_pool, conn);
+}
+
+// Frees the connection once the ring and the commit writer no longer refer to it
+static void maybe_free_connection(uring_engine *e, uring_conn *conn)
+{
+    if (conn->closing && conn->inflight == 0 && !conn->commit_pending)
+    {
+        free_connection(e, conn);
+    }
+}
+
+static void close_connection(uring_engine *e, uring_conn *conn)
+{
+    if (conn->closing)
+    {
+        return;
+    }
+    conn->closing = true;
+    e->closing_count++;
+    TAILQ_REMOVE(&e->connections, conn, entry);
+    if (conn->starved)
+    {
+        LIST_REMOVE(conn, starved_entry);
+        conn->starved = false;
+    }
+    release_held_buffers(e, conn);
+    metrics_gauge_add(METRIC_ACTIVE_CLIENTS, -1);
+    aesd_log(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    // Completes the pending recv and poll requests, the descriptor is closed once they are reaped
+    shutdown(conn->client_fd, SHUT_RDWR);
+    maybe_free_connection(e, conn);
+}
+
+// Runs on the group commit writer thread, hands the request back to its engine
+static void commit_completed(commit_request *request)
+{
+    uring_engine *e = ((uring_conn *)request->context)->owner;
+    uint64_t notify = 1;
+
+    pthread_mutex_lock(&e->completed_lock);
+    STAILQ_INSERT_TAIL(&e->completed, request, entry);
+    pthread_mutex_unlock(&e->completed_lock);
+    if (write(e->notify_fd, &notify, sizeof(notify)) == -1)
+    {
+        aesd_log(LOG_ERR, "Failed to notify io_uring engine of a commit: %s", strerror(errno));
+    }
+}
+
+static int store_packet(uring_conn *conn, const line_packet *packet)
+{
+    int status = 0;
+
+    if (server_config.incremental_replay && packet->spill_len == 0 && handle_cursor_command(packet->data, packet->len, &conn->cursor))
+    {
+        conn->stored = true;
+        return 0;
+    }
+    if (packet->spill_len == 0)
+    {
+        status = handle_seek_command(conn->file_fd, packet->data, packet->len, &conn->cursor);
+    }
+    if (status == 0 && commit_enabled())
+    {
+        // The packet stays in the framer buffer until the writer calls commit_completed()
+        commit_request_init(&conn->commit, packet->data, packet->len);
+        conn->commit.spill_fd = packet->spill_fd;
+        conn->commit.spill_len = packet->spill_len;
+        conn->commit.on_complete = commit_completed;
+        conn->commit.context = conn;
+        conn->commit_pending = true;
+        conn->owner->pending_commits++;
+        commit_submit(&conn->commit);
+        return 0;
+    }
+    if (status == 0)
+    {
+        status = write_framed_packet(conn->file_fd, packet);
+    }
+    conn->stored = status != -1;
+    return status;
+}
+
+// Stores the packets in the data received so far, or only the next one in keep-alive mode
+static conn_status receive_packets(uring_engine *e, uring_conn *conn)
+{
+    line_packet packet;
+
+    while (true)
+    {
+        if (conn->commit_pending)
+        {
+            return CONN_AGAIN;
+        }
+        if (conn->stored && server_config.keep_alive)
+        {
+            return CONN_DONE;
+        }
+        if (framer_next(&conn->framer, &packet) == FRAME_PACKET)
+        {
+            if (store_packet(conn, &packet) == -1)
+            {
+                return CONN_CLOSE;
+            }
+            continue;
+        }
+        if (conn->held_head != -1)
+        {
+            int bid = conn->held_head;
+            ssize_t taken = framer_append(&conn->framer, e->buffer_memory + (size_t)bid * URING_BUFFER_SIZE + e->held_pos[bid],
+                                          e->held_len[bid] - e->held_pos[bid]);
+            if (taken == -1)
+            {
+                return CONN_CLOSE;
+            }
+            e->held_pos[bid] += taken;
+            if (e->held_pos[bid] == e->held_len[bid])
+            {
+                conn->held_head = e->held_next[bid];
+                if (conn->held_head == -1)
+                {
+                    conn->held_tail = -1;
+                }
+                conn->held_count--;
+                recycle_buffer(e, bid);
+            }
+            continue;
+        }
+        if (conn->peer_closed)
+        {
+            // Peer finished sending, store whatever was received like the threaded server does
+            if (framer_flush(&conn->framer, &packet) == FRAME_PACKET)
+            {
+                if (store_packet(conn, &packet) == -1)
+                {
+                    return CONN_CLOSE;
+                }
+                continue;
+            }
+            return conn->stored ? CONN_DONE : CONN_CLOSE;
+        }
+        return conn->stored ? CONN_DONE : CONN_AGAIN;
+    }
+}
+
+static void start_replay(uring_conn *conn)
+{
+    conn->replay_offset = conn->cursor;
+    conn->replay.end = storage_replay_end();
+    conn->replaying = true;
+    conn->replay_start_usec = metrics_now_usec();
+    conn->stored = false;
+    aesd_log(LOG_DEBUG, "Sending back the received data to client");
+}
+
+static conn_status replay_to_client(uring_conn *conn)
+{
+    // Reads stop at the end snapshotted in start_replay()
+    replay_status status = storage_replay(conn->client_fd, conn->file_fd, &conn->replay_offset, &conn->replay);
+
+    if (status == REPLAY_AGAIN)
+    {
+        return CONN_AGAIN;
+    }
+    return status == REPLAY_DONE ? CONN_DONE : CONN_CLOSE;
+}
+
+static void process_connection(uring_engine *e, uring_conn *conn)
+{
+    conn_status status = CONN_DONE;
+
+    // The connection resumes from drain_completed()
+    if (conn->closing || conn->commit_pending)
+    {
+        return;
+    }
+    conn->last_active_ms = monotonic_ms();
+    TAILQ_REMOVE(&e->connections, conn, entry);
+    TAILQ_INSERT_TAIL(&e->connections, conn, entry);
+
+    while (status == CONN_DONE)
+    {
+        if (conn->replaying)
+        {
+            status = replay_to_client(conn);
+            if (status == CONN_AGAIN)
+            {
+                arm_poll_out(e, conn);
+                break;
+            }
+            if (status != CONN_DONE)
+            {
+                break;
+            }
+            conn->replaying = false;
+            metrics_observe_since(METRIC_REPLAY_LATENCY, conn->replay_start_usec);
+            // The next incremental replay starts where this one ended, otherwise at the beginning
+            conn->cursor = server_config.incremental_replay ? conn->replay_offset : 0;
+            if (!server_config.keep_alive || e->stopping)
+            {
+                status = CONN_CLOSE;
+                break;
+            }
+        }
+        status = receive_packets(e, conn);
+        if (status == CONN_DONE)
+        {
+            start_replay(conn);
+        }
+    }
+    if (status == CONN_CLOSE)
+    {
+        close_connection(e, conn);
+        return;
+    }
+    if (!conn->recv_armed && !conn->peer_closed && !conn->starved && conn->held_count < URING_HELD_LIMIT)
+    {
+        arm_recv(e, conn);
+    }
+}
+
+static void handle_accept(uring_engine *e, int res, unsigned flags)
+{
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size = sizeof(client_addr);
+
+    if (!(flags & IORING_CQE_F_MORE) && !e->stopping)
+    {
+        arm_accept(e);
+    }
+    if (res < 0)
+    {
+        if (res != -EAGAIN && res != -EINTR && res != -ECONNABORTED)
+        {
+            aesd_log(LOG_ERR, "Error occurred during accept operation: %s", strerror(-res));
+        }
+        return;
+    }
+    // Accepted before the cancellation took effect, still served within the drain timeout
+    uring_conn *conn = object_pool_get(&e->conn_pool);
+    if (conn == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate memory for connection state");
+        close(res);
+        return;
+    }
+    conn->client_fd = res;
+    conn->owner = e;
+    conn->held_head = -1;
+    conn->held_tail = -1;
+    framer_init(&conn->framer);
+    replay_state_init(&conn->replay);
+    if (getpeername(res, (struct sockaddr *)&client_addr, &client_addr_size) == 0)
+    {
+        if (client_addr.ss_family == AF_INET)
+        {
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&client_addr)->sin_addr, conn->client_ip, sizeof(conn->client_ip));
+        }
+        else if (client_addr.ss_family == AF_INET6)
+        {
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&client_addr)->sin6_addr, conn->client_ip, sizeof(conn->client_ip));
+        }
+    }
+    // The driver is opened once per client, the file backend shares one descriptor
+    if (storage_attach(&conn->file_fd) == -1)
+    {
+        close(res);
+        object_pool_put(&e->conn_pool, conn);
+        return;
+    }
+    conn->last_active_ms = monotonic_ms();
+    TAILQ_INSERT_TAIL(&e->connections, conn, entry);
+    metrics_count(METRIC_CONNECTIONS_ACCEPTED, 1);
+    metrics_gauge_add(METRIC_ACTIVE_CLIENTS, 1);
+    aesd_log(LOG_INFO, "Accepted connection from %s", conn->client_ip);
+    arm_recv(e, conn);
+}
+
+static void handle_recv(uring_engine *e, uring_conn *conn, int res, unsigned flags)
+{
+    if (!(flags & IORING_CQE_F_MORE))
+    {
+        conn->recv_armed = false;
+        conn->recv_cancelling = false;
+        conn->inflight--;
+    }
+    if (flags & IORING_CQE_F_BUFFER)
+    {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        e->buffers_free--;
+        if (res <= 0 || conn->closing)
+        {
+            recycle_buffer(e, bid);
+        }
+        else
+        {
+            metrics_count(METRIC_RECEIVED_BYTES, res);
+            e->held_len[bid] = res;
+            e->held_pos[bid] = 0;
+            e->held_next[bid] = -1;
+            if (conn->held_tail == -1)
+            {
+                conn->held_head = bid;
+            }
+            else
+            {
+                e->held_next[conn->held_tail] = bid;
+            }
+            conn->held_tail = bid;
+            conn->held_count++;
+        }
+    }
+    if (conn->closing)
+    {
+        maybe_free_connection(e, conn);
+        return;
+    }
+
+    if (res == 0)
+    {
+        conn->peer_closed = true;
+    }
+    else if (res == -ENOBUFS)
+    {
+        // Re-armed by rearm_starved() once buffers are recycled
+        conn->starved = true;
+        LIST_INSERT_HEAD(&e->starved, conn, starved_entry);
+    }
+    else if (res == -EINVAL && !e->single_shot_recv)
+    {
+        aesd_log(LOG_WARNING, "Kernel does not support multishot recv, re-arming recv per completion");
+        e->single_shot_recv = true;
+    }
+    else if (res < 0 && res != -ECANCELED && res != -EINTR && res != -EAGAIN)
+    {
+        aesd_log(LOG_ERR, "Receive from %s failed: %s", conn->client_ip, strerror(-res));
+        close_connection(e, conn);
+        return;
+    }
+
+    // A client that sends faster than it is answered stops receiving instead of draining the buffer ring
+    if (conn->recv_armed && !conn->recv_cancelling && conn->held_count >= URING_HELD_LIMIT)
+    {
+        cancel_recv(e, conn);
+    }
+    process_connection(e, conn);
+}
+
+static void rearm_starved(uring_engine *e)
+{
+    uring_conn *conn;
+
+    while (e->buffers_free > 0 && (conn = LIST_FIRST(&e->starved)) != NULL)
+    {
+        LIST_REMOVE(conn, starved_entry);
+        conn->starved = false;
+        process_connection(e, conn);
+    }
+}
+
+// Picks up requests made durable by the writer and resumes their connections
+static void drain_completed(uring_engine *e)
+{
+    struct UringCompletedList completed;
+    commit_request *request;
+
+    pthread_mutex_lock(&e->completed_lock);
+    STAILQ_INIT(&completed);
+    STAILQ_CONCAT(&completed, &e->completed);
+    pthread_mutex_unlock(&e->completed_lock);
+
+    while (!STAILQ_EMPTY(&completed))
+    {
+        request = STAILQ_FIRST(&completed);
+        STAILQ_REMOVE_HEAD(&completed, entry);
+        uring_conn *conn = (uring_conn *)request->context;
+        conn->commit_pending = false;
+        e->pending_commits--;
+        if (conn->closing)
+        {
+            maybe_free_connection(e, conn);
+            continue;
+        }
+        if (request->status == -1)
+        {
+            aesd_log(LOG_ERR, "Writing received data to the socketdata file failed");
+            close_connection(e, conn);
+            continue;
+        }
+        conn->stored = true;
+        process_connection(e, conn);
+    }
+}
+
+static void expire_idle_connections(uring_engine *e)
+{
+    long now = monotonic_ms();
+    uring_conn *conn;
+
+    while ((conn = TAILQ_FIRST(&e->connections)) != NULL && now - conn->last_active_ms >= server_config.idle_timeout_ms)
+    {
+        if (conn->commit_pending)
+        {
+            // Still referenced by the writer, check again after the commit
+            conn->last_active_ms = now;
+            TAILQ_REMOVE(&e->connections, conn, entry);
+            TAILQ_INSERT_TAIL(&e->connections, conn, entry);
+            continue;
+        }
+        aesd_log(LOG_INFO, "Connection from %s idle for %ld ms", conn->client_ip, now - conn->last_active_ms);
+        close_connection(e, conn);
+    }
+}
+
+// A keep-alive connection between two requests, nothing is lost by closing it
+static bool connection_idle(const uring_conn *conn)
+{
+    return server_config.keep_alive && !conn->replaying && !conn->commit_pending && !conn->stored &&
+           conn->held_count == 0 && !framer_has_partial(&conn->framer);
+}
+
+// Stops accepting and closes the idle connections, the others finish their request first
+static void start_drain(uring_engine *e)
+{
+    uring_conn *conn, *next;
+
+    e->stopping = true;
+    e->drain_deadline_ms = monotonic_ms() + server_config.drain_timeout_ms;
+    // Pending connections stay in the backlog, for a server that took the listener over
+    cancel_request(e, IORING_OP_ASYNC_CANCEL, user_data(NULL, URING_OP_ACCEPT));
+    // The idle timeout is armed again for the drain deadline
+    if (e->timeout_armed)
+    {
+        cancel_request(e, IORING_OP_TIMEOUT_REMOVE, user_data(NULL, URING_OP_TIMEOUT));
+    }
+    for (conn = TAILQ_FIRST(&e->connections); conn != NULL; conn = next)
+    {
+        next = TAILQ_NEXT(conn, entry);
+        if (connection_idle(conn))
+        {
+            close_connection(e, conn);
+        }
+    }
+}
+
+static void handle_completion(uring_engine *e, const struct io_uring_cqe *cqe)
+{
+    uring_op op = (uring_op)(cqe->user_data & URING_OP_MASK);
+    uring_conn *conn = (uring_conn *)(uintptr_t)(cqe->user_data & ~URING_OP_MASK);
+
+    switch (op)
+    {
+    case URING_OP_ACCEPT:
+        handle_accept(e, cqe->res, cqe->flags);
+        break;
+    case URING_OP_RECV:
+        handle_recv(e, conn, cqe->res, cqe->flags);
+        break;
+    case URING_OP_POLL_OUT:
+        conn->inflight--;
+        if (conn->closing)
+        {
+            maybe_free_connection(e, conn);
+        }
+        else
+        {
+            process_connection(e, conn);
+        }
+        break;
+    case URING_OP_NOTIFY:
+        drain_completed(e);
+        arm_notify(e);
+        break;
+    case URING_OP_STOP:
+        start_drain(e);
+        break;
+    case URING_OP_TIMEOUT:
+        e->timeout_armed = false;
+        if (server_config.keep_alive)
+        {
+            expire_idle_connections(e);
+        }
+        break;
+    case URING_OP_TIMESTAMP:
+        timestamp_timer_expired(e->timer_fd);
+        arm_timestamp(e);
+        break;
+    case URING_OP_IGNORE:
+        break;
+    }
+}
+
+static void *uring_thread(void *args)
+{
+    uring_engine *e = (uring_engine *)args;
+    bool closing_all = false;
+
+    arm_accept(e);
+    arm_notify(e);
+    arm_stop(e);
+    arm_timestamp(e);
+
+    while (true)
+    {
+        unsigned head = *e->ring.cq_head;
+        unsigned tail = __atomic_load_n(e->ring.cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != tail; head++)
+        {
+            handle_completion(e, &e->ring.cqes[head & e->ring.cq_mask]);
+        }
+        __atomic_store_n(e->ring.cq_head, head, __ATOMIC_RELEASE);
+        rearm_starved(e);
+
+        if (e->stopping && !closing_all && (TAILQ_EMPTY(&e->connections) || monotonic_ms() >= e->drain_deadline_ms))
+        {
+            if (!TAILQ_EMPTY(&e->connections))
+            {
+                aesd_log(LOG_WARNING, "Drain timeout expired, closing the remaining connections");
+            }
+            closing_all = true;
+        }
+        // Also catches a connection accepted just before the cancellation
+        while (closing_all && !TAILQ_EMPTY(&e->connections))
+        {
+            close_connection(e, TAILQ_FIRST(&e->connections));
+        }
+        // The writer and the kernel still reference closed connections until their last completion
+        if (closing_all && e->closing_count == 0 && e->pending_commits == 0)
+        {
+            break;
+        }
+        arm_idle_timeout(e);
+        if (uring_enter(&e->ring, 1) == -1 && errno != EINTR && errno != EAGAIN && errno != EBUSY)
+        {
+            aesd_log(LOG_ERR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @return 0 on success, 1 when the kernel lacks the required io_uring support, -1 on error
+ */
+static int setup_engine(uring_engine *e, int socket_fd, int timer_fd)
+{
+    e->listen_fd = socket_fd;
+    e->stop_fd = lifecycle_stop_fd();
+    e->timer_fd = timer_fd;
+    TAILQ_INIT(&e->connections);
+    LIST_INIT(&e->starved);
+    STAILQ_INIT(&e->completed);
+    pthread_mutex_init(&e->completed_lock, NULL);
+    object_pool_init(&e->conn_pool, sizeof(uring_conn), URING_CACHED_CONNECTIONS);
+
+    if (queue_init(&e->ring) == -1)
+    {
+        aesd_log(LOG_WARNING, "io_uring_setup failed: %s", strerror(errno));
+        pthread_mutex_destroy(&e->completed_lock);
+        return 1;
+    }
+    if (setup_buffers(e) == -1)
+    {
+        aesd_log(LOG_WARNING, "Registering provided buffers failed: %s", strerror(errno));
+        queue_exit(&e->ring);
+        pthread_mutex_destroy(&e->completed_lock);
+        return 1;
+    }
+    e->notify_fd = eventfd(0, EFD_CLOEXEC);
+    if (e->notify_fd == -1)
+    {
+        aesd_log(LOG_ERR, "eventfd failed: %s", strerror(errno));
+        free(e->buffer_memory);
+        munmap(e->buffers, e->buffers_len);
+        queue_exit(&e->ring);
+        pthread_mutex_destroy(&e->completed_lock);
+        return -1;
+    }
+    return 0;
+}
+
+static void cleanup_engine(uring_engine *e)
+{
+    // Closing the ring cancels the multishot accept and unregisters the buffers
+    queue_exit(&e->ring);
+    free(e->buffer_memory);
+    munmap(e->buffers, e->buffers_len);
+    close(e->notify_fd);
+    pthread_mutex_destroy(&e->completed_lock);
+    object_pool_destroy(&e->conn_pool);
+}
+
+int run_uring_server(const int *listen_fds, int listen_count)
+{
+    sigset_t block_mask, orig_mask;
+    int started = 0;
+    int status = 0;
+    int timer_fd;
+    int flags;
+    uring_engine *engines;
+
+    for (int i = 0; i < listen_count; i++)
+    {
+        flags = fcntl(listen_fds[i], F_GETFL, 0);
+        if (flags == -1 || fcntl(listen_fds[i], F_SETFL, flags | O_NONBLOCK) == -1)
+        {
+            aesd_log(LOG_ERR, "Failed to make listening socket non-blocking: %s", strerror(errno));
+            return -1;
+        }
+    }
+
+    engines = calloc(server_config.worker_threads, sizeof(uring_engine));
+    if (engines == NULL)
+    {
+        aesd_log(LOG_ERR, "Failed to allocate memory for io_uring engines");
+        return -1;
+    }
+    timer_fd = timestamp_timer_open();
+
+    // Engines block the signals so their system calls are not interrupted, the stop pipe wakes them
+    sigemptyset(&block_mask);
+    sigaddset(&block_mask, SIGINT);
+    sigaddset(&block_mask, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &block_mask, &orig_mask);
+
+    for (started = 0; started < server_config.worker_threads; started++)
+    {
+        // One engine stores the timestamps, alongside its clients' packets
+        status = setup_engine(&engines[started], listen_fds[started % listen_count], started == 0 ? timer_fd : -1);
+        if (status != 0)
+        {
+            break;
+        }
+        int err = pthread_create(&engines[started].thread_id, NULL, uring_thread, &engines[started]);
+        if (err != 0)
+        {
+            aesd_log(LOG_ERR, "Error creating io_uring engine thread: %s", strerror(err));
+            cleanup_engine(&engines[started]);
+            break;
+        }
+        if (server_config.reuse_port)
+        {
+            bind_thread_to_cpu(engines[started].thread_id, started);
+        }
+    }
+    pthread_sigmask(SIG_SETMASK, &orig_mask, NULL);
+
+    // The engines drain their clients by themselves once a stop is requested
+    if (started > 0)
+    {
+        aesd_log(LOG_INFO, "Started %d io_uring engine threads", started);
+        lifecycle_wait_for_stop();
+        lifecycle_log_stop();
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(engines[i].thread_id, NULL);
+        cleanup_engine(&engines[i]);
+    }
+    free(engines);
+    if (timer_fd != -1)
+    {
+        close(timer_fd);
+    }
+    if (started == 0)
+    {
+        // Nothing was served yet, the caller can still fall back to the epoll reactor
+        return status == 1 ? 1 : -1;
+    }
+    return 0;
+}
+
+#else /* !IORING_RECV_MULTISHOT */
+
+int run_uring_server(const int *listen_fds, int listen_count)
+{
+    (void)listen_fds;
+    (void)listen_count;
+    aesd_log(LOG_WARNING, "aesdsocket was built without io_uring support");
+    return 1;
+}
+
+#endif /* IORING_RECV_MULTISHOT */
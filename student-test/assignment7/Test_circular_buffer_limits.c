@@ -0,0 +1,157 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Tests for the configurable capacity and byte budget of the circular buffer: moving a full,
+* wrapped ring to larger or smaller storage the way the driver resizes it, and dropping the
+* oldest writes once the byte budget is exceeded.
+*/
+
+static const char *writes[] = {
+    "write0\n", "write1\n", "write2\n", "write3\n", "write4\n", "write5\n", "write6\n",
+    "write7\n", "write8\n", "write9\n", "write10\n", "write11\n", "write12\n", "write13\n",
+    "write14\n", "write15\n", "write16\n", "write17\n", "write18\n", "write19\n",
+};
+
+static const char *add_write(struct aesd_circular_buffer *buffer, const char *text)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = text;
+    entry.size = strlen(text);
+    return aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* Checks that buffer holds writes[first] to writes[last] in order, looked up by position
+*/
+static void verify_contents(struct aesd_circular_buffer *buffer, int first, int last)
+{
+    size_t position = 0;
+    size_t entry_offset;
+
+    TEST_ASSERT_EQUAL_UINT32_MESSAGE(last - first + 1, aesd_circular_buffer_count(buffer),
+                                     "Wrong number of stored entries");
+    for (int index = first; index <= last; index++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, position, &entry_offset);
+        TEST_ASSERT_NOT_NULL_MESSAGE(entry, "No entry at the start of a stored write");
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[index], entry->buffptr, "Stored writes are out of order");
+        TEST_ASSERT_EQUAL_INT_MESSAGE(0, entry_offset, "Entry start is not at offset 0 of the entry");
+        position += strlen(writes[index]);
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(position, buffer->total_size, "total_size does not match the stored writes");
+}
+
+void test_circular_buffer_grow_full_wrapped_ring(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry *entries = calloc(16, sizeof(struct aesd_buffer_entry));
+    struct aesd_buffer_entry *previous;
+
+    TEST_ASSERT_NOT_NULL(entries);
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < 13; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "Ring should be full before growing");
+    TEST_ASSERT_NOT_EQUAL_MESSAGE(0, buffer.out_offs, "Ring should have wrapped before growing");
+
+    previous = aesd_circular_buffer_set_storage(&buffer, entries, 16);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(buffer.default_entry, previous, "Growing should hand back the default storage");
+    TEST_ASSERT_EQUAL_UINT32(16, buffer.capacity);
+    TEST_ASSERT_FALSE_MESSAGE(buffer.full, "A grown ring has free entries");
+    verify_contents(&buffer, 3, 12);
+
+    // The free entries are used before anything is dropped
+    for (int index = 13; index < 19; index++) {
+        TEST_ASSERT_NULL_MESSAGE(add_write(&buffer, writes[index]), "Grown ring dropped a write before it was full");
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_contents(&buffer, 3, 18);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[3], add_write(&buffer, writes[19]), "Full grown ring should drop its oldest write");
+    verify_contents(&buffer, 4, 19);
+    free(entries);
+}
+
+void test_circular_buffer_shrink_full_wrapped_ring(void)
+{
+    struct aesd_circular_buffer buffer;
+    struct aesd_buffer_entry entries[4];
+    const char *removed;
+    int expected = 3;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < 13; index++) {
+        add_write(&buffer, writes[index]);
+    }
+
+    // Like the driver, drop the oldest writes that do not fit before moving the others
+    while ((removed = aesd_circular_buffer_remove_over_limit(&buffer, 4, 0)) != NULL) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[expected], removed, "Shrinking should drop the oldest writes first");
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(9, expected, "Shrinking to 4 entries should drop 6 writes");
+    aesd_circular_buffer_set_storage(&buffer, entries, 4);
+    TEST_ASSERT_TRUE_MESSAGE(buffer.full, "Ring shrunk to its number of writes should be full");
+    TEST_ASSERT_EQUAL_UINT32(0, buffer.in_offs);
+    verify_contents(&buffer, 9, 12);
+
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[9], add_write(&buffer, writes[13]), "Shrunk ring should drop its oldest write");
+    verify_contents(&buffer, 10, 13);
+}
+
+void test_circular_buffer_remove_oldest(void)
+{
+    struct aesd_circular_buffer buffer;
+    uint32_t slot;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_oldest(&buffer), "Empty ring has nothing to remove");
+    for (int index = 0; index < 12; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    slot = buffer.out_offs;
+    TEST_ASSERT_EQUAL_PTR(writes[2], aesd_circular_buffer_remove_oldest(&buffer));
+    TEST_ASSERT_FALSE_MESSAGE(buffer.full, "Ring is not full after a removal");
+    TEST_ASSERT_NULL_MESSAGE(buffer.entry[slot].buffptr, "Removed entry should be cleared");
+    TEST_ASSERT_EQUAL_INT(0, buffer.entry[slot].size);
+    verify_contents(&buffer, 3, 11);
+
+    // The freed entry takes the next write without dropping another one
+    TEST_ASSERT_NULL(add_write(&buffer, writes[12]));
+    verify_contents(&buffer, 3, 12);
+}
+
+void test_circular_buffer_byte_limit_eviction(void)
+{
+    struct aesd_circular_buffer buffer;
+    const char *removed;
+    int expected = 0;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < 5; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_over_limit(&buffer, buffer.capacity, 0),
+                             "A byte limit of 0 should keep every write");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_remove_over_limit(&buffer, buffer.capacity, buffer.total_size),
+                             "A ring exactly at its byte limit should keep every write");
+
+    // 5 writes of 7 bytes, 3 of them fit in 21 bytes
+    while ((removed = aesd_circular_buffer_remove_over_limit(&buffer, buffer.capacity, 21)) != NULL) {
+        TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[expected], removed, "Byte limit should drop the oldest writes first");
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT(2, expected);
+    verify_contents(&buffer, 2, 4);
+
+    // A write larger than the limit is kept alone
+    add_write(&buffer, writes[10]);
+    while ((removed = aesd_circular_buffer_remove_over_limit(&buffer, buffer.capacity, 5)) != NULL) {
+        expected++;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(5, expected, "Only the newest write should be left");
+    verify_contents(&buffer, 10, 10);
+}
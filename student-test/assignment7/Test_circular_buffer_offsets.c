@@ -0,0 +1,157 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Tests for the running offsets of the circular buffer: entry starts, the cached total_size and
+* the binary search of aesd_circular_buffer_find_entry_offset_for_fpos() at entry boundaries,
+* after wraparound and removals, and past the end of the stored writes.
+*/
+
+// Writes of different sizes, so a lookup landing in the wrong entry shows up
+static const char *writes[] = {
+    "a\n", "bb\n", "ccc\n", "dddd\n", "eeeee\n", "ffffff\n", "g\n", "hh\n",
+    "iii\n", "jjjj\n", "kkkkk\n", "llllll\n", "m\n", "nn\n", "ooo\n",
+};
+
+static void add_write(struct aesd_circular_buffer *buffer, const char *text)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = text;
+    entry.size = strlen(text);
+    aesd_circular_buffer_add_entry(buffer, &entry);
+}
+
+/**
+* Looks up every position of writes[first] to writes[last], which buffer is expected to hold
+* in order, and checks the positions just past the end
+*/
+static void verify_every_position(struct aesd_circular_buffer *buffer, int first, int last)
+{
+    size_t position = 0;
+    size_t entry_offset;
+    struct aesd_buffer_entry *entry;
+
+    for (int index = first; index <= last; index++) {
+        size_t size = strlen(writes[index]);
+        TEST_ASSERT_EQUAL_INT_MESSAGE(position, aesd_circular_buffer_entry_start(buffer, index - first),
+                                      "Entry start does not match the sizes of the older writes");
+        for (size_t byte = 0; byte < size; byte++) {
+            entry = aesd_circular_buffer_find_entry_offset_for_fpos(buffer, position + byte, &entry_offset);
+            TEST_ASSERT_NOT_NULL_MESSAGE(entry, "No entry for a stored position");
+            TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[index], entry->buffptr, "Position found in the wrong entry");
+            TEST_ASSERT_EQUAL_INT_MESSAGE(byte, entry_offset, "Wrong byte within the entry");
+        }
+        position += size;
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(position, buffer->total_size, "total_size does not match the stored writes");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, position, &entry_offset),
+                             "The position right after the last byte should not be found");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, position + 100, &entry_offset),
+                             "A position past the end should not be found");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(buffer, SIZE_MAX, &entry_offset),
+                             "SIZE_MAX should not be found");
+}
+
+void test_circular_buffer_offsets_empty(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    TEST_ASSERT_EQUAL_INT(0, buffer.total_size);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset),
+                             "An empty buffer has no position 0");
+}
+
+void test_circular_buffer_offsets_entry_boundaries(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t entry_offset;
+    struct aesd_buffer_entry *entry;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < 4; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    // "a\n" "bb\n" "ccc\n" "dddd\n" start at 0, 2, 5 and 9
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 1, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[0], entry->buffptr, "Last byte of the first entry");
+    TEST_ASSERT_EQUAL_INT(1, entry_offset);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 2, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[1], entry->buffptr, "First byte of the second entry");
+    TEST_ASSERT_EQUAL_INT(0, entry_offset);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 8, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[2], entry->buffptr, "Last byte of the third entry");
+    TEST_ASSERT_EQUAL_INT(3, entry_offset);
+    entry = aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 9, &entry_offset);
+    TEST_ASSERT_EQUAL_PTR_MESSAGE(writes[3], entry->buffptr, "First byte of the last entry");
+    TEST_ASSERT_EQUAL_INT(0, entry_offset);
+    verify_every_position(&buffer, 0, 3);
+}
+
+void test_circular_buffer_offsets_full_buffer(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_TRUE(buffer.full);
+    verify_every_position(&buffer, 0, AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1);
+}
+
+void test_circular_buffer_offsets_after_wraparound(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    // 15 writes into 10 entries, the oldest is writes[5] at entry 5
+    for (int index = 0; index < 15; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_EQUAL_UINT32(5, buffer.out_offs);
+    verify_every_position(&buffer, 5, 14);
+}
+
+void test_circular_buffer_offsets_after_remove_oldest(void)
+{
+    struct aesd_circular_buffer buffer;
+    size_t entry_offset;
+
+    aesd_circular_buffer_init(&buffer);
+    for (int index = 0; index < 13; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_EQUAL_PTR(writes[3], aesd_circular_buffer_remove_oldest(&buffer));
+    TEST_ASSERT_EQUAL_PTR(writes[4], aesd_circular_buffer_remove_oldest(&buffer));
+    // Positions are relative to the new oldest write
+    verify_every_position(&buffer, 5, 12);
+
+    add_write(&buffer, writes[13]);
+    add_write(&buffer, writes[14]);
+    verify_every_position(&buffer, 5, 14);
+
+    while (aesd_circular_buffer_remove_oldest(&buffer) != NULL) {
+    }
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, buffer.total_size, "Removing every write should leave total_size at 0");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&buffer, 0, &entry_offset),
+                             "An emptied buffer has no position 0");
+}
+
+void test_circular_buffer_offsets_running_sum_wraps(void)
+{
+    struct aesd_circular_buffer buffer;
+
+    aesd_circular_buffer_init(&buffer);
+    // The running sum of sizes wraps around after the first few writes
+    buffer.added_size = SIZE_MAX - 10;
+    for (int index = 0; index < 12; index++) {
+        add_write(&buffer, writes[index]);
+    }
+    TEST_ASSERT_TRUE_MESSAGE(buffer.added_size < 100, "added_size should have wrapped around");
+    verify_every_position(&buffer, 2, 11);
+}